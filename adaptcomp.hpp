@@ -0,0 +1,348 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  This file implements a comp that decides at runtime whether its stages are computed fused (as ff_comp does, every task
+ *  goes through all of them on the thread of the node) or pipelined (the stages are split into segments, the first one is
+ *  computed by the node and the others by helper threads connected by queues).
+ *  ff_adaptive_comp measures the service time of every stage and how long the node waits for its next task, once per
+ *  window of tasks it decides:
+ *    fused -> pipelined   the node is the bottleneck (it rarely waits for a task) and the best split of the stages into
+ *                         at most max_threads segments lowers the time per task even paying the handoff of a task
+ *                         between threads
+ *    pipelined -> fused   the tasks arrive slower than the fused stages would compute them, or the split no longer pays
+ *  The mode (and the split) changes only at safe points: when every task in flight has been sent out, so the results
+ *  always leave the node in the order of the tasks.
+ *  NOTE: the stages can't send out tasks with ff_send_out (a single result per task, GO_ON/EOS results are dropped), their
+ *  svc_init/svc_end are called on the thread of the node while svc may be called on a helper thread.
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_ADAPTCOMP_HPP
+#define FF_ADAPTCOMP_HPP
+
+#include "comp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ff {
+
+    enum comp_exec_mode { COMP_FUSED, COMP_PIPELINED };
+
+    class ff_adaptive_comp: public ff_node {
+
+    public:
+        // a decision of the node: from the task-th task on the stages run in mode, split into segments (1 when fused),
+        // and the samples of the window it has been taken from (service time of all the stages, wait for a task, in us)
+        struct switch_event {
+            size_t task;
+            comp_exec_mode mode;
+            size_t segments;
+            double service_us, wait_us;
+        };
+
+    private:
+        // blocking queue between two segments
+        struct channel {
+            std::mutex lock;
+            std::condition_variable cv;
+            std::deque<void *> tasks;
+            bool stop;
+            channel() : stop(false) { }
+            void push(void *t) {
+                {
+                    std::lock_guard<std::mutex> l(lock);
+                    tasks.push_back(t);
+                }
+                cv.notify_one();
+            }
+        };
+        struct stage_time {
+            std::atomic<unsigned long long> ns, calls;
+            unsigned long long last_ns, last_calls; // at the previous decision (node thread)
+            stage_time() : ns(0), calls(0), last_ns(0), last_calls(0) { }
+        };
+        std::vector<ff_node *> stages;
+        std::unique_ptr<stage_time[]> times;
+        std::vector<size_t> bounds;                       // segment s computes the stages [bounds[s], bounds[s+1])
+        std::vector<std::unique_ptr<channel> > inputs;    // inputs[h] feeds the segment h+1 (helper h)
+        channel results;                                  // results of the last segment
+        std::vector<std::thread> helpers;
+        const size_t max_threads;
+        size_t window, capacity, in_flight, tasks, window_tasks;
+        double overhead_us;
+        comp_exec_mode mode;
+        bool adaptive;
+        double wait_ns;                                   // waited for the tasks of the window
+        double time_elapsed;
+        std::chrono::steady_clock::time_point last_out;
+        std::vector<switch_event> events;
+
+        void *run_segment(size_t s, void *task);
+        void helper(size_t h);
+        void flush(bool wait);
+        void drain();
+        void decide();
+        double split(const std::vector<double>& us, size_t segments, std::vector<size_t>& out) const;
+        double cost(const std::vector<double>& us, const std::vector<size_t>& b) const;
+        void reconfigure(comp_exec_mode m, const std::vector<size_t>& b, double service_us, double wait_us);
+
+    protected:
+        void *svc(void *task);
+        int svc_init();
+        void svc_end();
+        void eosnotify(ssize_t id=-1);
+
+    public:
+         // the stages are split into at most max_threads segments (the node and max_threads-1 helpers)
+        explicit ff_adaptive_comp(size_t max_threads=2);
+        ~ff_adaptive_comp() { if (!helpers.empty()) svc_end(); }
+        int add_stage(ff_node *stage);
+         // tasks between two decisions, default 256
+        void set_window(size_t n) { window = n ? n : 1; }
+         // cost of handing a task to another thread (us), stages finer than it are never split, default 5us
+        void set_overhead(double us) { overhead_us = us; }
+         // tasks into the segments before svc waits for a result, default 16 per segment
+        void set_capacity(size_t n) { capacity = n ? n : 1; }
+         // fixed mode, the stages are split evenly by their number when pipelined (no adaption)
+        void set_mode(comp_exec_mode m) { mode = m; adaptive = false; }
+        comp_exec_mode get_mode() const { return mode; }
+        size_t get_segments() const { return bounds.size()-1; }
+        const std::vector<switch_event>& get_switches() const { return events; }
+        double ff_time() { return time_elapsed; } // Returns total run time (into svc and draining at the end of the stream)
+         // mean service time of a stage since svc_init (us)
+        double get_service_time(size_t stage) const {
+            const unsigned long long c = times[stage].calls;
+            return c ? times[stage].ns / 1e3 / c : 0;
+        }
+
+    };
+
+    inline ff_adaptive_comp::ff_adaptive_comp(size_t max_threads) :
+        max_threads(max_threads ? max_threads : 1), window(256), capacity(16*this->max_threads), in_flight(0), tasks(0),
+        window_tasks(0), overhead_us(5), mode(COMP_FUSED), adaptive(true), wait_ns(0), time_elapsed(0) { }
+
+    inline int ff_adaptive_comp::add_stage(ff_node *stage) {
+        if (!stage) return -1;
+        stages.push_back(stage);
+        return 0;
+    }
+
+    inline void *ff_adaptive_comp::run_segment(size_t s, void *task) {
+        for (size_t i=bounds[s]; i<bounds[s+1]; ++i) {
+            const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            task = stages[i]->svc(task);
+            times[i].ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count();
+            times[i].calls++;
+            if (comp_stop(task)) break; // the remaining stages have nothing to compute
+        }
+        return task;
+    }
+
+    // helper h computes the segment h+1, it blocks on its input queue when it has no tasks
+    inline void ff_adaptive_comp::helper(size_t h) {
+        channel& in = *inputs[h];
+        for (;;) {
+            void *task;
+            {
+                std::unique_lock<std::mutex> l(in.lock);
+                in.cv.wait(l, [&] { return in.stop || !in.tasks.empty(); });
+                if (in.tasks.empty()) return; // stopping
+                task = in.tasks.front();
+                in.tasks.pop_front();
+            }
+            // the split can change only while no task is in flight, the queue lock orders it before this read
+            const size_t s = h+1, last = bounds.size()-1;
+            if (comp_stop(task) || s >= last) { results.push(task); continue; }
+            task = run_segment(s, task);
+            if (comp_stop(task) || s+1 == last) results.push(task);
+            else inputs[h+1]->push(task);
+        }
+    }
+
+    // sends out the results of the last segment (every task goes through the same queues, they are in order)
+    inline void ff_adaptive_comp::flush(bool wait) {
+        std::deque<void *> out;
+        {
+            std::unique_lock<std::mutex> l(results.lock);
+            if (wait) results.cv.wait(l, [&] { return !results.tasks.empty(); });
+            out.swap(results.tasks);
+        }
+        in_flight -= out.size();
+        for (void *t : out)
+            if (!comp_stop(t)) ff_send_out(t);
+    }
+
+    inline void ff_adaptive_comp::drain() {
+        while (in_flight > 0) flush(true);
+    }
+
+    // splits the stages into at most `segments` consecutive segments minimizing the slowest one, returns its time
+    inline double ff_adaptive_comp::split(const std::vector<double>& us, size_t segments, std::vector<size_t>& out) const {
+        const size_t n = us.size();
+        segments = std::max<size_t>(1, std::min(segments, n));
+        std::vector<double> prefix(n+1, 0);
+        for (size_t i=0; i<n; ++i) prefix[i+1] = prefix[i] + us[i];
+        // best[k][i]: slowest segment splitting the first i stages into k segments, cut[k][i] where the last one starts
+        const double inf = std::numeric_limits<double>::max();
+        std::vector<std::vector<double> > best(segments+1, std::vector<double>(n+1, inf));
+        std::vector<std::vector<size_t> > cut(segments+1, std::vector<size_t>(n+1, 0));
+        best[0][0] = 0;
+        for (size_t k=1; k<=segments; ++k)
+            for (size_t i=1; i<=n; ++i)
+                for (size_t j=k-1; j<i; ++j) {
+                    if (best[k-1][j] == inf) continue;
+                    // every segment but the first one pays the handoff of its tasks
+                    const double cost = std::max(best[k-1][j], prefix[i]-prefix[j] + (j ? overhead_us : 0));
+                    if (cost < best[k][i]) { best[k][i] = cost; cut[k][i] = j; }
+                }
+        size_t k = 1;
+        for (size_t c=2; c<=segments; ++c) if (best[c][n] < best[k][n]) k = c;
+        out.assign(k+1, n);
+        for (size_t c=k, i=n; c>0; --c) { out[c] = i; i = cut[c][i]; }
+        out[0] = 0;
+        return best[k][n];
+    }
+
+    // time of the slowest segment of the split b
+    inline double ff_adaptive_comp::cost(const std::vector<double>& us, const std::vector<size_t>& b) const {
+        double slowest = 0;
+        for (size_t s=0; s+1<b.size(); ++s) {
+            double t = s ? overhead_us : 0;
+            for (size_t i=b[s]; i<b[s+1]; ++i) t += us[i];
+            slowest = std::max(slowest, t);
+        }
+        return slowest;
+    }
+
+    inline void ff_adaptive_comp::reconfigure(comp_exec_mode m, const std::vector<size_t>& b, double service_us, double wait_us) {
+        drain(); // safe point, no task in flight
+        mode = m;
+        bounds = b;
+        switch_event e = { tasks, m, bounds.size()-1, service_us, wait_us };
+        events.push_back(e);
+    }
+
+    inline void ff_adaptive_comp::decide() {
+        std::vector<double> us(stages.size());
+        double service = 0;
+        for (size_t i=0; i<stages.size(); ++i) {
+            const unsigned long long ns = times[i].ns, calls = times[i].calls;
+            us[i] = calls > times[i].last_calls ? (ns - times[i].last_ns) / 1e3 / (calls - times[i].last_calls) : 0;
+            times[i].last_ns = ns;
+            times[i].last_calls = calls;
+            service += us[i];
+        }
+        const double wait = wait_ns / 1e3 / window_tasks;
+        wait_ns = 0;
+        window_tasks = 0;
+        std::vector<size_t> b;
+        const double slowest = split(us, max_threads, b);
+        const bool pays = b.size() > 2 && slowest < 0.8 * service;
+        if (mode == COMP_FUSED) {
+            if (pays && wait < 0.1 * service) reconfigure(COMP_PIPELINED, b, service, wait);
+        } else {
+            // in pipelined mode the node computes the first segment, then it waits for the next task
+            double first = 0;
+            for (size_t i=bounds[0]; i<bounds[1]; ++i) first += us[i];
+            if (!pays || wait + first > 1.2 * service) {
+                std::vector<size_t> fused(1, 0);
+                fused.push_back(stages.size());
+                reconfigure(COMP_FUSED, fused, service, wait);
+            } else if (b != bounds && slowest < 0.8 * cost(us, bounds)) reconfigure(COMP_PIPELINED, b, service, wait);
+        }
+    }
+
+    inline void *ff_adaptive_comp::svc(void *task) {
+        const std::chrono::steady_clock::time_point in = std::chrono::steady_clock::now();
+        if (tasks) wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(in-last_out).count();
+        ++tasks;
+        if (mode == COMP_FUSED || bounds.size() == 2) {
+            void *out = run_segment(0, task);
+            if (!comp_stop(out)) ff_send_out(out);
+        } else {
+            task = run_segment(0, task);
+            in_flight++;
+            if (comp_stop(task)) results.push(task);
+            else inputs[0]->push(task);
+            flush(false);
+            while (in_flight >= capacity) flush(true); // back pressure, the previous stage waits for the segments
+        }
+        if (adaptive && ++window_tasks == window) decide();
+        last_out = std::chrono::steady_clock::now();
+        time_elapsed += ((std::chrono::duration<double, std::milli>) (last_out-in)).count();
+        return GO_ON;
+    }
+
+    // the results of all the tasks are sent out before the end of the stream
+    inline void ff_adaptive_comp::eosnotify(ssize_t id) {
+        const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        drain();
+        time_elapsed += ((std::chrono::duration<double, std::milli>) (std::chrono::steady_clock::now()-t0)).count();
+        for (ff_node *s : stages) s->eosnotify(id);
+    }
+
+    inline int ff_adaptive_comp::svc_init() {
+        if (stages.empty()) {
+            error("adaptive comp has no stages to execute\n");
+            return -1;
+        }
+        times.reset(new stage_time[stages.size()]);
+        in_flight = tasks = window_tasks = 0;
+        wait_ns = time_elapsed = 0;
+        events.clear();
+        const size_t segments = std::min(max_threads, stages.size());
+        bounds.clear();
+        if (mode == COMP_PIPELINED) // fixed split, evenly by the number of stages
+            for (size_t s=0; s<=segments; ++s) bounds.push_back(s * stages.size() / segments);
+        else {
+            bounds.push_back(0);
+            bounds.push_back(stages.size());
+        }
+        inputs.clear();
+        for (size_t h=0; h+1<segments; ++h) inputs.push_back(std::unique_ptr<channel>(new channel()));
+        for (size_t h=0; h+1<segments; ++h) helpers.push_back(std::thread(&ff_adaptive_comp::helper, this, h));
+        for (ff_node *s : stages)
+            if (s->svc_init() < 0) return -1;
+        return 0;
+    }
+
+    inline void ff_adaptive_comp::svc_end() {
+        for (std::unique_ptr<channel>& c : inputs) {
+            {
+                std::lock_guard<std::mutex> l(c->lock);
+                c->stop = true;
+            }
+            c->cv.notify_all();
+        }
+        for (std::thread& t : helpers) t.join();
+        helpers.clear();
+        for (ff_node *s : stages) s->svc_end();
+    }
+
+}
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  This file implements a comp whose stages can suspend a task while it waits for a slow operation (C++20 coroutines).
+ *  ff_async_comp is a single node (a stage of a pipeline) that composes plain nodes, computed with svc as into ff_comp, and
+ *  asynchronous stages (ff_async_stage) whose svc_async is a coroutine: when it co_awaits an operation that isn't ready
+ *  the task is suspended and the node goes on with the next tasks it receives and with the tasks whose operations have
+ *  completed, so up to a concurrency limit of tasks are in flight through the chain on the thread of the node.
+ *  Operations:
+ *    co_await ff_async_call(fn)   runs fn, a blocking call (file read, decoder, service request), on a thread of the
+ *                                 small pool of the comp and resumes the task with its result
+ *    co_await event               (ff_async_event<T>) resumes the task when some other thread calls event.set(value)
+ *  The results are sent out in completion order or, if the comp is ordered, in the order of the tasks.
+ *  NOTE: the composed nodes can't send out tasks with ff_send_out (a single result per task, GO_ON/EOS results are
+ *  dropped), the coroutines of a comp are always resumed on its own thread.
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_ASYNCCOMP_HPP
+#define FF_ASYNCCOMP_HPP
+
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "asynccomp.hpp needs C++20 coroutines (-std=c++20)"
+#endif
+
+#include "comp.hpp"
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ff {
+
+    // coroutine type of the asynchronous stages (and of the chain of a task), it starts when it's awaited and resumes its
+    // awaiter when it returns
+    template<typename T>
+    class ff_async {
+
+    public:
+        struct promise_type {
+            T value{};
+            std::coroutine_handle<> continuation;
+            ff_async get_return_object() { return ff_async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    std::coroutine_handle<> c = h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+                void await_resume() noexcept { }
+            };
+            final_awaiter final_suspend() noexcept { return {}; }
+            void return_value(T v) { value = std::move(v); }
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        ff_async(ff_async&& o) noexcept : h(std::exchange(o.h, nullptr)) { }
+        ff_async& operator=(ff_async&& o) noexcept {
+            if (this != &o) {
+                if (h) h.destroy();
+                h = std::exchange(o.h, nullptr);
+            }
+            return *this;
+        }
+        ff_async(const ff_async&) = delete;
+        ff_async& operator=(const ff_async&) = delete;
+        ~ff_async() { if (h) h.destroy(); }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+            h.promise().continuation = awaiter;
+            return h;
+        }
+        T await_resume() { return std::move(h.promise().value); }
+
+        void start() { h.resume(); }
+        bool done() const { return h.done(); }
+        T& result() { return h.promise().value; }
+
+    private:
+        explicit ff_async(std::coroutine_handle<promise_type> h) : h(h) { }
+        std::coroutine_handle<promise_type> h;
+
+    };
+
+    // asynchronous entry point of a composable stage, a node that also derives from ff_async_stage is computed with
+    // svc_async in place of svc by ff_async_comp (its svc computes the task synchronously, e.g. into an ff_comp)
+    struct ff_async_stage {
+        virtual ~ff_async_stage() { }
+        virtual ff_async<void *> svc_async(void *task) = 0;
+    };
+
+    class ff_async_comp: public ff_node {
+
+    public:
+        ff_async_comp(bool ordered=false) : ordered(ordered), limit(16), io_threads(4), stopping(false) { }
+        ~ff_async_comp() { stop_pool(); }
+        int add_stage(ff_node *stage);
+         // tasks in flight at the same time (svc waits for one of them when the limit is reached), default 16
+        void set_concurrency(size_t tasks) { limit = tasks ? tasks : 1; }
+         // threads that run the ff_async_call operations, default 4
+        void set_io_threads(size_t n) { io_threads = n ? n : 1; }
+        size_t get_max_in_flight() const { return max_in_flight; }
+        size_t get_suspensions() const { return suspensions; }
+
+        // comp whose coroutines are being resumed on this thread (used by the operations to post their completion)
+        static ff_async_comp *&current() {
+            static thread_local ff_async_comp *comp = nullptr;
+            return comp;
+        }
+        // resumes h on the thread of the comp, callable from any thread
+        void post(std::coroutine_handle<> h);
+        // runs fn on the pool of the comp
+        void submit(std::function<void()> fn);
+
+    protected:
+        void *svc(void *task);
+        int svc_init();
+        void svc_end();
+        void eosnotify(ssize_t id=-1);
+
+    private:
+        struct stage {
+            ff_node *node;
+            ff_async_stage *async;
+        };
+        std::vector<stage> stages;
+        const bool ordered;
+        size_t limit, io_threads;
+        std::map<size_t, ff_async<void *> > in_flight;  // chains of the tasks, by sequence number
+        std::vector<size_t> finished;                    // tasks whose chain has returned, not yet collected
+        std::map<size_t, void *> results;                // results waiting for the previous ones (ordered comp)
+        size_t next_seq = 0, next_out = 0, max_in_flight = 0, suspensions = 0;
+        // completions posted by the operations
+        std::mutex lock;
+        std::condition_variable completed_cv;
+        std::deque<std::coroutine_handle<> > completed;
+        // pool of the blocking calls
+        std::mutex pool_lock;
+        std::condition_variable pool_cv;
+        std::deque<std::function<void()> > jobs;
+        std::vector<std::thread> pool;
+        bool stopping;
+
+        ff_async<void *> chain(size_t seq, void *task);
+        void collect();
+        void resume_completed(bool wait);
+        void stop_pool();
+
+    };
+
+    // awaitable of ff_async_call
+    template<typename F>
+    class ff_async_call_op {
+
+        typedef typename std::invoke_result<F>::type R;
+        typedef typename std::conditional<std::is_void<R>::value, char, R>::type value_t;
+        F fn;
+        value_t value{};
+
+    public:
+        explicit ff_async_call_op(F fn) : fn(std::move(fn)) { }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            ff_async_comp *comp = ff_async_comp::current();
+            if (!comp) {
+                error("ff_async_call awaited outside of an ff_async_comp\n");
+                std::terminate();
+            }
+            comp->submit([this, h, comp] {
+                if constexpr (std::is_void<R>::value) fn();
+                else value = fn();
+                comp->post(h);
+            });
+        }
+        R await_resume() {
+            if constexpr (!std::is_void<R>::value) return std::move(value);
+        }
+
+    };
+
+    template<typename F>
+    ff_async_call_op<F> ff_async_call(F fn) { return ff_async_call_op<F>(std::move(fn)); }
+
+    // a value that some other thread sets once, the tasks that co_await it are suspended until then
+    template<typename T>
+    class ff_async_event {
+
+        std::mutex lock;
+        bool ready = false;
+        T value{};
+        std::vector<std::pair<std::coroutine_handle<>, ff_async_comp *> > waiting;
+
+    public:
+        void set(T v) {
+            std::vector<std::pair<std::coroutine_handle<>, ff_async_comp *> > w;
+            {
+                std::lock_guard<std::mutex> l(lock);
+                value = std::move(v);
+                ready = true;
+                w.swap(waiting);
+            }
+            for (auto& e : w) e.second->post(e.first);
+        }
+
+        auto operator co_await() {
+            struct awaiter {
+                ff_async_event& e;
+                bool await_ready() {
+                    std::lock_guard<std::mutex> l(e.lock);
+                    return e.ready;
+                }
+                bool await_suspend(std::coroutine_handle<> h) {
+                    std::lock_guard<std::mutex> l(e.lock);
+                    if (e.ready) return false;
+                    e.waiting.push_back({ h, ff_async_comp::current() });
+                    return true;
+                }
+                T await_resume() {
+                    std::lock_guard<std::mutex> l(e.lock);
+                    return e.value;
+                }
+            };
+            return awaiter{ *this };
+        }
+
+    };
+
+    inline int ff_async_comp::add_stage(ff_node *node) {
+        if (!node) return -1;
+        stages.push_back({ node, dynamic_cast<ff_async_stage *>(node) });
+        return 0;
+    }
+
+    inline void ff_async_comp::post(std::coroutine_handle<> h) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            completed.push_back(h);
+        }
+        completed_cv.notify_one();
+    }
+
+    inline void ff_async_comp::submit(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> l(pool_lock);
+            jobs.push_back(std::move(fn));
+        }
+        pool_cv.notify_one();
+    }
+
+    inline ff_async<void *> ff_async_comp::chain(size_t seq, void *task) {
+        for (stage& s : stages) {
+            if (s.async) task = co_await s.async->svc_async(task);
+            else task = s.node->svc(task);
+            if (comp_stop(task)) break;
+        }
+        finished.push_back(seq);
+        co_return task;
+    }
+
+    // sends out the results of the chains that have returned
+    inline void ff_async_comp::collect() {
+        for (size_t seq : finished) {
+            std::map<size_t, ff_async<void *> >::iterator it = in_flight.find(seq);
+            void *out = it->second.result();
+            in_flight.erase(it);
+            if (!ordered) {
+                if (!comp_stop(out)) ff_send_out(out);
+            } else results[seq] = out;
+        }
+        finished.clear();
+        while (ordered && !results.empty() && results.begin()->first == next_out) {
+            void *out = results.begin()->second;
+            results.erase(results.begin());
+            next_out++;
+            if (!comp_stop(out)) ff_send_out(out);
+        }
+    }
+
+    // resumes the tasks whose operations have completed, waiting for at least one if wait is true
+    inline void ff_async_comp::resume_completed(bool wait) {
+        std::deque<std::coroutine_handle<> > ready;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (wait) completed_cv.wait(l, [&] { return !completed.empty(); });
+            ready.swap(completed);
+        }
+        suspensions += ready.size();
+        current() = this;
+        for (std::coroutine_handle<> h : ready) h.resume();
+        current() = nullptr;
+        collect();
+    }
+
+    inline void *ff_async_comp::svc(void *task) {
+        const size_t seq = next_seq++;
+        std::pair<std::map<size_t, ff_async<void *> >::iterator, bool> it = in_flight.emplace(seq, chain(seq, task));
+        max_in_flight = std::max(max_in_flight, in_flight.size());
+        current() = this;
+        it.first->second.start(); // runs until the first operation that isn't ready
+        current() = nullptr;
+        collect();
+        resume_completed(false);
+        while (in_flight.size() >= limit) resume_completed(true);
+        return GO_ON;
+    }
+
+    // the results of all the tasks are sent out before the end of the stream
+    inline void ff_async_comp::eosnotify(ssize_t) {
+        while (!in_flight.empty()) resume_completed(true);
+    }
+
+    inline int ff_async_comp::svc_init() {
+        if (stages.empty()) {
+            error("async comp has no stages to execute\n");
+            return -1;
+        }
+        next_seq = next_out = max_in_flight = suspensions = 0;
+        stopping = false;
+        for (size_t i=0; i<io_threads; ++i)
+            pool.push_back(std::thread([this] {
+                for (;;) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> l(pool_lock);
+                        pool_cv.wait(l, [&] { return stopping || !jobs.empty(); });
+                        if (jobs.empty()) return;
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    job();
+                }
+            }));
+        for (stage& s : stages)
+            if (s.node->svc_init() < 0) return -1;
+        return 0;
+    }
+
+    inline void ff_async_comp::svc_end() {
+        for (stage& s : stages) s.node->svc_end();
+        stop_pool();
+    }
+
+    inline void ff_async_comp::stop_pool() {
+        {
+            std::lock_guard<std::mutex> l(pool_lock);
+            stopping = true;
+        }
+        pool_cv.notify_all();
+        for (std::thread& t : pool) t.join();
+        pool.clear();
+    }
+
+}
+
+#endif
@@ -30,84 +30,952 @@
 #include <ff/pipeline.hpp>
 #include <ff/farm.hpp>
 #include <ff/utils.hpp>
+#include <ff/parallel_for.hpp>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
 
 namespace ff {
 
+    // execution order used by ff_comp::run_batch:
+    //   COMP_TASK_MAJOR  -> every task goes through the whole chain before the next one starts
+    //   COMP_STAGE_MAJOR -> every stage runs over the whole batch before the next stage starts
+    //   COMP_BATCH_AUTO  -> stage major over chunks of batch_grain tasks (task major if there is a single stage)
+    enum comp_batch_mode { COMP_BATCH_AUTO, COMP_STAGE_MAJOR, COMP_TASK_MAJOR };
+
+    // service time statistics of a single composed stage (times are in nanoseconds), hist[b] counts the calls whose service
+    // time falls into [2^b, 2^(b+1)) ns, the last bucket collects everything above
+    struct comp_stage_stats {
+        static const size_t buckets = 32;
+        unsigned long long calls, total_ns, min_ns, max_ns;
+        unsigned long long hist[buckets];
+
+        comp_stage_stats() { reset(); }
+        void reset() {
+            calls = total_ns = max_ns = 0;
+            min_ns = ~0ULL;
+            for (size_t b=0; b<buckets; ++b) hist[b] = 0;
+        }
+        // accounts `count` calls that took `ns` nanoseconds as a whole (count > 1 for a chunk of a batch)
+        inline void add(unsigned long long ns, unsigned long long count=1) {
+            const unsigned long long per_call = ns / count;
+            size_t b = (per_call > 1) ? 63 - __builtin_clzll(per_call) : 0;
+            if (b >= buckets) b = buckets-1;
+            calls += count;
+            total_ns += ns;
+            hist[b] += count;
+            if (per_call < min_ns) min_ns = per_call;
+            if (per_call > max_ns) max_ns = per_call;
+        }
+        void merge(const comp_stage_stats& o) {
+            calls += o.calls;
+            total_ns += o.total_ns;
+            if (o.min_ns < min_ns) min_ns = o.min_ns;
+            if (o.max_ns > max_ns) max_ns = o.max_ns;
+            for (size_t b=0; b<buckets; ++b) hist[b] += o.hist[b];
+        }
+    };
+
+    // tracing policies used by ff_comp around every stage call: comp_trace_off compiles to nothing, comp_trace_on reads the
+    // monotonic clock before and after the call. The policy is chosen at compile time by defining TRACE_FF_COMP.
+    struct comp_trace_off {
+        static const bool enabled = false;
+        struct stamp { };
+        inline void resize(size_t) { }
+        inline stamp start() const { return stamp(); }
+        inline void stop(size_t, const stamp&, unsigned long long=1) { }
+        inline void reset() { }
+        inline void collect(size_t, comp_stage_stats&) const { }
+    };
+
+    struct comp_trace_on {
+        static const bool enabled = true;
+        typedef std::chrono::steady_clock::time_point stamp;
+        std::vector<comp_stage_stats> stats;
+        inline void resize(size_t n) { stats.resize(n); }
+        inline stamp start() const { return std::chrono::steady_clock::now(); }
+        inline void stop(size_t stage, const stamp& t0, unsigned long long count=1) {
+            stats[stage].add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count(), count);
+        }
+        inline void reset() { for (comp_stage_stats& st : stats) st.reset(); }
+        inline void collect(size_t stage, comp_stage_stats& st) const { if (stage < stats.size()) st.merge(stats[stage]); }
+    };
+
+#if defined(TRACE_FF_COMP)
+    typedef comp_trace_on comp_trace_policy;
+#else
+    typedef comp_trace_off comp_trace_policy;
+#endif
+
+    // calls made by a single thread to a reentrant comp (see ff_comp::set_reentrant), time_ms is their total run time
+    struct comp_thread_stats {
+        unsigned long long tasks;
+        double time_ms;
+    };
+
+    // true for the special values that end the computation of a task (a filtered out task or the end of the stream)
+    static inline bool comp_stop(void *t) { return t == GO_ON || t == EOS; }
+
+    // optional batch entry point of a composable stage: a node that also derives from ff_batch_stage<T> computes a contiguous
+    // span of n values in place with a single call (typically a vectorized loop), its svc must still compute a single value
+    template<typename T>
+    struct ff_batch_stage {
+        virtual ~ff_batch_stage() { }
+        virtual void svc_batch(T *data, size_t n) = 0;
+    };
+
+    // optional row entry point of a composable image stage: a node that also derives from ff_row_stage<T> computes a row of
+    // an image (cols pixels of channels interleaved values) from the rows [y-radius, y+radius] of its input, in[k] is the
+    // row y-radius+k (rows beyond the borders are reflected, as OpenCV BORDER_REFLECT_101), out never aliases in
+    template<typename T>
+    struct ff_row_stage {
+        virtual ~ff_row_stage() { }
+        virtual size_t row_radius() const = 0;
+        virtual void svc_row(const T* const* in, T *out, size_t cols, size_t channels) = 0;
+    };
+
     class ff_comp: public ff_node {
 
     private:
+        // callback argument registered on every composed node: a task sent out with ff_send_out from a stage continues
+        // from the stage `next` (depth first, on the stack of the sender), next == nodes.size() forwards it out of the comp
+        struct stage_link {
+            ff_comp *comp;
+            size_t next;
+        };
+        static const size_t no_link = (size_t) -1; // nodes that are run concurrently (farm workers) can't send out
+        // a farm found while decomposing, nodes[first, last) is the chain of its first worker and chains[w] the one of the
+        // w-th worker, the other workers are used only when the farm parallelism is enabled
+        struct farm_stage {
+            size_t first, last;
+            std::vector<svector<ff_node *> > chains;
+            std::vector<comp_trace_policy> traces; // one per worker, the workers run concurrently
+            ParallelFor *pf;
+        };
+        // statistics of a thread running a reentrant comp, only that thread writes them: the padding keeps the counters of
+        // two threads on different cache lines and the atomics let them be read while the comp is running
+        struct thread_slot {
+            char front[64];
+            std::atomic<unsigned long long> tasks, time_ns;
+            comp_trace_policy trace;
+            char back[64];
+            thread_slot() : tasks(0), time_ns(0) { }
+        };
+        // how replicate rebuilds an added stage: with make, or shared by the replicas when make is empty (add_stage of a
+        // node), a nested comp is listed as its own stages
+        struct stage_recipe {
+            ff_node *stage;
+            std::function<ff_node *()> make;
+        };
         svector<ff_node *> nodes;
-        svector<ff_node *> decompose(ff_node* node);
-        std::chrono::time_point<std::chrono::system_clock> cstart;
-        std::chrono::time_point<std::chrono::system_clock> cend;
+        std::vector<farm_stage> farms;
+        std::vector<stage_recipe> recipe;
+        std::vector<std::unique_ptr<ff_node> > owned; // stages built by a factory, deleted with the comp
+        bool pending; // a replica whose stages have still to be built by its svc_init
+        // comp whose stages a replica shares (the ones added without a factory): they are not initialized and finalized by
+        // the replica (borrowed nodes) but by the first and the last replica running, through share/unshare of prototype
+        ff_comp *prototype;
+        std::vector<ff_node *> borrowed;
+        bool is_borrowed(ff_node *n) const { return std::find(borrowed.begin(), borrowed.end(), n) != borrowed.end(); }
+        bool inlined; // the stages have been inlined into another comp, that owns their callbacks now
+        bool runnable() const;
+        std::deque<stage_link> links; // deque: registered addresses must stay valid while stages are added
+        bool farm_parallel, farm_running;
+        int append(ff_node *stage, bool borrow=false);
+        int build();
+        svector<ff_node *> decompose(ff_node* node, size_t offset=0, bool record=false);
+        svector<ff_node *> decompose_farm(const svector<ff_node *>& workers, size_t offset, bool record);
+        void run_chain(ff_node* const* chain, size_t len, void **tasks, size_t n, comp_batch_mode mode, size_t chunk,
+                       comp_trace_policy& tr, size_t first_stage);
+        void run_farm(farm_stage& farm, void **tasks, size_t n, comp_batch_mode mode, size_t chunk);
+        inline void *run_from(size_t first, void *task, comp_trace_policy& tr);
+        void link(ff_node *node, size_t next);
+        static bool forward(void *task, unsigned long retry, unsigned long ticks, void *arg);
+        inline thread_slot *slot();
+        inline void account(thread_slot *s, std::chrono::steady_clock::time_point cstart, size_t tasks);
+        int acquire();
+        void release();
+        int share(const std::vector<ff_node *>& stages);
+        void unshare(const std::vector<ff_node *>& stages);
+        static unsigned long next_id() {
+            static std::atomic<unsigned long> id(0);
+            return ++id;
+        }
         double time_elapsed;
+        comp_trace_policy trace;
+        size_t batch_grain;
+        bool reentrant;
+        const unsigned long id; // threads find their slot by id, a later comp may get the address of a deleted one
+        std::vector<thread_slot *> slots;
+        mutable std::mutex slots_lock; // slots, users and sharers
+        size_t users, sharers; // running workers sharing the comp and running replicas sharing its stages
+
+        friend class ff_comp_worker;
 
 
     protected:
         void *svc(void *t) { return run(t); }
-        int svc_init() { return 0; }
-        void svc_end() { }
+        int svc_init();
+        void svc_end();
+        void eosnotify(ssize_t id=-1);
 
     public:
-        ff_comp() { time_elapsed = 0; }
-        ~ff_comp() = default; 
+        ff_comp(): pending(false), prototype(nullptr), inlined(false), reentrant(false), id(next_id()), users(0), sharers(0) { time_elapsed = 0; batch_grain = 256; farm_parallel = farm_running = false; }
+        ~ff_comp() {
+            for (farm_stage& f : farms) delete f.pf;
+            for (thread_slot *s : slots) delete s;
+        }
+         // a nested comp is inlined: its stages send out their tasks through this comp, so the nested comp can't be run
+         // on its own anymore (run and svc_init fail)
         int add_stage(ff_node *stage);
+         // adds the stage built by make, owned by the comp, every replica builds a stage of its own with the same factory
+        int add_stage(std::function<ff_node *()> make);
+         // n replicas of the comp (C is ff_comp or a class derived from it) for the workers of a farm: the stages added with a
+         // factory are built again for every replica, nested comps included, the others are shared and the comp must be
+         // reentrant for it (the replicas are not reentrant, their own stages can use ff_send_out). With on_worker the replicas build their stages into their svc_init, on the thread that runs them
+         // (first touched on its NUMA node when the thread is pinned), otherwise here. The replicas own their stages and the
+         // caller owns the replicas: move them into an ff_Farm/ff_OFarm or keep them while ff_farm::add_workers runs them.
+         // Shared stages get svc_init/svc_end once, through this comp, that must outlive the run of the replicas
+        template<typename C=ff_comp>
+        std::vector<std::unique_ptr<ff_node> > replicate(size_t n, bool on_worker=true) const;
         const svector<ff_node *>& get_stages() const { return nodes; };
          // init task is the inital task submitted to comp, ex: f(g(h(init_task))), if init_task is null h (in this example) is a function that
          // takes no input (single emitter, constant function, ...)
+         // a stage returning GO_ON or EOS stops the chain and that value is returned, the tasks that a stage sends out with
+         // ff_send_out go through the following stages and leave the comp through its own ff_send_out (a comp that is not
+         // part of a running graph must have a callback registered to receive them)
         void *run(void *init_task=nullptr);
-        double ff_time() { return time_elapsed;  } // Returns total run time
+         // runs the composition over an array of n tasks, each result is stored in place of its task (tasks[i] = f(g(h(tasks[i]))))
+         // the batch is timed as a whole, returns -1 if the comp has no stages, filtered tasks are stored as GO_ON (or EOS)
+        int run_batch(void **tasks, size_t n, comp_batch_mode mode=COMP_BATCH_AUTO);
+         // number of tasks that COMP_BATCH_AUTO pushes through a stage before moving to the next one, it should be small
+         // enough that a chunk of tasks stays in cache while all the stages are applied to it
+        void set_batch_grain(size_t grain) { batch_grain = grain ? grain : 1; }
+         // runs the composition over a contiguous array of n values computed in place, in chunks of batch_grain values:
+         // when every stage is an ff_batch_stage<T> each stage gets a whole chunk with svc_batch, otherwise every value goes
+         // through svc (a value filtered out by a stage is left as it is), returns -1 if the comp has no stages
+        template<typename T>
+        int run_span(T *data, size_t n);
+         // runs the composition over an image of rows x cols pixels stored in data (stride values between two rows), in place:
+         // when every stage is an ff_row_stage<T> the image goes row by row through the whole chain, every stage keeping only
+         // its last 2*radius+1 input rows into circular line buffers, otherwise (or if the image has no more rows than a
+         // radius) task, the object that the stages compute with svc and whose pixels are data, is given to run
+        template<typename T>
+        void *run_rows(void *task, T *data, size_t rows, size_t cols, size_t channels, size_t stride);
+         // when enabled, run_batch splits the batch among the workers of every composed farm instead of using only the first
+         // one, the workers of a farm must not be shared with other running nodes (run always uses the first worker)
+        void set_farm_parallel(bool enable) { farm_parallel = enable; }
+         // a reentrant comp can be run by several threads at once (run, run_batch, run_span and run_rows), its stages must
+         // be stateless (their svc safe to call concurrently) and can't use ff_send_out, the farm parallelism is not used.
+         // The run time and the stage statistics are kept by thread, see get_thread_stats and ff_comp_worker
+        void set_reentrant(bool enable) { reentrant = enable; }
+        bool is_reentrant() const { return reentrant; }
+        double ff_time() const; // Returns total run time (of all the threads for a reentrant comp)
+         // calls of every thread that has run the reentrant comp, in the order they first ran it
+        std::vector<comp_thread_stats> get_thread_stats() const;
+         // per stage statistics (empty unless TRACE_FF_COMP is defined), the workers of a parallel farm and the threads of a
+         // reentrant comp are merged together, they must be read when the comp is not running
+        comp_stage_stats get_stage_stats(size_t stage) const;
+        void reset_stats();
+        void print_stats(std::ostream& out=std::cout) const;
 
     };
 
     int ff_comp::add_stage(ff_node *stage) {
+        if (append(stage) < 0) return -1;
+        ff_comp *c = dynamic_cast<ff_comp*>(stage);
+        if (c && c != this) recipe.insert(recipe.end(), c->recipe.begin(), c->recipe.end());
+        else {
+            stage_recipe r = { stage, std::function<ff_node *()>() };
+            recipe.push_back(r);
+        }
+        return 0;
+    }
+
+    int ff_comp::add_stage(std::function<ff_node *()> make) {
+        ff_node *stage = make ? make() : nullptr;
+        if (!stage) {
+            error("comp: a stage factory returned no stage\n");
+            return -1;
+        }
+        owned.push_back(std::unique_ptr<ff_node>(stage));
+        append(stage);
+        stage_recipe r = { stage, make };
+        recipe.push_back(r);
+        return 0;
+    }
+
+    template<typename C>
+    std::vector<std::unique_ptr<ff_node> > ff_comp::replicate(size_t n, bool on_worker) const {
+        std::vector<std::unique_ptr<ff_node> > replicas;
+        if (recipe.empty()) {
+            error("comp has no stages to replicate\n");
+            return replicas;
+        }
+        bool shares = false;
+        for (const stage_recipe& r : recipe)
+            if (!r.make) shares = true;
+        if (shares && !reentrant) {
+            error("comp: a stage added without a factory would be shared by the replicas (the comp is not reentrant)\n");
+            return replicas;
+        }
+        for (size_t i=0; i<n; ++i) {
+            C *replica = new C();
+            ff_comp& c = *replica;
+            c.recipe = recipe;
+            c.batch_grain = batch_grain;
+            c.farm_parallel = farm_parallel;
+            c.pending = true;
+            c.prototype = shares ? const_cast<ff_comp*>(this) : nullptr;
+            replicas.push_back(std::unique_ptr<ff_node>(replica));
+            if (!on_worker && c.build() < 0) {
+                replicas.clear();
+                break;
+            }
+        }
+        return replicas;
+    }
+
+    // builds the stages of a replica following its recipe, the nodes of a shared stage are borrowed
+    int ff_comp::build() {
+        pending = false;
+        for (stage_recipe& r : recipe) {
+            if (r.make) {
+                ff_node *stage = r.make();
+                if (!stage) {
+                    error("comp: a stage factory returned no stage\n");
+                    return -1;
+                }
+                owned.push_back(std::unique_ptr<ff_node>(stage));
+                r.stage = stage;
+            }
+            if (append(r.stage, !r.make) < 0) return -1;
+        }
+        return 0;
+    }
+
+    // a borrowed stage keeps the callbacks of the comp that owns it (the replicas sharing it run concurrently and can't
+    // forward what it sends out anyway)
+    int ff_comp::append(ff_node *stage, bool borrow) {
         if (!stage) return -1;
-        svector<ff_node *> nested = decompose(stage);
+        const size_t first = nodes.size(), first_farm = farms.size();
+        svector<ff_node *> nested = decompose(stage, first, true);
         for (ff_node *n : nested) nodes.push_back(n);
+        trace.resize(nodes.size());
+        for (thread_slot *s : slots) s->trace.resize(nodes.size());
+        for (size_t i=first; i<nodes.size(); ++i)
+            if (borrow) borrowed.push_back(nodes[i]);
+            else link(nodes[i], i+1);
+        for (size_t f=first_farm; f<farms.size(); ++f)
+            for (size_t w=1; w<farms[f].chains.size(); ++w)
+                for (ff_node *n : farms[f].chains[w])
+                    if (borrow) borrowed.push_back(n);
+                    else link(n, no_link);
         return 0;
     }
 
+    void ff_comp::link(ff_node *node, size_t next) {
+        stage_link l = { this, next };
+        links.push_back(l);
+        node->registerCallback(forward, &links.back());
+    }
+
+    bool ff_comp::forward(void *task, unsigned long retry, unsigned long ticks, void *arg) {
+        stage_link *l = (stage_link*) arg;
+        ff_comp *comp = l->comp;
+        if (l->next == no_link || comp->farm_running) {
+            error("comp: ff_send_out is not supported by stages running into a parallel farm\n");
+            return false;
+        }
+        if (comp->reentrant) {
+            error("comp: ff_send_out is not supported by the stages of a reentrant comp\n");
+            return false;
+        }
+        void *out = comp->run_from(l->next, task, comp->trace);
+        if (out == GO_ON) return true;
+        return comp->ff_send_out(out, retry, ticks);
+    }
+
+    int ff_comp::svc_init() {
+        if (inlined) {
+            error("comp: the stages have been inlined into another comp, that one must be run\n");
+            return -1;
+        }
+        if (pending && build() < 0) return -1;
+        if (prototype && prototype->share(borrowed) < 0) return -1;
+        for (ff_node *n : nodes)
+            if (!is_borrowed(n) && n->svc_init() < 0) return -1;
+        for (farm_stage& f : farms)
+            for (size_t w=1; w<f.chains.size(); ++w)
+                for (ff_node *n : f.chains[w])
+                    if (!is_borrowed(n) && n->svc_init() < 0) return -1;
+        return 0;
+    }
+
+    void ff_comp::svc_end() {
+        for (ff_node *n : nodes)
+            if (!is_borrowed(n)) n->svc_end();
+        for (farm_stage& f : farms)
+            for (size_t w=1; w<f.chains.size(); ++w)
+                for (ff_node *n : f.chains[w])
+                    if (!is_borrowed(n)) n->svc_end();
+        if (prototype) prototype->unshare(borrowed);
+    }
+
+    // the first worker of a reentrant comp initializes its stages, the others wait for it, and the last one finalizes them
+    int ff_comp::acquire() {
+        if (!reentrant) {
+            error("comp: only a reentrant comp can be shared by several workers\n");
+            return -1;
+        }
+        std::lock_guard<std::mutex> l(slots_lock);
+        if (users == 0 && svc_init() < 0) return -1;
+        users++;
+        return 0;
+    }
+
+    void ff_comp::release() {
+        std::lock_guard<std::mutex> l(slots_lock);
+        if (users > 0 && --users == 0) svc_end();
+    }
+
+    // the first replica starting initializes the stages the replicas borrow (the stages of this comp added without a
+    // factory, decomposed as the replicas see them) and the last one finalizes them, the other stages are left alone
+    int ff_comp::share(const std::vector<ff_node *>& stages) {
+        std::lock_guard<std::mutex> l(slots_lock);
+        if (sharers == 0)
+            for (ff_node *n : stages)
+                if (n->svc_init() < 0) return -1;
+        sharers++;
+        return 0;
+    }
+
+    void ff_comp::unshare(const std::vector<ff_node *>& stages) {
+        std::lock_guard<std::mutex> l(slots_lock);
+        if (sharers > 0 && --sharers == 0)
+            for (ff_node *n : stages) n->svc_end();
+    }
+
+    // stages are notified in order, so what a stage sends out at the end of the stream still goes through the next ones
+    void ff_comp::eosnotify(ssize_t id) {
+        for (ff_node *n : nodes) n->eosnotify(id);
+    }
+
+    inline void *ff_comp::run_from(size_t first, void *task, comp_trace_policy& tr) {
+        for (size_t i=first; i<nodes.size(); ++i) {
+            comp_trace_policy::stamp t0 = tr.start();
+            task = nodes[i]->svc(task);
+            tr.stop(i, t0);
+            if (comp_stop(task)) break; // the remaining stages have nothing to compute
+        }
+        return task;
+    }
+
+    // slot of the calling thread, created the first time it runs the comp (every thread keeps the slots it has used)
+    inline ff_comp::thread_slot *ff_comp::slot() {
+        static thread_local std::vector<std::pair<unsigned long, thread_slot *> > cache;
+        for (const std::pair<unsigned long, thread_slot *>& c : cache)
+            if (c.first == id) return c.second;
+        thread_slot *s = new thread_slot();
+        {
+            std::lock_guard<std::mutex> l(slots_lock);
+            s->trace.resize(nodes.size());
+            slots.push_back(s);
+        }
+        cache.push_back(std::make_pair(id, s));
+        return s;
+    }
+
+    // run time of a call that computed tasks, into the slot s of a reentrant comp (nullptr otherwise)
+    inline void ff_comp::account(thread_slot *s, std::chrono::steady_clock::time_point cstart, size_t tasks) {
+        const std::chrono::steady_clock::time_point cend = std::chrono::steady_clock::now();
+        if (!s) {
+            time_elapsed += ((std::chrono::duration<double, std::milli>) (cend-cstart)).count();
+            return;
+        }
+        const unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(cend-cstart).count();
+        s->tasks.store(s->tasks.load(std::memory_order_relaxed) + tasks, std::memory_order_relaxed); // single writer
+        s->time_ns.store(s->time_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+
+    bool ff_comp::runnable() const {
+        if (nodes.empty()) error("comp has no stages to execute\n");
+        else if (inlined) error("comp: the stages have been inlined into another comp, that one must be run\n");
+        else return true;
+        return false;
+    }
+
     void* ff_comp::run(void *init_task) {
         
-        cstart = std::chrono::system_clock::now();
-        void *_in=nullptr, *_out=nullptr;
-        if (nodes.empty()) error("comp has no stages to execute\n");
-        for(size_t i=0; i<nodes.size(); ++i) {
-            if (i == 0) _out = nodes[i]->svc(init_task); // first call
-            else _out = nodes[i]->svc(_in);
-            _in = _out;
-        }
-        cend = std::chrono::system_clock::now();
-        time_elapsed += ((std::chrono::duration<double, std::milli>) (cend-cstart)).count();
+        const std::chrono::steady_clock::time_point cstart = std::chrono::steady_clock::now();
+        thread_slot *s = reentrant ? slot() : nullptr;
+        void *_out=nullptr;
+        if (runnable()) _out = run_from(0, init_task, s ? s->trace : trace);
+        account(s, cstart, 1);
         return _out;
     }
 
-    // free helper function used to decompose nodes into the add_stage method
-    svector<ff_node *> ff_comp::decompose(ff_node* node) {
+    int ff_comp::run_batch(void **tasks, size_t n, comp_batch_mode mode) {
+        if (!runnable()) return -1;
+        if (n == 0) return 0;
+        const std::chrono::steady_clock::time_point cstart = std::chrono::steady_clock::now();
+        thread_slot *s = reentrant ? slot() : nullptr;
+        comp_trace_policy& tr = s ? s->trace : trace;
+        size_t chunk = n;
+        if (mode == COMP_BATCH_AUTO) {
+            if (nodes.size() == 1 || n == 1) mode = COMP_TASK_MAJOR;
+            else chunk = batch_grain;
+        }
+        size_t pos = 0;
+        if (farm_parallel && !reentrant && n > 1) {
+            for (farm_stage& f : farms) {
+                if (f.first > pos) run_chain(&nodes[pos], f.first-pos, tasks, n, mode, chunk, tr, pos);
+                run_farm(f, tasks, n, mode, chunk);
+                pos = f.last;
+            }
+        }
+        if (pos < nodes.size()) run_chain(&nodes[pos], nodes.size()-pos, tasks, n, mode, chunk, tr, pos);
+        account(s, cstart, n);
+        return 0;
+    }
+
+    template<typename T>
+    int ff_comp::run_span(T *data, size_t n) {
+        if (!runnable()) return -1;
+        if (n == 0) return 0;
+        const std::chrono::steady_clock::time_point cstart = std::chrono::steady_clock::now();
+        thread_slot *s = reentrant ? slot() : nullptr;
+        comp_trace_policy& tr = s ? s->trace : trace;
+        std::vector<ff_batch_stage<T>*> batch(nodes.size());
+        bool batched = true;
+        for (size_t j=0; j<nodes.size() && batched; ++j)
+            batched = (batch[j] = dynamic_cast<ff_batch_stage<T>*>(nodes[j])) != nullptr;
+        std::vector<void*> tasks(batched ? 0 : std::min(n, batch_grain));
+        for (size_t base=0; base<n; base+=batch_grain) {
+            const size_t len = std::min(n-base, batch_grain);
+            if (batched) {
+                for (size_t j=0; j<nodes.size(); ++j) {
+                    comp_trace_policy::stamp t0 = tr.start();
+                    batch[j]->svc_batch(data+base, len);
+                    tr.stop(j, t0, len);
+                }
+            } else {
+                for (size_t i=0; i<len; ++i) tasks[i] = data+base+i;
+                run_chain(&nodes[0], nodes.size(), tasks.data(), len, COMP_STAGE_MAJOR, len, tr, 0);
+                for (size_t i=0; i<len; ++i) // a stage may have returned the result in a task of its own
+                    if (!comp_stop(tasks[i]) && tasks[i] != data+base+i) data[base+i] = *((T*) tasks[i]);
+            }
+        }
+        account(s, cstart, n);
+        return 0;
+    }
+
+    template<typename T>
+    void *ff_comp::run_rows(void *task, T *data, size_t rows, size_t cols, size_t channels, size_t stride) {
+        if (!runnable()) return nullptr;
+        const size_t m = nodes.size();
+        std::vector<ff_row_stage<T>*> row(m);
+        bool streamed = m > 0;
+        for (size_t j=0; j<m && streamed; ++j)
+            streamed = (row[j] = dynamic_cast<ff_row_stage<T>*>(nodes[j])) != nullptr && row[j]->row_radius() < rows;
+        if (!streamed || rows == 0) return run(task);
+        const std::chrono::steady_clock::time_point cstart = std::chrono::steady_clock::now();
+        thread_slot *s = reentrant ? slot() : nullptr;
+        comp_trace_policy& tr = s ? s->trace : trace;
+        const size_t width = cols * channels;
+        // lines[j] holds the last inputs of stage j (row i in slot i % size): copies of the image rows for the first stage,
+        // outputs of stage j-1 for the others, done[j] rows of lines[j] have been filled, the last stage writes in place
+        std::vector<std::vector<T> > lines(m);
+        std::vector<size_t> size(m), done(m, 0);
+        std::vector<const T*> in;
+        for (size_t j=0; j<m; ++j) {
+            size[j] = 2*row[j]->row_radius() + 1;
+            lines[j].resize(size[j] * width);
+        }
+        auto reflect = [rows](long i) { return (size_t) (i < 0 ? -i : (i >= (long) rows ? 2*(long) rows-2-i : i)); };
+        std::function<void(size_t, size_t, T*)> compute;
+        // fills lines[j] up to row last (stage j-1 computes its rows on demand)
+        std::function<void(size_t, size_t)> fill = [&](size_t j, size_t last) {
+            for (; done[j] <= last; ++done[j]) {
+                T *dst = &lines[j][(done[j] % size[j]) * width];
+                if (j == 0) std::copy(data + done[j]*stride, data + done[j]*stride + width, dst);
+                else compute(j-1, done[j], dst);
+            }
+        };
+        // computes the row y of stage j into out
+        compute = [&](size_t j, size_t y, T *out) {
+            const long r = (long) row[j]->row_radius();
+            fill(j, std::min(rows-1, y + (size_t) r));
+            in.resize(2*r+1);
+            for (long k=-r; k<=r; ++k) in[k+r] = &lines[j][(reflect((long) y + k) % size[j]) * width];
+            comp_trace_policy::stamp t0 = tr.start();
+            row[j]->svc_row(in.data(), out, cols, channels);
+            tr.stop(j, t0);
+        };
+        // the image row y has been copied into lines[0] before the last stage writes it
+        for (size_t y=0; y<rows; ++y) compute(m-1, y, data + y*stride);
+        account(s, cstart, 1);
+        return task;
+    }
+
+    // applies the len stages of chain to every task of the batch, chain[j] is traced as the stage first_stage+j of tr
+    void ff_comp::run_chain(ff_node* const* chain, size_t len, void **tasks, size_t n, comp_batch_mode mode, size_t chunk,
+                            comp_trace_policy& tr, size_t first_stage) {
+        if (mode == COMP_TASK_MAJOR) {
+            for (size_t i=0; i<n; ++i)
+                for (size_t j=0; j<len && !comp_stop(tasks[i]); ++j) {
+                    comp_trace_policy::stamp t0 = tr.start();
+                    tasks[i] = chain[j]->svc(tasks[i]);
+                    tr.stop(first_stage+j, t0);
+                }
+        } else {
+            for (size_t base=0; base<n; base+=chunk) {
+                const size_t last = (n-base < chunk) ? n : base+chunk;
+                for (size_t j=0; j<len; ++j) {
+                    comp_trace_policy::stamp t0 = tr.start();
+                    for (size_t i=base; i<last; ++i)
+                        if (!comp_stop(tasks[i])) tasks[i] = chain[j]->svc(tasks[i]);
+                    tr.stop(first_stage+j, t0, last-base);
+                }
+            }
+        }
+    }
+
+    // the batch is split into one contiguous slice per worker, so every worker chain is used by exactly one thread
+    void ff_comp::run_farm(farm_stage& farm, void **tasks, size_t n, comp_batch_mode mode, size_t chunk) {
+        const long nw = (long) std::min(farm.chains.size(), n);
+        if (!farm.pf) farm.pf = new ParallelFor((long) farm.chains.size());
+        const size_t slice = (n + nw - 1) / nw;
+        farm_running = true;
+        farm.pf->parallel_for(0, nw, 1, 1, [&](const long w) {
+            const size_t first = w*slice;
+            const size_t last = std::min(n, first+slice);
+            if (first < last) run_chain(&farm.chains[w][0], farm.chains[w].size(), tasks+first, last-first, mode, chunk,
+                                        farm.traces[w], 0);
+        }, nw);
+        farm_running = false;
+    }
+
+    double ff_comp::ff_time() const {
+        double t = time_elapsed;
+        std::lock_guard<std::mutex> l(slots_lock);
+        for (const thread_slot *s : slots) t += s->time_ns.load(std::memory_order_relaxed) / 1e6;
+        return t;
+    }
+
+    std::vector<comp_thread_stats> ff_comp::get_thread_stats() const {
+        std::vector<comp_thread_stats> stats;
+        std::lock_guard<std::mutex> l(slots_lock);
+        for (const thread_slot *s : slots) {
+            comp_thread_stats st = { s->tasks.load(std::memory_order_relaxed), s->time_ns.load(std::memory_order_relaxed) / 1e6 };
+            stats.push_back(st);
+        }
+        return stats;
+    }
+
+    comp_stage_stats ff_comp::get_stage_stats(size_t stage) const {
+        comp_stage_stats st;
+        trace.collect(stage, st);
+        {
+            std::lock_guard<std::mutex> l(slots_lock);
+            for (const thread_slot *s : slots) s->trace.collect(stage, st);
+        }
+        for (const farm_stage& f : farms)
+            if (stage >= f.first && stage < f.last)
+                for (const comp_trace_policy& tr : f.traces) tr.collect(stage-f.first, st);
+        if (st.calls == 0) st.min_ns = 0;
+        return st;
+    }
+
+    void ff_comp::reset_stats() {
+        trace.reset();
+        {
+            std::lock_guard<std::mutex> l(slots_lock);
+            for (thread_slot *s : slots) s->trace.reset();
+        }
+        for (farm_stage& f : farms)
+            for (comp_trace_policy& tr : f.traces) tr.reset();
+    }
+
+    void ff_comp::print_stats(std::ostream& out) const {
+        if (!comp_trace_policy::enabled) {
+            out << "comp stage statistics are disabled (compile with -DTRACE_FF_COMP)\n";
+            return;
+        }
+        out << "stage\tcalls\ttotal(ms)\tavg(us)\tmin(us)\tmax(us)\n";
+        for (size_t i=0; i<nodes.size(); ++i) {
+            comp_stage_stats st = get_stage_stats(i);
+            const double avg = st.calls ? st.total_ns / (double) st.calls : 0;
+            out << i << "\t" << st.calls << "\t" << st.total_ns / 1e6 << "\t" << avg / 1e3 << "\t"
+                << st.min_ns / 1e3 << "\t" << st.max_ns / 1e3 << "\n";
+            out << "\thistogram (log2 ns: calls):";
+            for (size_t b=0; b<comp_stage_stats::buckets; ++b)
+                if (st.hist[b]) out << " " << b << ":" << st.hist[b];
+            out << "\n";
+        }
+    }
+
+    // free helper function used to decompose nodes into the add_stage method, offset is the position that the first decomposed
+    // node will take into the comp and record tells whether farms have to be recorded for the farm parallelism.
+    // Graphs are normalized into a flat array of stages: pipelines (ff_Pipe too) are replaced by their stages, farms
+    // (ff_farm<>, ff_Farm, ff_ofarm, ff_OFarm) by the chain of their first worker and nested comps by their stages (with
+    // their recorded farms), so a wrapper of a single stage costs nothing and every task goes through a single run.
+    // The stages of an inlined comp send out their tasks through the comp they have been inlined into, the inner comp is
+    // marked as inlined and refuses to run on its own
+    svector<ff_node *> ff_comp::decompose(ff_node* node, size_t offset, bool record) {
         svector<ff_node *> n_list;
-        if (ff_pipeline *p  = dynamic_cast<ff_pipeline*>(node)) {
+        if (ff_comp *c = dynamic_cast<ff_comp*>(node)) {
+            if (c == this) error("a comp can't be composed into itself\n");
+            else if (c->nodes.empty()) error("Decomposing an empty comp\n");
+            else {
+                if (record)
+                    for (const farm_stage& f : c->farms) {
+                        farm_stage fs = f;
+                        fs.first += offset;
+                        fs.last += offset;
+                        fs.pf = nullptr;
+                        for (comp_trace_policy& tr : fs.traces) tr.reset();
+                        farms.push_back(fs);
+                    }
+                n_list += c->nodes;
+                c->inlined = true;
+            }
+        } else if (ff_pipeline *p  = dynamic_cast<ff_pipeline*>(node)) {
             svector<ff_node *> pipe_list = p->getStages();
             if (pipe_list.empty()) error("Decomposing an empty pipeline\n");
             for (ff_node *n: pipe_list) {
-                svector<ff_node *> temp = decompose(n);
+                svector<ff_node *> temp = decompose(n, offset+n_list.size(), record);
                 n_list += temp;
             }
         } else if (ff_farm<> *f  = dynamic_cast<ff_farm<>*>(node)) {
-            svector<ff_node*> workers = f->getWorkers();
-            if(workers.empty()) error("Decomposing an empty farm\n");
-            else {
-                svector<ff_node *> temp = decompose(workers[0]); // decomposing the first, we assume they're all executing the SAME task
-                n_list += temp;
-            }            
+            n_list += decompose_farm(f->getWorkers(), offset, record);
+        } else if (ff_farm<ofarm_lb, ofarm_gt> *f  = dynamic_cast<ff_farm<ofarm_lb, ofarm_gt>*>(node)) {
+            n_list += decompose_farm(f->getWorkers(), offset, record);
         } else if (ff_node *n  = dynamic_cast<ff_node*>(node)) {
             n_list.push_back(n);
         } else {
-            error("only ff_pipeline, ff_farm and ff_node can be composed\n");
+            error("only ff_comp, ff_pipeline, ff_farm and ff_node can be composed\n");
         }
         return n_list;
     }
 
+    svector<ff_node *> ff_comp::decompose_farm(const svector<ff_node *>& workers, size_t offset, bool record) {
+        svector<ff_node *> n_list;
+        if(workers.empty()) error("Decomposing an empty farm\n");
+        else {
+            n_list = decompose(workers[0]); // decomposing the first, we assume they're all executing the SAME task
+            if (record && workers.size() > 1) {
+                farm_stage fs;
+                fs.first = offset;
+                fs.last = fs.first+n_list.size();
+                fs.pf = nullptr;
+                fs.chains.push_back(n_list);
+                for (size_t w=1; w<workers.size(); ++w) {
+                    fs.chains.push_back(decompose(workers[w])); // nested farms are collapsed to their first worker
+                    if (fs.chains.back().size() != n_list.size()) break;
+                }
+                if (fs.chains.back().size() == n_list.size()) {
+                    fs.traces.resize(fs.chains.size());
+                    for (comp_trace_policy& tr : fs.traces) tr.resize(n_list.size());
+                    farms.push_back(fs);
+                }
+                else error("farm workers have different shapes, the farm will be composed sequentially\n");
+            }
+        }
+        return n_list;
+    }
+
+    // farm worker running a reentrant comp shared with the other workers, e.g. for 16 workers of Comp(S1, S2):
+    //   ff_comp comp; comp.add_stage(&s1); comp.add_stage(&s2); comp.set_reentrant(true);
+    //   for (int i=0; i<16; ++i) workers.push_back(new ff_comp_worker(comp));
+    // the stages are not replicated, the run time and the tasks of every worker are kept by the comp (get_thread_stats).
+    // The stages get svc_init from the first worker starting and svc_end from the last one ending, eosnotify is not
+    // forwarded (stateless stages have nothing to flush at the end of the stream)
+    class ff_comp_worker: public ff_node {
+
+    private:
+        ff_comp& comp;
+
+    protected:
+        void *svc(void *t) { return comp.run(t); }
+        int svc_init() { return comp.acquire(); }
+        void svc_end() { comp.release(); }
+
+    public:
+        ff_comp_worker(ff_comp& comp): comp(comp) { }
+        ff_comp& get_comp() const { return comp; }
+
+    };
+
+    // ------------------------------------------------------------------------------------------------------------------------
+    // Typed composition: ff_comp_t<S1, S2, ..., Sn> computes Sn(...S2(S1(x))) where each stage is either an ff_node_t<IN,OUT>
+    // (its svc(IN*) must be public) or a callable taking exactly one argument (function pointer, lambda, functor).
+    // The chain is resolved at compile time: the output type of every stage must be convertible to the input type of the
+    // next one and the stages are called directly, so the whole chain can be inlined into a single function.
+    // Stages are owned by the composition, they are default constructed or copied from the constructor arguments.
+    // As for ff_comp, a pointer chain stops on GO_ON/EOS, node stages get their lifecycle calls forwarded and what they send
+    // out with ff_send_out goes through the following stages.
+    // ------------------------------------------------------------------------------------------------------------------------
+
+    // input/output types of a callable stage, deduced from its call operator
+    template<typename F> struct comp_callable_traits: comp_callable_traits<decltype(&F::operator())> { };
+    template<typename C, typename R, typename A> struct comp_callable_traits<R (C::*)(A)> { typedef A in_type; typedef R out_type; };
+    template<typename C, typename R, typename A> struct comp_callable_traits<R (C::*)(A) const> { typedef A in_type; typedef R out_type; };
+    template<typename R, typename A> struct comp_callable_traits<R (*)(A)> { typedef A in_type; typedef R out_type; };
+
+    typedef bool (*comp_callback_t)(void *, unsigned long, unsigned long, void *);
+
+    template<typename S, bool is_node = std::is_base_of<ff_node, S>::value>
+    struct comp_stage_traits {
+        typedef typename comp_callable_traits<S>::in_type in_type;
+        typedef typename comp_callable_traits<S>::out_type out_type;
+        static inline out_type call(S& s, in_type x) { return s(x); }
+        static inline int init(S&) { return 0; }
+        static inline void end(S&) { }
+        static inline void eos(S&, ssize_t) { }
+        static inline void link(S&, comp_callback_t, void *) { }
+    };
+
+    template<typename S>
+    struct comp_stage_traits<S, true> {
+        typedef typename S::in_type* in_type;
+        typedef typename S::out_type* out_type;
+        static inline out_type call(S& s, in_type x) { return s.S::svc(x); } // qualified call, no virtual dispatch
+        static inline int init(S& s) { return static_cast<ff_node&>(s).svc_init(); }
+        static inline void end(S& s) { static_cast<ff_node&>(s).svc_end(); }
+        static inline void eos(S& s, ssize_t id) { static_cast<ff_node&>(s).eosnotify(id); }
+        static inline void link(S& s, comp_callback_t cb, void *arg) { s.registerCallback(cb, arg); }
+    };
+
+    // fused chain of the stages I..N-1 contained into the tuple
+    template<typename Tuple, size_t I, size_t N = std::tuple_size<Tuple>::value>
+    struct comp_fused {
+        typedef comp_stage_traits<typename std::tuple_element<I, Tuple>::type> stage;
+        typedef comp_fused<Tuple, I+1, N> next;
+        typedef typename stage::in_type in_type;
+        typedef typename next::out_type out_type;
+        static_assert(std::is_convertible<typename stage::out_type, typename next::in_type>::value,
+                      "ff_comp_t: the output type of a stage doesn't match the input type of the next one");
+        static inline out_type run(Tuple& t, in_type x) {
+            typedef std::integral_constant<bool, std::is_pointer<typename stage::out_type>::value && std::is_pointer<out_type>::value> can_stop;
+            return step(t, stage::call(std::get<I>(t), x), can_stop());
+        }
+        static inline out_type step(Tuple& t, typename stage::out_type y, std::true_type) {
+            if (comp_stop((void*) y)) return (out_type) (void*) y;
+            return next::run(t, y);
+        }
+        static inline out_type step(Tuple& t, typename stage::out_type y, std::false_type) { return next::run(t, y); }
+    };
+
+    template<typename Tuple, size_t N>
+    struct comp_fused<Tuple, N, N> {
+        typedef typename comp_stage_traits<typename std::tuple_element<N-1, Tuple>::type>::out_type in_type;
+        typedef in_type out_type;
+        static inline out_type run(Tuple&, in_type x) { return x; }
+    };
+
+    // lifecycle calls and callback registration over all the stages contained into the tuple
+    template<typename Tuple, size_t I=0, size_t N = std::tuple_size<Tuple>::value>
+    struct comp_tuple_ops {
+        typedef comp_stage_traits<typename std::tuple_element<I, Tuple>::type> stage;
+        typedef comp_tuple_ops<Tuple, I+1, N> next;
+        static int init(Tuple& t) { return (stage::init(std::get<I>(t)) < 0) ? -1 : next::init(t); }
+        static void end(Tuple& t) { stage::end(std::get<I>(t)); next::end(t); }
+        static void eos(Tuple& t, ssize_t id) { stage::eos(std::get<I>(t), id); next::eos(t, id); }
+        template<typename Comp> static void link(Tuple& t, Comp *comp) {
+            stage::link(std::get<I>(t), &Comp::template forward<I>, comp);
+            next::link(t, comp);
+        }
+    };
+
+    template<typename Tuple, size_t N>
+    struct comp_tuple_ops<Tuple, N, N> {
+        static int init(Tuple&) { return 0; }
+        static void end(Tuple&) { }
+        static void eos(Tuple&, ssize_t) { }
+        template<typename Comp> static void link(Tuple&, Comp *) { }
+    };
+
+    template<typename First, typename... Rest>
+    class ff_comp_t: public ff_node {
+
+        template<typename, size_t, size_t> friend struct comp_tuple_ops;
+
+    private:
+        typedef std::tuple<First, Rest...> stages_t;
+        typedef comp_fused<stages_t, 0> chain;
+        stages_t stages;
+
+        // callback of the I-th stage: what it sends out goes through the stages I+1..n and then out of the comp
+        template<size_t I>
+        static bool forward(void *task, unsigned long retry, unsigned long ticks, void *arg) {
+            typedef comp_fused<stages_t, I+1> rest;
+            typedef std::integral_constant<bool, std::is_pointer<typename rest::in_type>::value && std::is_pointer<typename rest::out_type>::value> pointers;
+            return ((ff_comp_t*) arg)->template send_out<rest>(task, retry, ticks, pointers());
+        }
+        template<typename R>
+        bool send_out(void *task, unsigned long retry, unsigned long ticks, std::true_type) {
+            void *out = (void*) R::run(stages, (typename R::in_type) task);
+            if (out == GO_ON) return true;
+            return ff_send_out(out, retry, ticks);
+        }
+        template<typename R>
+        bool send_out(void *, unsigned long, unsigned long, std::false_type) {
+            error("ff_comp_t: ff_send_out needs the following stages to map pointers to pointers\n");
+            return false;
+        }
+
+        // how a void* task coming from the FastFlow runtime is mapped onto the typed chain
+        enum { TASK_POINTER, TASK_IN_PLACE, TASK_UNSUPPORTED };
+        static const int task_kind =
+            (std::is_pointer<typename chain::in_type>::value && std::is_pointer<typename chain::out_type>::value) ? TASK_POINTER :
+            std::is_same<typename chain::in_type, typename chain::out_type>::value ? TASK_IN_PLACE : TASK_UNSUPPORTED;
+
+        template<int K> struct task_tag { };
+        void *svc_task(void *t, task_tag<TASK_POINTER>) { return (void*) chain::run(stages, (typename chain::in_type) t); }
+        void *svc_task(void *t, task_tag<TASK_IN_PLACE>) { // the task points to a value, the result overwrites it
+            typedef typename std::remove_cv<typename std::remove_reference<typename chain::in_type>::type>::type value_t;
+            *((value_t*)t) = chain::run(stages, *((value_t*)t));
+            return t;
+        }
+        void *svc_task(void *, task_tag<TASK_UNSUPPORTED>) {
+            error("ff_comp_t: a typed comp used as ff_node must map pointers to pointers or a type to itself\n");
+            return EOS;
+        }
+
+    protected:
+        void *svc(void *t) { return svc_task(t, task_tag<task_kind>()); }
+        int svc_init() { return comp_tuple_ops<stages_t>::init(stages); }
+        void svc_end() { comp_tuple_ops<stages_t>::end(stages); }
+        void eosnotify(ssize_t id=-1) { comp_tuple_ops<stages_t>::eos(stages, id); }
+
+    public:
+        typedef typename chain::in_type in_type;
+        typedef typename chain::out_type out_type;
+
+        ff_comp_t() { comp_tuple_ops<stages_t>::link(stages, this); }
+        explicit ff_comp_t(const First& first, const Rest&... rest): stages(first, rest...) { comp_tuple_ops<stages_t>::link(stages, this); }
+        // the callbacks of the stages are registered on the comp that owns them: a copy (or a moved comp) registers its own,
+        // assignment would keep the ones of the assigned object
+        ff_comp_t(const ff_comp_t& o): ff_node(), stages(o.stages) { comp_tuple_ops<stages_t>::link(stages, this); }
+        ff_comp_t(ff_comp_t&& o): ff_node(), stages(std::move(o.stages)) { comp_tuple_ops<stages_t>::link(stages, this); }
+        ff_comp_t& operator=(const ff_comp_t&) = delete;
+        ff_comp_t& operator=(ff_comp_t&&) = delete;
+        inline out_type run(in_type x) { return chain::run(stages, x); }
+        inline out_type operator()(in_type x) { return chain::run(stages, x); }
+        template<size_t I> typename std::tuple_element<I, stages_t>::type& get_stage() { return std::get<I>(stages); }
+        static constexpr size_t cardinality() { return std::tuple_size<stages_t>::value; }
+
+    };
+
 } // namespace ff
 
 #endif // FF_COMP_HPP
@@ -0,0 +1,338 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  This file implements a farm of comps that can change the number of its active workers while it runs.
+ *  ff_comp_farm_base is the core shared by the farms of comps: a single node (a stage of a pipeline) that owns a thread for
+ *  every replica it has been given (typically comps of the same stages) and sends out the results itself, optionally in
+ *  the same order of the tasks, blocking the previous stage when too many tasks are into the farm. A farm only decides how
+ *  the tasks are queued (dispatch) and how a worker takes its next one (next_task).
+ *  ff_comp_farm dispatches the tasks to the active workers through a shared queue.
+ *  With autoscaling enabled the farm samples, once per period, how many tasks are waiting for a worker and how busy the
+ *  active workers have been: one more worker is activated when tasks are waiting and the workers are busy, one is parked
+ *  when they are mostly idle. Parked workers block on a condition variable, they don't spin.
+ *  NOTE: replicas are not owned by the farm, their svc_init/svc_end are called on their own worker thread and they can't
+ *  send out tasks with ff_send_out (a single result per task, GO_ON/EOS results are dropped).
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_COMPFARM_HPP
+#define FF_COMPFARM_HPP
+
+#include "comp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ff {
+
+    class ff_comp_farm_base: public ff_node {
+
+    protected:
+        struct entry {
+            size_t seq;
+            void *task;
+        };
+        std::vector<ff_node *> replicas;
+        const bool ordered;
+        std::mutex lock;                    // results, counters and the queues of the derived farms unless they say otherwise
+        std::condition_variable work_cv, done_cv;
+        bool stopping;                      // set by svc_end, next_task returns false once the tasks are over
+        std::chrono::milliseconds period;   // a farm waiting for its results wakes up once per period to call tick
+        std::unique_ptr<std::atomic<unsigned long long>[]> busy_ns;
+
+         // queues the task (lock not held) and wakes up the worker(s) that may take it
+        virtual void dispatch(size_t seq, void *task) = 0;
+         // next task of the worker id, waiting for it on work_cv, false when the worker has to stop
+        virtual bool next_task(size_t id, entry& e) = 0;
+         // called before the workers start, to reset the state of the queues of a new run
+        virtual void reset() { }
+         // called before every task is dispatched and while the farm waits for its results
+        virtual void tick() { }
+         // stops and joins the workers, the destructor of a derived farm must call it (the workers call its hooks)
+        void stop();
+
+        void *svc(void *task);
+        int svc_init();
+        void svc_end() { stop(); }
+        void eosnotify(ssize_t id=-1);
+
+    private:
+        std::deque<entry> done;             // results, in completion order
+        std::map<size_t, void *> reorder;   // results waiting for the previous ones (ordered farm)
+        std::vector<std::thread> threads;
+        std::vector<size_t> worker_tasks;
+        size_t capacity, next_seq, next_out, in_flight, started;
+        bool init_failed;
+
+        void worker(size_t id);
+        bool ready() const; // lock held
+        void flush();
+
+    public:
+        ff_comp_farm_base(const std::vector<ff_node *>& replicas, bool ordered);
+        virtual ~ff_comp_farm_base() { }
+         // tasks that can be into the farm (queued or computed but not yet sent out) before svc blocks, default 4 per worker
+        void set_capacity(size_t tasks) { capacity = tasks ? tasks : 1; }
+         // tasks computed by the worker id, to be read at the end of the stream
+        size_t get_worker_tasks(size_t id) const { return worker_tasks[id]; }
+
+    };
+
+    inline ff_comp_farm_base::ff_comp_farm_base(const std::vector<ff_node *>& replicas, bool ordered) :
+        replicas(replicas), ordered(ordered), stopping(false), period(100),
+        busy_ns(new std::atomic<unsigned long long>[replicas.size()]), worker_tasks(replicas.size(), 0),
+        capacity(4*replicas.size()), next_seq(0), next_out(0), in_flight(0), started(0), init_failed(false) {
+        if (replicas.empty()) error("comp farm has no replicas\n");
+        if (!capacity) capacity = 1;
+    }
+
+    inline void ff_comp_farm_base::worker(size_t id) {
+        const int r = replicas[id]->svc_init();
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (r < 0) init_failed = true;
+            ++started;
+        }
+        done_cv.notify_all();
+        entry e;
+        while (next_task(id, e)) {
+            const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            void *out = replicas[id]->svc(e.task);
+            busy_ns[id] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count();
+            {
+                std::unique_lock<std::mutex> l(lock);
+                worker_tasks[id]++;
+                if (ordered) reorder[e.seq] = out;
+                else done.push_back({ e.seq, out });
+            }
+            done_cv.notify_all();
+        }
+        replicas[id]->svc_end();
+    }
+
+    inline bool ff_comp_farm_base::ready() const {
+        if (ordered) return !reorder.empty() && reorder.begin()->first == next_out;
+        return !done.empty();
+    }
+
+    // sends out the results that are ready, outside of the lock (ff_send_out may block)
+    inline void ff_comp_farm_base::flush() {
+        std::vector<void *> out;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            while (ready()) {
+                if (ordered) {
+                    out.push_back(reorder.begin()->second);
+                    reorder.erase(reorder.begin());
+                    next_out++;
+                } else {
+                    out.push_back(done.front().task);
+                    done.pop_front();
+                }
+                in_flight--;
+            }
+        }
+        for (void *t : out)
+            if (!comp_stop(t)) ff_send_out(t);
+    }
+
+    inline void *ff_comp_farm_base::svc(void *task) {
+        tick();
+        size_t seq;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            seq = next_seq++;
+            in_flight++;
+        }
+        dispatch(seq, task);
+        flush();
+        while (in_flight >= capacity) { // back pressure, the previous stage waits for the farm
+            {
+                std::unique_lock<std::mutex> l(lock);
+                done_cv.wait_for(l, period, [&] { return ready(); });
+            }
+            flush();
+            tick();
+        }
+        return GO_ON;
+    }
+
+    // the results of all the tasks are sent out before the end of the stream
+    inline void ff_comp_farm_base::eosnotify(ssize_t) {
+        while (in_flight > 0) {
+            {
+                std::unique_lock<std::mutex> l(lock);
+                done_cv.wait(l, [&] { return ready(); });
+            }
+            flush();
+        }
+    }
+
+    inline int ff_comp_farm_base::svc_init() {
+        if (replicas.empty()) return -1;
+        for (size_t i=0; i<replicas.size(); ++i) {
+            busy_ns[i] = 0;
+            worker_tasks[i] = 0;
+        }
+        next_seq = next_out = in_flight = started = 0;
+        stopping = init_failed = false;
+        reset();
+        for (size_t i=0; i<replicas.size(); ++i) threads.push_back(std::thread(&ff_comp_farm_base::worker, this, i));
+        std::unique_lock<std::mutex> l(lock);
+        done_cv.wait(l, [&] { return started == replicas.size(); });
+        return init_failed ? -1 : 0;
+    }
+
+    inline void ff_comp_farm_base::stop() {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (std::thread& t : threads) t.join();
+        threads.clear();
+    }
+
+    class ff_comp_farm: public ff_comp_farm_base {
+
+    public:
+        // a decision of the autoscaling controller: the number of active workers from time_ms (since svc_init) on, and the
+        // samples it has been taken from (average number of waiting tasks, fraction of time the active workers were busy)
+        struct scale_event {
+            double time_ms;
+            size_t workers;
+            double occupancy, utilization;
+        };
+
+    private:
+        std::deque<entry> queue;            // tasks waiting for a worker
+        size_t active, min_workers, max_workers;
+        bool autoscale;
+        std::chrono::steady_clock::time_point start, last_tick;
+        double occupancy_sum;
+        size_t occupancy_samples;
+        unsigned long long last_busy;
+        std::vector<scale_event> events;
+
+    protected:
+        void dispatch(size_t seq, void *task);
+        bool next_task(size_t id, entry& e);
+        void reset();
+        void tick();
+
+    public:
+         // one worker thread per replica, all of them active unless autoscaling is enabled
+        ff_comp_farm(const std::vector<ff_node *>& replicas, bool ordered=false);
+        ~ff_comp_farm() { stop(); }
+         // number of active workers, autoscaling is disabled
+        void set_workers(size_t n);
+         // the farm starts with min workers and the controller keeps them into [min, max] deciding once per period
+        void set_autoscale(size_t min, size_t max, std::chrono::milliseconds period=std::chrono::milliseconds(100));
+        size_t get_active_workers() const { return active; }
+        const std::vector<scale_event>& get_scale_events() const { return events; }
+
+    };
+
+    inline ff_comp_farm::ff_comp_farm(const std::vector<ff_node *>& replicas, bool ordered) :
+        ff_comp_farm_base(replicas, ordered), active(replicas.size()), min_workers(replicas.size()),
+        max_workers(replicas.size()), autoscale(false), occupancy_sum(0), occupancy_samples(0), last_busy(0) { }
+
+    inline void ff_comp_farm::set_workers(size_t n) {
+        std::unique_lock<std::mutex> l(lock);
+        autoscale = false;
+        active = std::max<size_t>(1, std::min(n, replicas.size()));
+        l.unlock();
+        work_cv.notify_all();
+    }
+
+    inline void ff_comp_farm::set_autoscale(size_t min, size_t max, std::chrono::milliseconds p) {
+        std::unique_lock<std::mutex> l(lock);
+        max_workers = std::max<size_t>(1, std::min(max, replicas.size()));
+        min_workers = std::max<size_t>(1, std::min(min, max_workers));
+        active = min_workers;
+        period = p;
+        autoscale = true;
+        l.unlock();
+        work_cv.notify_all();
+    }
+
+    inline void ff_comp_farm::dispatch(size_t seq, void *task) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            occupancy_sum += queue.size();
+            occupancy_samples++;
+            queue.push_back({ seq, task });
+        }
+        work_cv.notify_all(); // only an active worker can take it
+    }
+
+    inline bool ff_comp_farm::next_task(size_t id, entry& e) {
+        std::unique_lock<std::mutex> l(lock);
+        work_cv.wait(l, [&] { return stopping || (id < active && !queue.empty()); });
+        if (id >= active || queue.empty()) return false; // stopping
+        e = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    inline void ff_comp_farm::reset() {
+        start = last_tick = std::chrono::steady_clock::now();
+        last_busy = 0;
+        occupancy_sum = 0;
+        occupancy_samples = 0;
+        events.clear();
+        if (autoscale) active = min_workers;
+    }
+
+    inline void ff_comp_farm::tick() {
+        if (!autoscale) return;
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        const double elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now-last_tick).count();
+        if (elapsed_ns < std::chrono::duration_cast<std::chrono::nanoseconds>(period).count()) return;
+        unsigned long long busy = 0;
+        for (size_t i=0; i<replicas.size(); ++i) busy += busy_ns[i];
+        std::unique_lock<std::mutex> l(lock);
+        const double utilization = (busy - last_busy) / (elapsed_ns * active);
+        const double occupancy = occupancy_samples ? occupancy_sum / occupancy_samples : 0;
+        size_t workers = active;
+        if (occupancy >= 1 && utilization > 0.8 && active < max_workers) workers++;      // tasks are waiting for a worker
+        else if (utilization < 0.5 && active > min_workers) workers--;                   // workers are mostly idle
+        if (workers != active) {
+            active = workers;
+            scale_event e = { std::chrono::duration<double, std::milli>(now-start).count(), workers, occupancy, utilization };
+            events.push_back(e);
+        }
+        last_tick = now;
+        last_busy = busy;
+        occupancy_sum = 0;
+        occupancy_samples = 0;
+        l.unlock();
+        work_cv.notify_all();
+    }
+
+}
+
+#endif
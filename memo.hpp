@@ -0,0 +1,200 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  This file implements the memoization of pure stages of a comp (or of a whole prefix of a comp, given as a nested comp).
+ *  ff_memo_cache is a bounded map from the keys of the tasks to the values the stage has computed for them, split into
+ *  shards with their own lock (so it can be shared by the workers of a farm) and evicted with the CLOCK algorithm: every
+ *  hit marks the slot as referenced, the hand of the shard gives a second chance to referenced slots and reuses the first
+ *  one it finds unmarked.
+ *  ff_memo_node wraps a stage: the key of every task is looked up into the cache, on a hit the stored value is applied to
+ *  the task (load) and the stage isn't computed, on a miss the stage computes the task and the value of its result (store)
+ *  is cached.
+ *  NOTE: the wrapped stage must be a pure function of the key of its task and it can't send out tasks with ff_send_out (a
+ *  single result per task), GO_ON/EOS results are never cached.
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_MEMO_HPP
+#define FF_MEMO_HPP
+
+#include "comp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ff {
+
+    template<typename K, typename V, typename Hash=std::hash<K> >
+    class ff_memo_cache {
+
+    private:
+        struct slot {
+            K key;
+            V value;
+            bool used, referenced;
+            slot() : key(), value(), used(false), referenced(false) { }
+        };
+        struct shard {
+            std::mutex lock;
+            std::vector<slot> slots;
+            std::unordered_map<K, size_t, Hash> index;  // key -> slot
+            size_t hand;
+            shard() : hand(0) { }
+        };
+        std::unique_ptr<shard[]> shards;
+        const size_t nshards;
+        Hash hash;
+        std::atomic<size_t> hits, misses, evictions;
+
+        shard& shard_of(const K& key) { return shards[(hash(key) * 0x9E3779B97F4A7C15ull >> 32) % nshards]; }
+
+    public:
+         // capacity entries spread over the shards (no more shards than entries)
+        explicit ff_memo_cache(size_t capacity, size_t nshards=16) :
+            nshards(std::max<size_t>(1, std::min(nshards, capacity))), hits(0), misses(0), evictions(0) {
+            shards.reset(new shard[this->nshards]);
+            for (size_t s=0; s<this->nshards; ++s) {
+                const size_t entries = capacity / this->nshards + (s < capacity % this->nshards);
+                shards[s].slots.resize(entries ? entries : 1);
+                shards[s].index.reserve(shards[s].slots.size());
+            }
+        }
+
+        // copies the value cached for key into value, false on a miss
+        bool get(const K& key, V& value) {
+            shard& s = shard_of(key);
+            {
+                std::lock_guard<std::mutex> guard(s.lock);
+                typename std::unordered_map<K, size_t, Hash>::iterator it = s.index.find(key);
+                if (it != s.index.end()) {
+                    slot& sl = s.slots[it->second];
+                    sl.referenced = true;
+                    value = sl.value;
+                    hits++;
+                    return true;
+                }
+            }
+            misses++;
+            return false;
+        }
+
+        // caches value for key, evicting the first unreferenced entry under the hand of the shard if it's full
+        void put(const K& key, const V& value) {
+            shard& s = shard_of(key);
+            std::lock_guard<std::mutex> guard(s.lock);
+            typename std::unordered_map<K, size_t, Hash>::iterator it = s.index.find(key);
+            if (it != s.index.end()) { // computed by another worker in the meantime
+                s.slots[it->second].value = value;
+                return;
+            }
+            for (;;) {
+                slot& sl = s.slots[s.hand];
+                if (sl.used && sl.referenced) sl.referenced = false; // second chance
+                else break;
+                s.hand = (s.hand + 1) % s.slots.size();
+            }
+            slot& sl = s.slots[s.hand];
+            if (sl.used) {
+                s.index.erase(sl.key);
+                evictions++;
+            }
+            sl.key = key;
+            sl.value = value;
+            sl.used = true;
+            sl.referenced = false;
+            s.index[key] = s.hand;
+            s.hand = (s.hand + 1) % s.slots.size();
+        }
+
+        void clear() {
+            for (size_t i=0; i<nshards; ++i) {
+                std::lock_guard<std::mutex> guard(shards[i].lock);
+                for (slot& sl : shards[i].slots) sl = slot();
+                shards[i].index.clear();
+                shards[i].hand = 0;
+            }
+        }
+
+        size_t size() {
+            size_t n = 0;
+            for (size_t i=0; i<nshards; ++i) {
+                std::lock_guard<std::mutex> guard(shards[i].lock);
+                n += shards[i].index.size();
+            }
+            return n;
+        }
+        size_t get_hits() const { return hits; }
+        size_t get_misses() const { return misses; }
+        size_t get_evictions() const { return evictions; }
+
+    };
+
+    template<typename K, typename V, typename Hash=std::hash<K> >
+    class ff_memo_node: public ff_node {
+
+    public:
+        typedef std::function<K(void *)> key_f;                 // key of an input task
+        typedef std::function<V(void *)> store_f;               // value to cache from the result of the stage
+        typedef std::function<void *(void *, const V&)> load_f; // result of the stage, given the input task and the cached value
+
+    private:
+        ff_node *stage;
+        ff_memo_cache<K, V, Hash>& cache;
+        key_f key;
+        store_f store;
+        load_f load;
+        size_t hits, misses;
+
+    protected:
+        void *svc(void *task) {
+            const K k = key(task);
+            V v;
+            if (cache.get(k, v)) {
+                hits++;
+                return load(task, v);
+            }
+            misses++;
+            void *out = stage->svc(task);
+            if (!comp_stop(out)) cache.put(k, store(out));
+            return out;
+        }
+        int svc_init() {
+            hits = misses = 0;
+            return stage->svc_init();
+        }
+        void svc_end() { stage->svc_end(); }
+        void eosnotify(ssize_t id=-1) { stage->eosnotify(id); }
+
+    public:
+         // the cache is not owned by the node, the same cache can be given to the replicas of a stage into a farm
+        ff_memo_node(ff_node *stage, ff_memo_cache<K, V, Hash>& cache, key_f key, store_f store, load_f load) :
+            stage(stage), cache(cache), key(key), store(store), load(load), hits(0), misses(0) { }
+         // hits and misses of this node (the cache counts the ones of all the nodes sharing it)
+        size_t get_hits() const { return hits; }
+        size_t get_misses() const { return misses; }
+
+    };
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*  
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  This file implements a recycling pool of tasks that the nodes of a comp, a pipeline or a farm can draw their tasks
+ *  from and give them back to, instead of allocating and freeing every task on the heap.
+ *  Tasks are allocated in slabs and never released until the pool is destroyed, every thread (every node) keeps a small
+ *  private cache of tasks and it exchanges them with the shared pool in bunches, so the pool lock is rarely taken.
+ *  NOTE: recycled tasks are handed out as they were given back, the user has to overwrite them.
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_TASKPOOL_HPP
+#define FF_TASKPOOL_HPP
+
+#include <mutex>
+#include <vector>
+
+namespace ff {
+
+    template<typename T>
+    class ff_task_pool {
+
+    private:
+        std::mutex lock;
+        std::vector<T *> free_list;
+        std::vector<T *> slabs;
+        const size_t slab_size;
+        size_t exchanges;
+
+        void grow() { // lock held
+            T *slab = new T[slab_size];
+            slabs.push_back(slab);
+            for (size_t i=0; i<slab_size; ++i) free_list.push_back(&slab[i]);
+        }
+
+    public:
+
+        // private front end of the pool, it must be used by a single thread (ex. a member of a node used only into svc)
+        class cache {
+        private:
+            ff_task_pool& pool;
+            std::vector<T *> items;
+            const size_t capacity;
+        public:
+            cache(ff_task_pool& pool, size_t capacity=64): pool(pool), capacity(capacity ? capacity : 1) { items.reserve(this->capacity); }
+            ~cache() { flush(); }
+            T *get() {
+                if (items.empty()) pool.take(items, capacity/2 + 1);
+                T *t = items.back();
+                items.pop_back();
+                return t;
+            }
+            void put(T *t) {
+                if (items.size() >= capacity) pool.give(items, capacity/2);
+                items.push_back(t);
+            }
+            void flush() { pool.give(items, items.size()); }
+        };
+
+        explicit ff_task_pool(size_t slab_size=1024): slab_size(slab_size ? slab_size : 1), exchanges(0) { }
+        ~ff_task_pool() { for (T *slab : slabs) delete[] slab; } // every task is released, even the ones still in use
+
+        // shared (locked) access, used by threads without a cache
+        T *get() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (free_list.empty()) grow();
+            T *t = free_list.back();
+            free_list.pop_back();
+            return t;
+        }
+        void put(T *t) {
+            std::lock_guard<std::mutex> guard(lock);
+            free_list.push_back(t);
+        }
+
+        // moves n tasks into items, the pool grows if it has not enough free tasks
+        void take(std::vector<T *>& items, size_t n) {
+            std::lock_guard<std::mutex> guard(lock);
+            ++exchanges;
+            while (free_list.size() < n) grow();
+            items.insert(items.end(), free_list.end()-n, free_list.end());
+            free_list.resize(free_list.size()-n);
+        }
+        // gives back the last n tasks of items
+        void give(std::vector<T *>& items, size_t n) {
+            if (n == 0) return;
+            std::lock_guard<std::mutex> guard(lock);
+            ++exchanges;
+            free_list.insert(free_list.end(), items.end()-n, items.end());
+            items.resize(items.size()-n);
+        }
+
+        // statistics: heap allocations done by the pool (one per slab), tasks created so far, tasks into the pool (not taken
+        // by a cache or a thread) and exchanges with the caches
+        size_t heap_allocations() { std::lock_guard<std::mutex> guard(lock); return slabs.size(); }
+        size_t tasks() { std::lock_guard<std::mutex> guard(lock); return slabs.size()*slab_size; }
+        size_t free_tasks() { std::lock_guard<std::mutex> guard(lock); return free_list.size(); }
+        size_t cache_exchanges() { std::lock_guard<std::mutex> guard(lock); return exchanges; }
+
+    };
+
+} // namespace ff
+
+#endif // FF_TASKPOOL_HPP
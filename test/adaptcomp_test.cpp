@@ -0,0 +1,126 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Adaptive comp test:
+ *  Pipe(Source, Adaptive(Step, Step, Step), Drain) over the stream [1, ..., n], Step computes 2x+1 spinning for a while
+ *  Expected 8x+7 for every x in the stream order, with coarse stages and a fast source the node switches to pipelined
+ *  execution and back to fused when the source slows down, with fine stages and a slow source it never leaves fused
+ *  execution, then a fixed pipelined comp whose first stage drops the odd tasks (the even ones still in order)
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../adaptcomp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Step : ff_node {
+    const int spin_us;
+    Step(int spin_us) : spin_us(spin_us) { }
+    void* svc(void *t){
+        const chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::microseconds(spin_us);
+        while (chrono::steady_clock::now() < end);
+        *((int*)t) = 2*(*((int*)t))+1;
+        return t;
+    }
+};
+
+struct DropOdd : ff_node {
+    void* svc(void *t){
+        if (*((int*)t) % 2) {
+            delete (int*) t;
+            return GO_ON;
+        }
+        return t;
+    }
+};
+
+struct Source : ff_node {
+    int counter;
+    const int n, sleep_us, slow_from;
+    Source(int n, int sleep_us, int slow_from) : n(n), sleep_us(sleep_us), slow_from(slow_from) { }
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        if (sleep_us && counter > slow_from) this_thread::sleep_for(chrono::microseconds(sleep_us));
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+// the source sleeps sleep_us before every task after the first slow_from
+vector<int> run(ff_adaptive_comp& comp, int n, int sleep_us=0, int slow_from=0) {
+    Source source(n, sleep_us, slow_from);
+    Drain drain;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&comp);
+    pipe.add_stage(&drain);
+    assert(pipe.run_and_wait_end() == 0);
+    return drain.data;
+}
+
+vector<int> expected(int n) {
+    vector<int> e;
+    for (int i=1; i<=n; ++i) e.push_back(8*i+7);
+    return e;
+}
+
+int main() {
+    cout << "Executing coarse stages test..." << endl;
+    Step a(100), b(100), c(100);
+    ff_adaptive_comp coarse(3);
+    coarse.add_stage(&a);
+    coarse.add_stage(&b);
+    coarse.add_stage(&c);
+    coarse.set_window(64);
+    assert(run(coarse, 1000, 1000, 500) == expected(1000)); // slow source for the second half of the stream
+    const vector<ff_adaptive_comp::switch_event>& sw = coarse.get_switches();
+    assert(sw.size() >= 2 && sw[0].mode == COMP_PIPELINED && sw[0].segments > 1 && sw[0].task <= 500);
+    assert(sw.back().mode == COMP_FUSED && sw.back().task > 500 && coarse.get_mode() == COMP_FUSED);
+    cout << "-> PASSED (" << coarse.get_switches().size() << " switches)" << endl;
+
+    cout << "Executing fine stages test..." << endl;
+    Step d(1), e(1), f(1);
+    ff_adaptive_comp fine(3);
+    fine.add_stage(&d);
+    fine.add_stage(&e);
+    fine.add_stage(&f);
+    fine.set_window(64);
+    assert(run(fine, 300, 200) == expected(300));
+    assert(fine.get_switches().empty() && fine.get_mode() == COMP_FUSED);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing fixed pipelined test..." << endl;
+    DropOdd drop;
+    Step g(0), h(0);
+    ff_adaptive_comp fixed(3);
+    fixed.add_stage(&drop);
+    fixed.add_stage(&g);
+    fixed.add_stage(&h);
+    fixed.set_mode(COMP_PIPELINED);
+    fixed.set_capacity(4);
+    vector<int> out = run(fixed, 1000);
+    assert(fixed.get_segments() == 3 && out.size() == 500);
+    for (size_t i=0; i<out.size(); ++i) assert(out[i] == 4*(2*(int) i+2)+3);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Async comp test (C++20):
+ *  Pipe(Source, AsyncComp(Incr, SlowRead, Doub), Drain) over the stream [1, ..., n], SlowRead co_awaits a blocking read of
+ *  20ms run by the pool of the comp
+ *  Expected Doub(SlowRead(Incr(x))) = 2(x+1)+2 for every x, in the stream order for the ordered comp, at most the
+ *  concurrency limit of tasks in flight and reads overlapped (much less than n reads in a row), then a stage that
+ *  co_awaits an event set by another thread
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../asynccomp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+int slow_read(int x) {
+    this_thread::sleep_for(chrono::milliseconds(20));
+    return x+1;
+}
+
+struct SlowRead : ff_node, ff_async_stage {
+    void *svc(void *t) {
+        *((int*)t) = slow_read(*((int*)t));
+        return t;
+    }
+    ff_async<void *> svc_async(void *t) {
+        const int x = *((int*)t);
+        *((int*)t) = co_await ff_async_call([x] { return slow_read(x); });
+        co_return t;
+    }
+};
+
+struct WaitEvent : ff_node, ff_async_stage {
+    ff_async_event<int>& event;
+    WaitEvent(ff_async_event<int>& event) : event(event) { }
+    void *svc(void *t) { return t; }
+    ff_async<void *> svc_async(void *t) {
+        *((int*)t) += co_await event;
+        co_return t;
+    }
+};
+
+struct Source : ff_node {
+    int counter;
+    const int n;
+    Source(int n) : n(n) { }
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+vector<int> run(ff_async_comp& comp, int n) {
+    Source source(n);
+    Drain drain;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&comp);
+    pipe.add_stage(&drain);
+    assert(pipe.run_and_wait_end() == 0);
+    return drain.data;
+}
+
+int main() {
+    const int n = 64;
+    vector<int> expected;
+    for (int i=1; i<=n; ++i) expected.push_back(2*(i+2));
+
+    cout << "Executing ordered async comp test..." << endl;
+    Incr incr;
+    SlowRead read;
+    Doub doub;
+    ff_async_comp ordered(true);
+    ordered.add_stage(&incr);
+    ordered.add_stage(&read);
+    ordered.add_stage(&doub);
+    ordered.set_concurrency(8);
+    ordered.set_io_threads(8);
+    const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    assert(run(ordered, n) == expected);
+    const double ms = chrono::duration<double, milli>(chrono::steady_clock::now()-t0).count();
+    assert(ordered.get_max_in_flight() == 8);
+    assert(ordered.get_suspensions() == (size_t) n);
+    assert(ms < n*20/2); // 8 reads at a time, about n*20/8
+    cout << "-> PASSED (" << ms << "ms, " << n*20 << "ms reading one task at a time)" << endl;
+
+    cout << "Executing unordered async comp test..." << endl;
+    ff_async_comp unordered;
+    unordered.add_stage(&incr);
+    unordered.add_stage(&read);
+    unordered.add_stage(&doub);
+    unordered.set_concurrency(3);
+    vector<int> out = run(unordered, n);
+    sort(out.begin(), out.end());
+    assert(out == expected);
+    assert(unordered.get_max_in_flight() == 3);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing async event test..." << endl;
+    ff_async_event<int> event;
+    WaitEvent wait(event);
+    ff_async_comp waiting(true);
+    waiting.add_stage(&incr);
+    waiting.add_stage(&wait);
+    thread setter([&] {
+        this_thread::sleep_for(chrono::milliseconds(20));
+        event.set(100);
+    });
+    out = run(waiting, 4); // the source ends before the event is set, the tasks wait into the comp
+    setter.join();
+    assert(out == vector<int>({ 102, 103, 104, 105 }));
+    assert(waiting.get_max_in_flight() == 4);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
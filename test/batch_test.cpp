@@ -0,0 +1,73 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Batch test:
+ *  Running a comp over an array of tasks with every batch mode
+ *  Comp(Incr, Doub, Incr) applied to [0, 1, ..., n-1]
+ *  Expected Incr(Doub(Incr(x))) = 2x+3 for every x in the batch
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    } 
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+bool check_batch(ff_comp& comp, comp_batch_mode mode, size_t n) {
+    vector<int> values(n);
+    vector<void*> tasks(n);
+    for (size_t i=0; i<n; ++i) {
+        values[i] = (int) i;
+        tasks[i] = &values[i];
+    }
+    if (comp.run_batch(tasks.data(), n, mode)<0) return false;
+    for (size_t i=0; i<n; ++i) 
+        if (tasks[i] != &values[i] || values[i] != 2*((int)i)+3) return false;
+    return true;
+}
+
+int main() {
+    Incr incr1, incr2;
+    Doub doub;
+    ff_comp comp;
+    comp.add_stage(&incr1);
+    comp.add_stage(&doub);
+    comp.add_stage(&incr2);
+    comp.set_batch_grain(7); // not a divisor of the batch size, the last chunk is a partial one
+    cout << "Executing batch test in task major mode..." << endl;
+    assert(check_batch(comp, COMP_TASK_MAJOR, 1000));
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    cout << "Executing batch test in stage major mode..." << endl;
+    assert(check_batch(comp, COMP_STAGE_MAJOR, 1000));
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    cout << "Executing batch test in auto mode..." << endl;
+    assert(check_batch(comp, COMP_BATCH_AUTO, 1000));
+    assert(check_batch(comp, COMP_BATCH_AUTO, 1));
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    cout << "Executing batch test on an empty comp..." << endl;
+    ff_comp empty;
+    int foo = 0;
+    void* task = &foo;
+    assert(empty.run_batch(&task, 1)<0);
+    cout << "-> PASSED" << endl;
+    return EXIT_SUCCESS;
+}
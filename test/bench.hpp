@@ -0,0 +1,181 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Small harness used by the benchmarks: every variant is executed a configurable number of times after some warm-up runs
+ *  (not measured), every repetition is timed with steady_clock and the samples are summarized with median, mean, standard
+ *  deviation and a 95% confidence interval of the mean (Student's t). The results can be written as JSON or CSV together
+ *  with the configuration of the benchmark and a description of the machine, so runs on different hosts can be compared.
+ *
+*/
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+namespace bench {
+
+    struct config {
+        unsigned warmup;      // runs executed before the measured ones
+        unsigned repetitions; // measured runs
+        config(unsigned warmup=1, unsigned repetitions=5) : warmup(warmup), repetitions(repetitions ? repetitions : 1) { }
+    };
+
+    struct result {
+        std::string name;
+        std::vector<double> samples; // milliseconds, one per repetition
+        double median, mean, stddev, ci_low, ci_high, min, max;
+    };
+
+    // two sided 95% quantile of Student's t distribution with df degrees of freedom
+    inline double t_quantile(size_t df) {
+        static const double table[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179,
+                                        2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                        2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+        if (df == 0) return 0;
+        if (df <= 30) return table[df-1];
+        return 1.960;
+    }
+
+    inline result summarize(const std::string& name, const std::vector<double>& samples) {
+        result r;
+        r.name = name;
+        r.samples = samples;
+        std::vector<double> sorted(samples);
+        std::sort(sorted.begin(), sorted.end());
+        const size_t n = sorted.size();
+        r.median = (n%2) ? sorted[n/2] : (sorted[n/2-1]+sorted[n/2]) / 2;
+        r.min = sorted.front();
+        r.max = sorted.back();
+        r.mean = 0;
+        for (double s : samples) r.mean += s;
+        r.mean /= n;
+        double var = 0;
+        for (double s : samples) var += (s-r.mean)*(s-r.mean);
+        r.stddev = (n > 1) ? std::sqrt(var / (n-1)) : 0;
+        const double half = t_quantile(n-1) * r.stddev / std::sqrt((double) n);
+        r.ci_low = r.mean - half;
+        r.ci_high = r.mean + half;
+        return r;
+    }
+
+    // runs prepare() and then run() warmup+repetitions times, only run() is timed (prepare builds what a run consumes,
+    // e.g. a new pipeline or the input of an in place computation)
+    template<typename Prepare, typename Run>
+    result measure(const std::string& name, const config& cfg, Prepare prepare, Run run) {
+        std::vector<double> samples;
+        for (unsigned i=0; i<cfg.warmup+cfg.repetitions; ++i) {
+            prepare();
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            run();
+            const std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+            if (i >= cfg.warmup) samples.push_back(std::chrono::duration<double, std::milli>(stop-start).count());
+        }
+        return summarize(name, samples);
+    }
+
+    template<typename Run>
+    result measure(const std::string& name, const config& cfg, Run run) {
+        return measure(name, cfg, []() { }, run);
+    }
+
+    // key/value description of a benchmark run, machine() fills in the host the benchmark runs on
+    struct metadata {
+        std::vector<std::pair<std::string, std::string> > entries;
+
+        template<typename T>
+        void add(const std::string& key, const T& value) {
+            std::ostringstream s;
+            s << value;
+            entries.push_back(std::make_pair(key, s.str()));
+        }
+
+        void machine() {
+            char host[256] = "unknown";
+            gethostname(host, sizeof(host)-1);
+            add("host", host);
+            struct utsname u;
+            if (uname(&u) == 0) add("kernel", std::string(u.sysname) + " " + u.release + " " + u.machine);
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            std::string line;
+            while (std::getline(cpuinfo, line))
+                if (line.compare(0, 10, "model name") == 0) {
+                    add("cpu", line.substr(line.find(':') + 2));
+                    break;
+                }
+            add("online_cores", sysconf(_SC_NPROCESSORS_ONLN));
+#ifdef __VERSION__
+            add("compiler", __VERSION__);
+#endif
+            char date[32];
+            const std::time_t now = std::time(nullptr);
+            std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+            add("date", date);
+        }
+    };
+
+    inline std::string json_escape(const std::string& s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if ((unsigned char) c < 0x20) out += ' ';
+            else out += c;
+        }
+        return out;
+    }
+
+    inline void write_json(std::ostream& out, const metadata& meta, const std::vector<result>& results) {
+        out << "{\n  \"metadata\": {";
+        for (size_t i=0; i<meta.entries.size(); ++i)
+            out << (i ? "," : "") << "\n    \"" << json_escape(meta.entries[i].first) << "\": \""
+                << json_escape(meta.entries[i].second) << "\"";
+        out << "\n  },\n  \"results\": [";
+        for (size_t i=0; i<results.size(); ++i) {
+            const result& r = results[i];
+            out << (i ? "," : "") << "\n    { \"name\": \"" << json_escape(r.name) << "\", \"unit\": \"ms\", \"median\": " << r.median
+                << ", \"mean\": " << r.mean << ", \"stddev\": " << r.stddev << ", \"ci95_low\": " << r.ci_low
+                << ", \"ci95_high\": " << r.ci_high << ", \"min\": " << r.min << ", \"max\": " << r.max << ", \"samples\": [";
+            for (size_t s=0; s<r.samples.size(); ++s) out << (s ? ", " : "") << r.samples[s];
+            out << "] }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    // one row per variant, the metadata are written as comment lines before the header
+    inline void write_csv(std::ostream& out, const metadata& meta, const std::vector<result>& results) {
+        for (const std::pair<std::string, std::string>& e : meta.entries) out << "# " << e.first << ": " << e.second << "\n";
+        out << "name,repetitions,median_ms,mean_ms,stddev_ms,ci95_low_ms,ci95_high_ms,min_ms,max_ms\n";
+        for (const result& r : results)
+            out << r.name << "," << r.samples.size() << "," << r.median << "," << r.mean << "," << r.stddev << ","
+                << r.ci_low << "," << r.ci_high << "," << r.min << "," << r.max << "\n";
+    }
+
+    // writes the results to path, as CSV if its extension is .csv and as JSON otherwise, returns false on error
+    inline bool write(const std::string& path, const metadata& meta, const std::vector<result>& results) {
+        std::ofstream out(path.c_str());
+        if (!out) return false;
+        out.precision(9);
+        if (path.size() >= 4 && path.compare(path.size()-4, 4, ".csv") == 0) write_csv(out, meta, results);
+        else write_json(out, meta, results);
+        return (bool) out;
+    }
+
+    inline void print(std::ostream& out, const result& r) {
+        out << "Done! [Elapsed time: " << r.median << "(ms) median of " << r.samples.size() << ", stddev " << r.stddev
+            << "(ms), 95% CI [" << r.ci_low << ", " << r.ci_high << "](ms)]" << std::endl;
+    }
+
+}
+
+#endif
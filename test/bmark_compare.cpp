@@ -0,0 +1,134 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Benchmark regression comparator, it reads the traces of the benchmarks (legacy text traces under ffcomp_bmarks/, output
+ *  of comp_benchmark and its -o JSON/CSV files, see bmark_store.hpp) and:
+ *    ingest store.csv trace...   appends the results of the traces to a common store (created if it doesn't exist)
+ *    show path...                prints the results read from traces, directories or stores, merged by key
+ *    compare baseline current    compares every result of current with the baseline of the same machine, benchmark,
+ *                                configuration, variant and metric (each one can be a trace, a directory or a store)
+ *  A result is a regression when its mean time is larger than the baseline one by more than -m percent (default 5) and
+ *  Welch's t-test says the slowdown is significant at level -a (default 0.01). A result that has a single sample on one
+ *  side, or an unknown number of samples (n=? into a store), can't be tested and it's reported as a regression when it
+ *  exceeds the threshold only if -s is given.
+ *  Exit status: 0 no regression, 1 regressions found, 2 usage or input error.
+ *
+*/
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "bmark_store.hpp"
+
+using namespace std;
+
+void print_usage(ostream& out) {
+    out << "Usage: bmark_compare ingest store.csv trace...\n"
+        << "       bmark_compare show path...\n"
+        << "       bmark_compare compare [-a alpha] [-m min slowdown %] [-s] baseline current" << endl;
+}
+
+bool load_all(char **paths, int n, vector<bmark::record>& records) {
+    for (int i=0; i<n; ++i)
+        if (!bmark::load(paths[i], records)) {
+            cerr << "Error: reading " << paths[i] << endl;
+            return false;
+        }
+    return true;
+}
+
+int ingest(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage(cerr);
+        return 2;
+    }
+    vector<bmark::record> records;
+    if (!load_all(argv+1, argc-1, records)) return 2;
+    const bool exists = ifstream(argv[0]).good();
+    ofstream store(argv[0], ios::app);
+    if (!store) {
+        cerr << "Error: opening the store " << argv[0] << endl;
+        return 2;
+    }
+    store << setprecision(9);
+    bmark::write_store(store, records, !exists);
+    cout << records.size() << " results added to " << argv[0] << endl;
+    return 0;
+}
+
+int show(int argc, char **argv) {
+    vector<bmark::record> records;
+    if (!load_all(argv, argc, records)) return 2;
+    vector<bmark::record> merged;
+    for (const auto& e : bmark::index(records)) merged.push_back(e.second);
+    bmark::write_store(cout, merged);
+    return 0;
+}
+
+int compare(int argc, char **argv) {
+    double alpha = 0.01, min_slowdown = 5;
+    bool single = false;
+    int param;
+    optind = 1;
+    while ((param = getopt(argc, argv, "a:m:s")) != -1) {
+        switch (param) {
+        case 'a': alpha = atof(optarg); break;
+        case 'm': min_slowdown = atof(optarg); break;
+        case 's': single = true; break;
+        default:
+            print_usage(cerr);
+            return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage(cerr);
+        return 2;
+    }
+    vector<bmark::record> baseline_records, current_records;
+    if (!load_all(argv+optind, 1, baseline_records) || !load_all(argv+optind+1, 1, current_records)) return 2;
+    const auto baseline = bmark::index(baseline_records);
+    const auto current = bmark::index(current_records);
+
+    size_t compared = 0, regressions = 0;
+    cout << fixed;
+    for (const auto& e : current) {
+        const auto base = baseline.find(e.first);
+        if (base == baseline.end()) continue;
+        const bmark::record& b = base->second;
+        const bmark::record& c = e.second;
+        const bmark::welch_result w = bmark::welch(b, c);
+        const double change = (b.mean > 0) ? (c.mean - b.mean) / b.mean * 100 : 0;
+        const bool slower = change > min_slowdown;
+        const bool regression = slower && (w.testable ? w.p < alpha : single);
+        compared++;
+        if (regression) regressions++;
+        cout << (regression ? "REGRESSION " : "ok         ") << e.first << ": " << setprecision(3) << b.mean << " -> " << c.mean
+             << " " << c.unit << " (" << showpos << setprecision(2) << change << noshowpos << "%";
+        if (w.testable) cout << ", p=" << setprecision(4) << w.p << ", n=" << b.n << "/" << c.n;
+        else cout << (b.counted && c.counted ? ", single sample, not tested" : ", unknown number of samples, not tested");
+        cout << ")\n";
+    }
+    if (compared == 0) {
+        cerr << "Error: no result of " << argv[optind+1] << " has a baseline in " << argv[optind] << endl;
+        return 2;
+    }
+    cout << compared << " results compared, " << regressions << " regressions" << endl;
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        print_usage(argc > 1 && string(argv[1]) == "-h" ? cout : cerr);
+        return (argc > 1 && string(argv[1]) == "-h") ? EXIT_SUCCESS : 2;
+    }
+    const string command = argv[1];
+    if (command == "ingest") return ingest(argc-2, argv+2);
+    if (command == "show") return show(argc-2, argv+2);
+    if (command == "compare") return compare(argc-1, argv+1);
+    print_usage(cerr);
+    return 2;
+}
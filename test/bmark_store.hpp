@@ -0,0 +1,416 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Common store of benchmark results used by bmark_compare. Every result is summarized by a record (number of samples,
+ *  mean, standard deviation, min and max) identified by machine, benchmark, configuration, variant and metric, records are
+ *  read from:
+ *    - the legacy text traces under ffcomp_bmarks/ (comp_benchmark output, videobenchmark.sh summaries and the optional
+ *      ffvideofarm runs), the machine is taken from the shell prompt or from the name of the directory of the trace
+ *    - the text output of the current comp_benchmark and the JSON/CSV files it writes with -o (see bench.hpp)
+ *    - a store file, a CSV with one record per line written by write_store
+ *  Times are in milliseconds, lower is better for every metric. videobenchmark.sh only kept average, min and max of its
+ *  iterations, the standard deviation of these records is estimated as (max-min)/4 and their number of samples is taken
+ *  from the header of the trace or from its last iteration number. When neither has been kept the record is not counted:
+ *  it is shown but it can't be tested, and it makes the records it is merged with not counted too.
+ *
+*/
+
+#ifndef BMARK_STORE_HPP
+#define BMARK_STORE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace bmark {
+
+    struct record {
+        std::string machine, benchmark, config, variant, metric, unit, source;
+        size_t n;
+        double mean, stddev, min, max;
+        bool counted; // false if the number of samples behind the summary is unknown (n is then 1), "?" into a store
+
+        record() : unit("ms"), n(0), mean(0), stddev(0), min(0), max(0), counted(true) { }
+        std::string key() const { return machine + "/" + benchmark + "/" + config + "/" + variant + "/" + metric; }
+    };
+
+    inline record single(double value) {
+        record r;
+        r.n = 1;
+        r.mean = r.min = r.max = value;
+        return r;
+    }
+
+    // summary of the union of the samples of a and b (a and b must have the same key), a record that is not counted can't
+    // be weighted by its samples: the union isn't counted, its stddev is estimated from its range as for the traces
+    inline record merge(const record& a, const record& b) {
+        if (a.n == 0) return b;
+        if (b.n == 0) return a;
+        record r = a;
+        const double n = a.n + b.n;
+        const double delta = b.mean - a.mean;
+        const double m2 = a.stddev*a.stddev*(a.n-1) + b.stddev*b.stddev*(b.n-1) + delta*delta*a.n*b.n/n;
+        r.n = a.n + b.n;
+        r.mean = a.mean + delta*b.n/n;
+        r.stddev = std::sqrt(m2 / (n-1));
+        r.min = std::min(a.min, b.min);
+        r.max = std::max(a.max, b.max);
+        r.counted = a.counted && b.counted;
+        if (!r.counted) {
+            r.n = 1;
+            r.stddev = (r.max - r.min) / 4;
+        }
+        if (a.source != b.source) r.source = "merged";
+        return r;
+    }
+
+    // ------------------------------------------------------------------------------------------------------------------------
+    // statistics
+    // ------------------------------------------------------------------------------------------------------------------------
+
+    // continued fraction of the regularized incomplete beta function (Lentz's method)
+    inline double beta_cf(double a, double b, double x) {
+        const double tiny = 1e-300;
+        double c = 1, d = 1 - (a+b)*x/(a+1);
+        if (std::fabs(d) < tiny) d = tiny;
+        d = 1/d;
+        double h = d;
+        for (int m=1; m<=300; ++m) {
+            const double m2 = 2*m;
+            double aa = m*(b-m)*x / ((a+m2-1)*(a+m2));
+            d = 1 + aa*d; if (std::fabs(d) < tiny) d = tiny;
+            c = 1 + aa/c; if (std::fabs(c) < tiny) c = tiny;
+            d = 1/d;
+            h *= d*c;
+            aa = -(a+m)*(a+b+m)*x / ((a+m2)*(a+m2+1));
+            d = 1 + aa*d; if (std::fabs(d) < tiny) d = tiny;
+            c = 1 + aa/c; if (std::fabs(c) < tiny) c = tiny;
+            d = 1/d;
+            const double del = d*c;
+            h *= del;
+            if (std::fabs(del-1) < 1e-14) break;
+        }
+        return h;
+    }
+
+    inline double incomplete_beta(double a, double b, double x) {
+        if (x <= 0) return 0;
+        if (x >= 1) return 1;
+        const double front = std::exp(std::lgamma(a+b) - std::lgamma(a) - std::lgamma(b) + a*std::log(x) + b*std::log(1-x));
+        if (x < (a+1)/(a+b+2)) return front * beta_cf(a, b, x) / a;
+        return 1 - front * beta_cf(b, a, 1-x) / b;
+    }
+
+    // P(T > t) for a Student's t distribution with df degrees of freedom
+    inline double t_upper_tail(double t, double df) {
+        const double tail = 0.5 * incomplete_beta(df/2, 0.5, df/(df+t*t));
+        return (t >= 0) ? tail : 1-tail;
+    }
+
+    struct welch_result {
+        double t, df, p; // p is one sided: probability of a mean of current at least this larger than the baseline one
+        bool testable;   // false if one of the two sides has a single sample or isn't counted
+    };
+
+    inline welch_result welch(const record& baseline, const record& current) {
+        welch_result w = { 0, 0, 1, baseline.n > 1 && current.n > 1 && baseline.counted && current.counted };
+        if (!w.testable) return w;
+        const double vb = baseline.stddev*baseline.stddev / baseline.n;
+        const double vc = current.stddev*current.stddev / current.n;
+        if (vb + vc == 0) {
+            w.p = (current.mean > baseline.mean) ? 0 : 1;
+            return w;
+        }
+        w.t = (current.mean - baseline.mean) / std::sqrt(vb+vc);
+        w.df = (vb+vc)*(vb+vc) / (vb*vb/(baseline.n-1) + vc*vc/(current.n-1));
+        w.p = t_upper_tail(w.t, w.df);
+        return w;
+    }
+
+    // ------------------------------------------------------------------------------------------------------------------------
+    // parsing
+    // ------------------------------------------------------------------------------------------------------------------------
+
+    inline std::string trim(const std::string& s) {
+        const size_t first = s.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) return "";
+        return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+    }
+
+    inline bool starts_with(const std::string& s, const std::string& prefix) { return s.compare(0, prefix.size(), prefix) == 0; }
+
+    // number that follows the first occurrence of marker in line
+    inline bool number_after(const std::string& line, const std::string& marker, double& value) {
+        const size_t pos = line.find(marker);
+        if (pos == std::string::npos) return false;
+        const char *start = line.c_str() + pos + marker.size();
+        char *end;
+        value = std::strtod(start, &end);
+        return end != start;
+    }
+
+    inline std::string json_string(const std::string& line, const std::string& key) {
+        const std::string marker = "\"" + key + "\": \"";
+        const size_t pos = line.find(marker);
+        if (pos == std::string::npos) return "";
+        const size_t first = pos + marker.size();
+        return line.substr(first, line.find('"', first) - first);
+    }
+
+    inline std::string directory_name(const std::string& path) {
+        const size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos || slash == 0) return "unknown";
+        const std::string dir = path.substr(0, slash);
+        return dir.substr(dir.find_last_of('/') + 1);
+    }
+
+    // name used for a variant of comp_benchmark, from its "Running ... computation..." line
+    inline std::string comp_variant(const std::string& line) {
+        if (line.find("vectorized") != std::string::npos) return "vectorized comp";
+        if (line.find("batched") != std::string::npos) return "batched comp";
+        if (line.find("composed") != std::string::npos) return "comp";
+        if (line.find("pipelined") != std::string::npos) return "pipeline";
+        if (line.find("farmed") != std::string::npos) return "farm";
+        if (line.find("sequential") != std::string::npos) return "sequential";
+        return "";
+    }
+
+    inline std::string lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s;
+    }
+
+    // legacy traces and the text output of the benchmarks
+    inline void parse_text(std::istream& in, const std::string& path, std::vector<record>& out) {
+        std::string machine = directory_name(path), video, variant, benchmark;
+        double cores = 0, size_mb = 0, runs = 0, iterations = 0, last_iteration = -1;
+        std::vector<record> found;
+        std::string line;
+        while (std::getline(in, line)) {
+            line = trim(line);
+            const size_t at = line.find('@'), prompt = line.find("$ ");
+            if (at != std::string::npos && prompt != std::string::npos && at < prompt) {
+                machine = line.substr(at+1, line.find(':', at) - at - 1);
+                std::istringstream args(line.substr(prompt+2));
+                std::string arg;
+                while (args >> arg) if (arg.find('.') != std::string::npos && arg[0] != '.') video = arg;
+                continue;
+            }
+            double v;
+            if (number_after(line, "Number of cores (for the pipeline test):", v)) cores = v;
+            else if (number_after(line, "Data set size:", v)) size_mb = v;
+            else if (number_after(line, "Parallelism grain:", v)) runs = v;
+            else if (number_after(line, "Starting the benchmark with", v)) {
+                iterations = v;
+                last_iteration = -1;
+            }
+            else if (number_after(line, "iteration number:", v)) last_iteration = v;
+            else if (starts_with(line, "Running the optional farm test with")) {
+                variant = line.substr(std::string("Running the optional farm test with ").size());
+                variant = variant.substr(0, variant.find(' '));
+                if (variant == "pipeline") variant = "pipe";
+                benchmark = "videofarm";
+            } else if (starts_with(line, "Running ") && line.find("computation") != std::string::npos) {
+                variant = comp_variant(line);
+                benchmark = "comp_benchmark";
+            } else if (benchmark == "comp_benchmark" && !variant.empty() && number_after(line, "Done! [Elapsed time:", v)) {
+                record r = single(v);
+                r.benchmark = benchmark;
+                r.variant = variant;
+                r.metric = "completion_time";
+                double median, n, sd;
+                if (number_after(line, "(ms) median of", n) && number_after(line, "stddev", sd) && number_after(line, "Elapsed time:", median)) {
+                    r.n = (size_t) n; // summary of several repetitions, the median stands for the mean
+                    r.stddev = sd;
+                }
+                found.push_back(r);
+                variant.clear();
+            } else if (benchmark == "videofarm" && number_after(line, "Completion time:", v)) {
+                record r = single(v);
+                r.benchmark = benchmark;
+                r.variant = variant;
+                r.metric = "completion_time";
+                found.push_back(r);
+            } else if (benchmark == "videofarm" && number_after(line, "Average time per frame:", v)) {
+                record r = single(v);
+                r.benchmark = benchmark;
+                r.variant = variant;
+                r.metric = "frame_time";
+                found.push_back(r);
+            } else if (starts_with(line, "Average / Min / Max inner")) {
+                std::istringstream name(line.substr(std::string("Average / Min / Max inner ").size()));
+                std::string what;
+                name >> what;
+                record r;
+                const size_t colon = line.find(':');
+                std::istringstream values(line.substr(colon+1));
+                char sep;
+                if (colon == std::string::npos || !(values >> r.mean >> sep >> r.min >> sep >> r.max)) continue;
+                r.benchmark = "videobenchmark";
+                r.variant = lower(what);
+                if (r.variant == "pipeline") r.variant = "pipe";
+                r.metric = "completion_time";
+                // a trace may have lost its header, the iterations are numbered from 0
+                if (iterations > 0) r.n = (size_t) iterations;
+                else if (last_iteration >= 0) r.n = (size_t) last_iteration + 1;
+                else {
+                    r.n = 1;
+                    r.counted = false;
+                }
+                r.stddev = (r.max - r.min) / 4; // range rule, only average, min and max have been traced
+                found.push_back(r);
+            }
+        }
+        std::ostringstream comp_config, video_config;
+        comp_config << "cores=" << cores << ";data_size=" << (size_t) (size_mb*1000000/8 + 0.5) << ";runs_per_stage=" << runs;
+        video_config << "video=" << (video.empty() ? "unknown" : video);
+        for (record& r : found) {
+            r.machine = machine;
+            r.config = (r.benchmark == "comp_benchmark") ? comp_config.str() : video_config.str();
+            r.source = path;
+            out.push_back(r);
+        }
+    }
+
+    // JSON written by bench::write_json (one result per line)
+    inline void parse_json(std::istream& in, const std::string& path, std::vector<record>& out) {
+        std::map<std::string, std::string> meta;
+        std::vector<record> found;
+        std::string line;
+        bool in_results = false;
+        while (std::getline(in, line)) {
+            if (line.find("\"results\"") != std::string::npos) in_results = true;
+            else if (!in_results) {
+                const size_t q1 = line.find('"'), q2 = line.find('"', q1+1), q3 = line.find('"', q2+1);
+                if (q3 != std::string::npos && line.find('"', q3+1) != std::string::npos)
+                    meta[line.substr(q1+1, q2-q1-1)] = line.substr(q3+1, line.find('"', q3+1)-q3-1);
+            } else if (line.find("\"name\"") != std::string::npos) {
+                record r;
+                r.variant = json_string(line, "name");
+                r.unit = json_string(line, "unit");
+                number_after(line, "\"mean\": ", r.mean);
+                number_after(line, "\"stddev\": ", r.stddev);
+                number_after(line, "\"min\": ", r.min);
+                number_after(line, "\"max\": ", r.max);
+                const size_t samples = line.find("\"samples\": [");
+                r.n = (samples == std::string::npos) ? 1 : std::count(line.begin()+samples, line.end(), ',') + 1;
+                r.metric = "completion_time";
+                found.push_back(r);
+            }
+        }
+        for (record& r : found) {
+            r.machine = meta.count("host") ? meta["host"] : directory_name(path);
+            r.benchmark = meta.count("benchmark") ? meta["benchmark"] : "unknown";
+            r.config = "cores=" + meta["cores"] + ";data_size=" + meta["data_size"] + ";runs_per_stage=" + meta["runs_per_stage"];
+            r.source = path;
+            out.push_back(r);
+        }
+    }
+
+    inline std::vector<std::string> split_csv(const std::string& line) {
+        std::vector<std::string> fields;
+        std::istringstream s(line);
+        std::string f;
+        while (std::getline(s, f, ',')) fields.push_back(trim(f));
+        return fields;
+    }
+
+    // CSV written by bench::write_csv or by write_store
+    inline void parse_csv(std::istream& in, const std::string& path, std::vector<record>& out) {
+        std::map<std::string, std::string> meta;
+        std::vector<std::string> header;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (starts_with(line, "# ")) {
+                const size_t colon = line.find(": ");
+                if (colon != std::string::npos) meta[line.substr(2, colon-2)] = trim(line.substr(colon+2));
+                continue;
+            }
+            std::vector<std::string> fields = split_csv(line);
+            if (header.empty()) { header = fields; continue; }
+            if (fields.size() != header.size()) continue;
+            std::map<std::string, std::string> f;
+            for (size_t i=0; i<header.size(); ++i) f[header[i]] = fields[i];
+            record r;
+            if (f.count("machine")) { // store
+                r.machine = f["machine"]; r.benchmark = f["benchmark"]; r.config = f["config"]; r.variant = f["variant"];
+                r.metric = f["metric"]; r.unit = f["unit"]; r.source = f["source"];
+                r.counted = f["n"] != "?";
+                r.n = r.counted ? std::strtoul(f["n"].c_str(), nullptr, 10) : 1;
+                r.mean = std::atof(f["mean"].c_str());
+                r.stddev = std::atof(f["stddev"].c_str());
+                r.min = std::atof(f["min"].c_str());
+                r.max = std::atof(f["max"].c_str());
+            } else { // bench output
+                r.machine = meta.count("host") ? meta["host"] : directory_name(path);
+                r.benchmark = meta.count("benchmark") ? meta["benchmark"] : "unknown";
+                r.config = "cores=" + meta["cores"] + ";data_size=" + meta["data_size"] + ";runs_per_stage=" + meta["runs_per_stage"];
+                r.variant = f["name"];
+                r.metric = "completion_time";
+                r.n = std::strtoul(f["repetitions"].c_str(), nullptr, 10);
+                r.mean = std::atof(f["mean_ms"].c_str());
+                r.stddev = std::atof(f["stddev_ms"].c_str());
+                r.min = std::atof(f["min_ms"].c_str());
+                r.max = std::atof(f["max_ms"].c_str());
+                r.source = path;
+            }
+            out.push_back(r);
+        }
+    }
+
+    inline bool ends_with(const std::string& s, const std::string& suffix) {
+        return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // reads a trace, a bench output or a store, directories are read recursively, returns false if path can't be read
+    inline bool load(const std::string& path, std::vector<record>& out) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        if (S_ISDIR(st.st_mode)) {
+            DIR *dir = opendir(path.c_str());
+            if (!dir) return false;
+            std::vector<std::string> entries;
+            while (struct dirent *e = readdir(dir))
+                if (e->d_name[0] != '.') entries.push_back(path + "/" + e->d_name);
+            closedir(dir);
+            std::sort(entries.begin(), entries.end());
+            for (const std::string& e : entries) if (!load(e, out)) return false;
+            return true;
+        }
+        std::ifstream in(path.c_str());
+        if (!in) return false;
+        if (ends_with(path, ".json")) parse_json(in, path, out);
+        else if (ends_with(path, ".csv")) parse_csv(in, path, out);
+        else parse_text(in, path, out);
+        return true;
+    }
+
+    // one record per key, the records with the same key (e.g. several runs of the same benchmark) are merged
+    inline std::map<std::string, record> index(const std::vector<record>& records) {
+        std::map<std::string, record> idx;
+        for (const record& r : records) {
+            std::map<std::string, record>::iterator it = idx.find(r.key());
+            if (it == idx.end()) idx[r.key()] = r;
+            else it->second = merge(it->second, r);
+        }
+        return idx;
+    }
+
+    inline void write_store(std::ostream& out, const std::vector<record>& records, bool header=true) {
+        if (header) out << "machine,benchmark,config,variant,metric,unit,n,mean,stddev,min,max,source\n";
+        for (const record& r : records)
+            out << r.machine << "," << r.benchmark << "," << r.config << "," << r.variant << "," << r.metric << "," << r.unit << ","
+                << (r.counted ? std::to_string(r.n) : std::string("?")) << "," << r.mean << "," << r.stddev << "," << r.min << "," << r.max << "," << r.source << "\n";
+    }
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Benchmark store test:
+ *  Parsing a legacy comp_benchmark trace and a legacy videobenchmark.sh trace into records, merging records with the same key
+ *  and checking Welch's t-test used by bmark_compare against known values of Student's t distribution. Traces that lost
+ *  their header take the number of samples from the last iteration number, or are not counted (never tested, also once
+ *  merged or stored)
+ *
+ */
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "bmark_store.hpp"
+
+using namespace std;
+
+const char *comp_trace =
+    "(-) Generating random data set...\n"
+    "-- Benchmark specifications --\n"
+    "Number of cores (for the pipeline test): 16\n"
+    "Data set size:                           50(MB)\n"
+    "Parallelism grain:                       100 runs per stage\n"
+    "Running sequential computation...\n"
+    "(-) Done! [Elapsed time: 673705(ms)]\n"
+    "Running composed computation...\n"
+    "(-) Done! [Elapsed time: 687009(ms)]\n"
+    "Running pipelined computation...\n"
+    "(-) Done! [Elapsed time: 50517.3(ms)]\n";
+
+const char *video_trace =
+    "paolini@titanic:~/ff_comp/test$ ./videobenchmark.sh -p 5 helicopter.avi \n"
+    "Starting the benchmark with 5 iterations\n"
+    "Average / Min / Max inner Comp completion time (ms):\t\t66698.00 / 66506.90 / 66950.20\n"
+    "Average / Min / Max inner Pipeline completion time (ms):\t35345.30 / 35308.50 / 35396.20\n";
+
+// the last iterations of a trace, without its header
+const char *tail_trace =
+    "iteration number: 48\n"
+    "iteration number: 49\n"
+    "Average / Min / Max inner Comp completion time (ms):\t\t66596.90 / 65249.70 / 67049.60\n";
+
+// the summary alone
+const char *summary_trace =
+    "Average / Min / Max inner Comp completion time (ms):\t\t66697.80 / 66490.00 / 67018.60\n";
+
+bool near(double a, double b, double eps) { return fabs(a-b) <= eps; }
+
+int main() {
+    cout << "Executing legacy comp trace parsing test..." << endl;
+    vector<bmark::record> records;
+    istringstream comp(comp_trace);
+    bmark::parse_text(comp, "ffcomp_bmarks/ninja/comp_08_01_2018_1", records);
+    assert(records.size() == 3);
+    assert(records[1].machine == "ninja" && records[1].benchmark == "comp_benchmark" && records[1].variant == "comp");
+    assert(records[1].config == "cores=16;data_size=6250000;runs_per_stage=100");
+    assert(records[1].n == 1 && records[1].mean == 687009);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing legacy video trace parsing test..." << endl;
+    records.clear();
+    istringstream video(video_trace);
+    bmark::parse_text(video, "somewhere/else/trace", records);
+    assert(records.size() == 2);
+    assert(records[0].machine == "titanic" && records[0].config == "video=helicopter.avi" && records[0].variant == "comp");
+    assert(records[0].n == 5 && records[0].mean == 66698.00 && records[0].min == 66506.90 && records[0].max == 66950.20);
+    assert(records[1].variant == "pipe");
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing headless video trace parsing test..." << endl;
+    records.clear();
+    istringstream tail(tail_trace), summary(summary_trace);
+    bmark::parse_text(tail, "ffcomp_bmarks/titanic/video_20_01_2018_2", records);
+    bmark::parse_text(summary, "ffcomp_bmarks/titanic/video_18_01_2018_5", records);
+    assert(records.size() == 2 && records[0].key() == records[1].key());
+    assert(records[0].counted && records[0].n == 50 && !records[1].counted && records[1].n == 1);
+    bmark::record all = bmark::index(records)[records[0].key()];
+    assert(!all.counted && all.min == 65249.70 && all.max == 67049.60 && near(all.stddev, (67049.60-65249.70)/4, 1e-9));
+    assert(!bmark::welch(all, records[0]).testable && !bmark::welch(records[0], records[1]).testable);
+    ostringstream store;
+    bmark::write_store(store, vector<bmark::record>(1, all));
+    assert(store.str().find(",?,") != string::npos);
+    istringstream stored(store.str());
+    vector<bmark::record> back;
+    bmark::parse_csv(stored, "store.csv", back);
+    assert(back.size() == 1 && !back[0].counted && back[0].n == 1);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing merge test..." << endl;
+    bmark::record merged = bmark::single(1);
+    merged = bmark::merge(merged, bmark::single(2));
+    merged = bmark::merge(merged, bmark::single(3));
+    assert(merged.n == 3 && near(merged.mean, 2, 1e-12) && near(merged.stddev, 1, 1e-12));
+    assert(merged.min == 1 && merged.max == 3);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing Welch test..." << endl;
+    assert(near(bmark::t_upper_tail(2.0, 10), 0.036694, 1e-5));
+    assert(near(bmark::t_upper_tail(-2.0, 10), 1-0.036694, 1e-5));
+    assert(near(bmark::t_upper_tail(1.0, 1), 0.25, 1e-9));
+    bmark::record base = bmark::single(100), slow = bmark::single(120);
+    base.n = slow.n = 10;
+    base.stddev = slow.stddev = 5;
+    const bmark::welch_result w = bmark::welch(base, slow);
+    assert(w.testable && w.t > 8 && near(w.df, 18, 1e-9) && w.p < 1e-6);
+    assert(bmark::welch(slow, base).p > 0.99);
+    assert(!bmark::welch(bmark::single(1), slow).testable);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
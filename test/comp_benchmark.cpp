@@ -5,6 +5,9 @@
  *  code. We are going to read a big number of double values and perform several heavy operations on them in order to see if there are any differences between
  *  the completely sequential code and the code that uses ff_comp, obiouvsly we expect to see an huge speedup using the ff_pipeline construct.
  * 
+ *  Every variant is run -w times to warm up and then -n times (see bench.hpp), the reported times are medians and -o writes
+ *  all the statistics together with the machine description as JSON or CSV.
+ * 
  *  Tested with valgrind http://valgrind.org/info/about.html
  *
 */
@@ -17,7 +20,12 @@
 #include <cmath>
 #include <chrono>
 #include <iomanip>
+#include <memory>
+#include <string>
 #include "../comp.hpp"
+#include "../taskpool.hpp"
+#include "simd_trig.hpp"
+#include "bench.hpp"
 #include <ff/farm.hpp>
 
 using namespace std;
@@ -26,6 +34,13 @@ using namespace ff;
 size_t DATA_SIZE = 6250000;    // default size is 50MB
 size_t CORES_NUM = 7;          // default n. of cores
 unsigned long RUNS = 1000;     // default computation grain
+simd_trig::isa ISA = simd_trig::detect(); // instruction set of the vectorized stages (the widest one by default)
+unsigned WARMUP = 1;           // default n. of warm-up runs of every variant
+unsigned REPETITIONS = 5;      // default n. of measured runs of every variant
+string OUTPUT_PATH;            // results file (JSON, or CSV if it ends with .csv), none by default
+
+// every task of the benchmark is drawn from this pool and given back to it once its result has been collected
+ff_task_pool<double> task_pool(4096);
 
 // Helper functions (definitions are at the bottom of this file)
 
@@ -59,6 +74,7 @@ struct Emitter : public ff_node {
 private:
     const vector<double> in_stream;
     unsigned long index;
+    ff_task_pool<double>::cache tasks;
 protected:
     int svc_init() {
         index = 0;
@@ -71,14 +87,16 @@ protected:
         }
         auto val = in_stream[index];
         if (index++ >= in_stream.size()) return EOS;
-        return new double(sequentializer(val,RUNS,static_cast<double(*)(double)>(sin)));
+        double *task = tasks.get();
+        *task = sequentializer(val,RUNS,static_cast<double(*)(double)>(sin));
+        return task;
     }
     void svc_end() {
         index = 0;
         return;
     }
 public:
-    Emitter(const vector<double>& is) : in_stream(is) { }    
+    Emitter(const vector<double>& is) : in_stream(is), tasks(task_pool) { }    
 };
 
 // Pipeline/Farm collector
@@ -87,16 +105,17 @@ struct Collector: public ff_node {
 private:
     vector<double> out_stream;
    const bool odd;
+    ff_task_pool<double>::cache tasks;
 protected:
     void *svc(void *t) {
         double val = *((double*)t);
         if (odd) out_stream.push_back(sequentializer(val,RUNS,static_cast<double(*)(double)>(sin)));
         else out_stream.push_back(sequentializer(val,RUNS,static_cast<double(*)(double)>(cos)));
-        delete (double*) t;
+        tasks.put((double*) t);
         return GO_ON;
     }
 public:
-    Collector(bool is_odd) : odd(is_odd) { }    
+    Collector(bool is_odd) : odd(is_odd), tasks(task_pool) { }    
     const vector<double>& get_output_stream() const { return out_stream; }
 };
 
@@ -118,17 +137,37 @@ struct CosStage : public ff_node {
     }
 };
 
+// Vectorized comp stages: the same computation of SinStage/CosStage (with the Cephes kernels instead of libm, so results
+// are compared with a tolerance), a span of values is computed with a single svc_batch call
+
+struct VecSinStage : public ff_node, public ff_batch_stage<double> {
+    void *svc(void *t) {
+        simd_trig::apply_scalar((double*) t, 1, RUNS, false);
+        return t;
+    }
+    void svc_batch(double *data, size_t n) { simd_trig::apply(ISA, data, n, RUNS, false); }
+};
+
+struct VecCosStage : public ff_node, public ff_batch_stage<double> {
+    void *svc(void *t) {
+        simd_trig::apply_scalar((double*) t, 1, RUNS, true);
+        return t;
+    }
+    void svc_batch(double *data, size_t n) { simd_trig::apply(ISA, data, n, RUNS, true); }
+};
+
 int main(int argc, char **argv) {
 
     // parsing command line options
     
     int param;
-    const char *pattern = "hc:r:s:";
+    const char *pattern = "hc:r:s:i:w:n:o:";
     while ((param = getopt(argc, argv, pattern)) != -1) {
         try {
             switch (param) {
             case 'h':
-                cout << "Usage: comp_benchmark [-c number of cores] [-r parallelism grain] [-s data set size]" << endl;
+                cout << "Usage: comp_benchmark [-c number of cores] [-r parallelism grain] [-s data set size] [-i scalar|avx2|avx512]"
+                     << " [-w warm-up runs] [-n measured runs] [-o results.json|results.csv]" << endl;
                 return EXIT_SUCCESS;
             case 'c':
                 CORES_NUM = stoi(optarg);
@@ -151,8 +190,38 @@ int main(int argc, char **argv) {
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'i':
+                if (string(optarg) == "scalar") ISA = simd_trig::SCALAR;
+                else if (string(optarg) == "avx2") ISA = simd_trig::AVX2;
+                else if (string(optarg) == "avx512") ISA = simd_trig::AVX512;
+                else {
+                    cerr << "Error: instruction set must be scalar, avx2 or avx512" << endl;
+                    return EXIT_FAILURE;
+                }
+                if (ISA > simd_trig::detect()) {
+                    cerr << "Error: " << simd_trig::isa_name(ISA) << " is not supported by this machine" << endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                if (stoi(optarg) < 0) {
+                    cerr << "Error: warm-up runs can't be negative" << endl;
+                    return EXIT_FAILURE;
+                }
+                WARMUP = stoi(optarg);
+                break;
+            case 'n':
+                if (stoi(optarg) < 1) {
+                    cerr << "Error: measured runs must be greater than zero" << endl;
+                    return EXIT_FAILURE;
+                }
+                REPETITIONS = stoi(optarg);
+                break;
+            case 'o':
+                OUTPUT_PATH = optarg;
+                break;
             case '?':
-                if (optopt == 'c' || optopt == 'r' || optopt == 's')
+                if (optopt == 'c' || optopt == 'r' || optopt == 's' || optopt == 'i' || optopt == 'w' || optopt == 'n' || optopt == 'o')
                     cerr << "Error: option -" << optopt << " requires an argument" << endl;
                 else if (isprint(optopt))
                     cerr << "Error: unknown option " << optopt << endl;
@@ -168,8 +237,8 @@ int main(int argc, char **argv) {
         }
     }
 
-    std::chrono::time_point<std::chrono::system_clock> chrono_start;
-    std::chrono::time_point<std::chrono::system_clock> chrono_stop;
+    bench::config bench_cfg(WARMUP, REPETITIONS);
+    vector<bench::result> results;
 
     // creating an universal random big data set for the benchmark (50MB) 
 
@@ -189,26 +258,30 @@ int main(int argc, char **argv) {
     cout << "Number of cores (for the pipeline test): " << CORES_NUM << "\n";
     cout << "Data set size:                           " << DATA_SIZE*8 / (float) 1000000 << "(MB)\n";
     cout << "Parallelism grain:                       " << RUNS << " runs per stage\n";
+    cout << "Vectorized stages instruction set:       " << simd_trig::isa_name(ISA) << "\n";
+    cout << "Warm-up runs / measured runs:            " << bench_cfg.warmup << " / " << bench_cfg.repetitions << "\n";
     cout << "Warning: it's recommended to not exceed the number of cores of this machine\n";
     
     // sequential test
     
     vector<double> seq_result_set;
-    seq_result_set.reserve(DATA_SIZE);
     cout << "Running sequential computation..." << endl;
-    chrono_start = chrono::system_clock::now();
-    for (size_t i=0; i<DATA_SIZE; ++i) {
-        double temp;
-        for (size_t j=0; j<CORES_NUM; ++j) {
-            if (j == 0) temp = sequentializer(data_set[i], RUNS, static_cast<double(*)(double)>(sin)); // first call
-            else if (j%2 == 0) temp = sequentializer(temp, RUNS, static_cast<double(*)(double)>(sin)); // sin call
-            else temp = sequentializer(temp, RUNS, static_cast<double(*)(double)>(cos)); // cos call
+    results.push_back(bench::measure("sequential", bench_cfg, [&]() {
+        seq_result_set.clear();
+        seq_result_set.reserve(DATA_SIZE);
+    }, [&]() {
+        for (size_t i=0; i<DATA_SIZE; ++i) {
+            double temp;
+            for (size_t j=0; j<CORES_NUM; ++j) {
+                if (j == 0) temp = sequentializer(data_set[i], RUNS, static_cast<double(*)(double)>(sin)); // first call
+                else if (j%2 == 0) temp = sequentializer(temp, RUNS, static_cast<double(*)(double)>(sin)); // sin call
+                else temp = sequentializer(temp, RUNS, static_cast<double(*)(double)>(cos)); // cos call
+            }
+            seq_result_set.push_back(temp);
         }
-        seq_result_set.push_back(temp);
-    }
-    chrono_stop = chrono::system_clock::now();
-    auto seq_time = ((std::chrono::duration<double, std::milli>) (chrono_stop - chrono_start)).count();
-    cout << "Done! [Elapsed time: " << seq_time << "(ms)]" << endl;
+    }));
+    bench::print(cout, results.back());
+    const double seq_time = results.back().median;
 
     // comp test
 
@@ -216,117 +289,167 @@ int main(int argc, char **argv) {
     vector<ff_node*> comp_stages;
     comp_stages.reserve(CORES_NUM);
     vector<double> comp_result_set;
-    comp_result_set.reserve(DATA_SIZE);
 
     for (size_t i=0; i<CORES_NUM; ++i){
-        if (i%2==0) comp_stages[i] = new SinStage();
-        else comp_stages[i] = new CosStage();
+        if (i%2==0) comp_stages.push_back(new SinStage());
+        else comp_stages.push_back(new CosStage());
         comp.add_stage(comp_stages[i]);
     }
 
     cout << "Running composed computation..." << endl;
 
-    chrono_start = chrono::system_clock::now();
-    for (size_t i=0; i<DATA_SIZE; ++i) {
-        double* task = new double(data_set[i]);
-        task = (double*) comp.run(task);
-        comp_result_set.push_back(double(*task));
-        delete task;
-    }
-    chrono_stop = chrono::system_clock::now();
-    auto comp_time = ((std::chrono::duration<double, std::milli>) (chrono_stop - chrono_start)).count();
-    cout << "Done! [Elapsed time: " << comp_time << "(ms)]" << endl;
+    results.push_back(bench::measure("comp", bench_cfg, [&]() {
+        comp_result_set.clear();
+        comp_result_set.reserve(DATA_SIZE);
+    }, [&]() {
+        ff_task_pool<double>::cache tasks(task_pool);
+        for (size_t i=0; i<DATA_SIZE; ++i) {
+            double* task = tasks.get();
+            *task = data_set[i];
+            task = (double*) comp.run(task);
+            comp_result_set.push_back(double(*task));
+            tasks.put(task);
+        }
+    }));
+    bench::print(cout, results.back());
+    const double comp_time = results.back().median;
+
+    // batched comp test (same comp, the whole data set is submitted with a single run_batch call)
+
+    vector<double> batch_result_set;
+    vector<void*> batch_tasks;
+
+    cout << "Running batched composed computation..." << endl;
+
+    results.push_back(bench::measure("batched comp", bench_cfg, [&]() {
+        batch_result_set = data_set;
+        batch_tasks.clear();
+        for (size_t i=0; i<DATA_SIZE; ++i) batch_tasks.push_back(&batch_result_set[i]);
+    }, [&]() {
+        if (comp.run_batch(batch_tasks.data(), batch_tasks.size())<0) error("Running batched comp\n");
+    }));
+    bench::print(cout, results.back());
+    const double batch_time = results.back().median;
 
     while (!comp_stages.empty()) {
         delete comp_stages.back();
         comp_stages.pop_back();
     }
 
-    // pipeline test
+    // vectorized comp test (every stage provides svc_batch, the data set is submitted with a single run_span call)
 
-    ff_pipeline pipeline;
-    Emitter emitter(data_set);
-    Collector odd_collector(true), even_collector(false);
-    size_t internal_stages = CORES_NUM - 2; // we already have an emitter and a collector
-    vector<ff_node*> pipe_stages;
-    pipe_stages.reserve(internal_stages);
-
-    pipeline.add_stage(&emitter);
-    for (size_t i=0; i<internal_stages; ++i) {
-        if(i%2==0) pipe_stages[i] = new CosStage();
-        else pipe_stages[i] = new SinStage();
-        pipeline.add_stage(pipe_stages[i]);
+    ff_comp vec_comp;
+    for (size_t i=0; i<CORES_NUM; ++i){
+        if (i%2==0) comp_stages.push_back(new VecSinStage());
+        else comp_stages.push_back(new VecCosStage());
+        vec_comp.add_stage(comp_stages[i]);
     }
-    if (CORES_NUM%2 == 0) pipeline.add_stage(&even_collector);
-    else pipeline.add_stage(&odd_collector);
-
-    cout << "Running pipelined computation..." << endl;
+    vector<double> vec_result_set;
 
-    chrono_start = chrono::system_clock::now();
-    if(pipeline.run_and_wait_end()<0) error("Running pipeline\n");
-    chrono_stop = chrono::system_clock::now();
-    vector<double> pipe_result_set;
-    pipe_result_set.reserve(DATA_SIZE);
-    if (CORES_NUM%2 == 0) pipe_result_set = even_collector.get_output_stream();
-    else pipe_result_set = odd_collector.get_output_stream();
+    cout << "Running vectorized composed computation..." << endl;
 
-    auto pipe_time = ((std::chrono::duration<double, std::milli>) (chrono_stop - chrono_start)).count();
-    cout << "Done! [Elapsed time: " << pipe_time << "(ms)]" << endl;
+    results.push_back(bench::measure("vectorized comp", bench_cfg, [&]() { vec_result_set = data_set; }, [&]() {
+        if (vec_comp.run_span(vec_result_set.data(), vec_result_set.size())<0) error("Running vectorized comp\n");
+    }));
+    bench::print(cout, results.back());
+    const double vec_time = results.back().median;
 
-    while (!pipe_stages.empty()) {
-        delete pipe_stages.back();
-        pipe_stages.pop_back();
+    while (!comp_stages.empty()) {
+        delete comp_stages.back();
+        comp_stages.pop_back();
     }
 
+    // pipeline test (the pipeline is built again before every run, its collector keeps the results of a single run)
+
+    const bool odd = CORES_NUM%2 != 0;
+    size_t internal_stages = CORES_NUM - 2; // we already have an emitter and a collector
+    unique_ptr<ff_pipeline> pipeline;
+    unique_ptr<Emitter> emitter;
+    unique_ptr<Collector> collector;
+    vector<unique_ptr<ff_node>> pipe_stages;
+
+    cout << "Running pipelined computation..." << endl;
+
+    results.push_back(bench::measure("pipeline", bench_cfg, [&]() {
+        pipeline.reset(new ff_pipeline());
+        emitter.reset(new Emitter(data_set));
+        collector.reset(new Collector(odd));
+        pipe_stages.clear();
+        pipeline->add_stage(emitter.get());
+        for (size_t i=0; i<internal_stages; ++i) {
+            if(i%2==0) pipe_stages.push_back(make_unique<CosStage>());
+            else pipe_stages.push_back(make_unique<SinStage>());
+            pipeline->add_stage(pipe_stages.back().get());
+        }
+        pipeline->add_stage(collector.get());
+    }, [&]() {
+        if(pipeline->run_and_wait_end()<0) error("Running pipeline\n");
+    }));
+    bench::print(cout, results.back());
+    const double pipe_time = results.back().median;
+    vector<double> pipe_result_set = collector->get_output_stream();
+    pipeline.reset();
+
     // farm test
     // NOTE: this part of the benchmark needs more test and a review and it may be useless for the final results,
     // at this time is no more than an exercise
 
-    Emitter femitter(data_set);
-    Collector feven_collector(false), fodd_collector(true);
+    unique_ptr<ff_Farm<>> farm;
+    size_t nworkers = CORES_NUM - 2;
 
-    if (CORES_NUM%2 == 0) {
-        size_t nworkers = CORES_NUM - 2;
-        ff_Farm<> farm( [nworkers]() {
-            vector<unique_ptr<ff_node>> fworkers;
-            for (size_t i=0; i<nworkers; ++i) fworkers.push_back(make_unique<FarmWorker>(RUNS,CORES_NUM-2));
-            return fworkers;
-        }(), femitter, feven_collector );
-        cout << "Running farmed computation..." << endl;
-        chrono_start = chrono::system_clock::now();
-        if (farm.run_and_wait_end()<0) error("Running farm test\n");
-        chrono_stop = chrono::system_clock::now();
-    } else {
-        size_t nworkers = CORES_NUM - 2;
-        ff_Farm<> farm( [nworkers]() {
+    cout << "Running farmed computation..." << endl;
+
+    results.push_back(bench::measure("farm", bench_cfg, [&]() {
+        farm.reset();
+        emitter.reset(new Emitter(data_set));
+        collector.reset(new Collector(odd));
+        farm.reset(new ff_Farm<>( [nworkers]() {
             vector<unique_ptr<ff_node>> fworkers;
             for (size_t i=0; i<nworkers; ++i) fworkers.push_back(make_unique<FarmWorker>(RUNS,CORES_NUM-2));
             return fworkers;
-        }(), femitter, fodd_collector );
-        cout << "Running farmed computation..." << endl;
-        chrono_start = chrono::system_clock::now();
-        if (farm.run_and_wait_end()<0) error("Running farm test\n");
-        chrono_stop = chrono::system_clock::now();
+        }(), *emitter, *collector ));
+    }, [&]() {
+        if (farm->run_and_wait_end()<0) error("Running farm test\n");
+    }));
+    bench::print(cout, results.back());
+    const double farm_time = results.back().median;
+    vector<double> farm_result_set = collector->get_output_stream();
+    farm.reset();
+
+    if (!OUTPUT_PATH.empty()) {
+        bench::metadata meta;
+        meta.machine();
+        meta.add("benchmark", "comp_benchmark");
+        meta.add("cores", CORES_NUM);
+        meta.add("data_size", DATA_SIZE);
+        meta.add("runs_per_stage", RUNS);
+        meta.add("isa", simd_trig::isa_name(ISA));
+        meta.add("warmup", bench_cfg.warmup);
+        meta.add("repetitions", bench_cfg.repetitions);
+        if (bench::write(OUTPUT_PATH, meta, results)) cout << "Results written to " << OUTPUT_PATH << endl;
+        else cerr << "Error: writing the results to " << OUTPUT_PATH << endl;
     }
 
-    vector<double> farm_result_set;
-    farm_result_set.reserve(DATA_SIZE);
-    if (CORES_NUM%2 == 0) farm_result_set = even_collector.get_output_stream();
-    else farm_result_set = odd_collector.get_output_stream();
-    auto farm_time = ((std::chrono::duration<double, std::milli>) (chrono_stop - chrono_start)).count();
-    cout << "Done! [Elapsed time: " << farm_time << "(ms)]" << endl;
-
     // performance evaluation
 
     cout << fixed;
     cout << "-- Performance statistics --\n";
     cout << "Difference between sequential and comp:     " << diff(seq_time,comp_time) << "(ms) \t" << setprecision(2) << diff_perc(seq_time,comp_time) << "%\n";
+    cout << "Difference between comp and batched comp:   " << setprecision(6) << diff(comp_time,batch_time) << "(ms) \t" << setprecision(2) << diff_perc(comp_time,batch_time) << "%\n";
+    cout << "Difference between pipeline and batch comp: " << setprecision(6) << diff(pipe_time,batch_time) << "(ms) \t" << setprecision(2) << diff_perc(pipe_time,batch_time) << "%\n";
+    cout << "Difference between pipeline and vec comp:   " << setprecision(6) << diff(pipe_time,vec_time) << "(ms) \t" << setprecision(2) << diff_perc(pipe_time,vec_time) << "%\n";
+    cout << "Difference between batch and vec comp:      " << setprecision(6) << diff(batch_time,vec_time) << "(ms) \t" << setprecision(2) << diff_perc(batch_time,vec_time) << "%\n";
     cout << "Difference between pipeline and comp:       " << setprecision(6) << diff(pipe_time,comp_time) << "(ms) \t" << setprecision(2) << diff_perc(pipe_time,comp_time) << "%\n";
     cout << "Difference between farm and comp:           " << setprecision(6) << diff(farm_time,comp_time) << "(ms) \t" << setprecision(2) << diff_perc(farm_time,comp_time) << "%\n";
     cout << "Difference between sequential and pipeline: " << setprecision(6) << diff(seq_time,pipe_time) << "(ms) \t" << setprecision(2) << diff_perc(seq_time,pipe_time) << "%\n";
     cout << "Difference between sequential and farm:     " << setprecision(6) << diff(seq_time,farm_time) << "(ms) \t" << setprecision(2) << diff_perc(seq_time,farm_time) << "%\n";
     cout << "Difference between pipeline and farm:       " << setprecision(6) << diff(pipe_time,farm_time) << "(ms) \t" << setprecision(2) << diff_perc(pipe_time,farm_time) << "%\n";
 
+    cout << "-- Task allocations --\n";
+    cout << "Tasks created by the pool:                  " << task_pool.tasks() << " (" << task_pool.heap_allocations() << " heap allocations, "
+         << task_pool.cache_exchanges() << " cache exchanges)\n";
+    cout << "Tasks submitted (one allocation each without the pool): " << 3*DATA_SIZE*(bench_cfg.warmup+bench_cfg.repetitions) << "\n";
+
     // consistency check (farm result are checked only in size because they aren't ordered)
 
     cout << "Checking consistency between the result sets...\n";
@@ -334,13 +457,22 @@ int main(int argc, char **argv) {
     bool consistence = true;
     if(farm_result_set.size() != seq_result_set.size()) consistence = false;
     while (i<comp_result_set.size() && i<seq_result_set.size() && i<pipe_result_set.size() && consistence) {
-        if (comp_result_set[i] != seq_result_set[i] || comp_result_set[i] != pipe_result_set[i])
+        if (comp_result_set[i] != seq_result_set[i] || comp_result_set[i] != pipe_result_set[i] || comp_result_set[i] != batch_result_set[i])
             consistence = false;
         i++;
     }
     if (consistence) cout << "The results are consistent" << endl;
     else cout << "The results are NOT consistent" << endl; 
 
+    // the vectorized kernels aren't bit identical to libm, their results are checked with a tolerance
+    const double tolerance = 1e-9;
+    double max_error = 0;
+    for (size_t i=0; i<vec_result_set.size() && i<seq_result_set.size(); ++i)
+        max_error = max(max_error, diff(vec_result_set[i], seq_result_set[i]));
+    cout << scientific << "Vectorized results max absolute error:      " << max_error << " (tolerance " << tolerance << ")" << endl;
+    if (vec_result_set.size() == seq_result_set.size() && max_error <= tolerance) cout << "The vectorized results are consistent" << endl;
+    else cout << "The vectorized results are NOT consistent" << endl;
+
     return EXIT_SUCCESS;
 
 }
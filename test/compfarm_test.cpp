@@ -0,0 +1,128 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Comp farm test:
+ *  Pipe(Source, CompFarm(4 x Comp(Incr, Doub)), Drain) over the stream [1, ..., n]
+ *  Expected Doub(Incr(x)) = 2x+2 for every x, in the stream order for the ordered farm and as a permutation of it otherwise,
+ *  svc_init/svc_end called once on every replica, an autoscaled farm starting with a single worker grows when its workers
+ *  are busy and tasks are waiting for them
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../compfarm.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    int inits = 0, ends = 0;
+    int svc_init() { ++inits; return 0; }
+    void svc_end() { ++ends; }
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node {
+    int delay_us = 0;
+    void* svc(void *t){
+        if (delay_us) this_thread::sleep_for(chrono::microseconds(delay_us));
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+struct Source : ff_node {
+    int counter;
+    const int n;
+    Source(int n) : n(n) { }
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+struct Replicas {
+    vector<Incr> incrs;
+    vector<Doub> doubs;
+    vector<ff_comp> comps;
+    vector<ff_node*> nodes;
+    Replicas(size_t n, int delay_us=0) : incrs(n), doubs(n), comps(n) {
+        for (size_t i=0; i<n; ++i) {
+            doubs[i].delay_us = delay_us;
+            comps[i].add_stage(&incrs[i]);
+            comps[i].add_stage(&doubs[i]);
+            nodes.push_back(&comps[i]);
+        }
+    }
+};
+
+vector<int> run(ff_comp_farm& farm, int n) {
+    Source source(n);
+    Drain drain;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&farm);
+    pipe.add_stage(&drain);
+    assert(pipe.run_and_wait_end() == 0);
+    return drain.data;
+}
+
+int main() {
+    const int n = 1000;
+    vector<int> expected;
+    for (int i=1; i<=n; ++i) expected.push_back(2*i+2);
+
+    cout << "Executing ordered comp farm test..." << endl;
+    Replicas ordered_replicas(4);
+    ff_comp_farm ordered(ordered_replicas.nodes, true);
+    assert(run(ordered, n) == expected);
+    for (Incr& incr : ordered_replicas.incrs) assert(incr.inits == 1 && incr.ends == 1);
+    size_t tasks = 0;
+    for (size_t i=0; i<4; ++i) tasks += ordered.get_worker_tasks(i);
+    assert(tasks == (size_t) n);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing unordered comp farm test..." << endl;
+    Replicas unordered_replicas(4);
+    ff_comp_farm unordered(unordered_replicas.nodes);
+    unordered.set_capacity(3);
+    vector<int> out = run(unordered, n);
+    sort(out.begin(), out.end());
+    assert(out == expected);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing autoscaled comp farm test..." << endl;
+    Replicas scaled_replicas(4, 200); // slow workers, the source can always keep them busy
+    ff_comp_farm scaled(scaled_replicas.nodes, true);
+    scaled.set_autoscale(1, 4, chrono::milliseconds(5));
+    assert(run(scaled, n) == expected);
+    assert(!scaled.get_scale_events().empty());
+    size_t most = 0;
+    for (const ff_comp_farm::scale_event& e : scaled.get_scale_events()) most = max(most, e.workers);
+    assert(most > 1 && most <= 4);
+    cout << "-> PASSED (up to " << most << " workers, " << scaled.get_scale_events().size() << " changes)" << endl;
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Farm batch test:
+ *  Composing a farm of pipelines between two nodes and running a batch of tasks with the farm parallelism enabled
+ *  Comp(Incr, Farm, Incr) where Farm = [Default Emitter -> Pipeline(s) -> Default Collector] and Pipeline = [Doub -> Count]
+ *  Expected Incr(Doub(Incr(x))) for every x in the batch, every worker of the farm must have received a slice of the batch
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    } 
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+// counts the tasks computed by a single worker, it is not thread safe on purpose
+struct Count : ff_node {
+    size_t count = 0;
+    void* svc(void *t){
+        ++count;
+        return t;
+    }
+};
+
+int main() {
+    const int num_pipes = 4;
+    const size_t batch_size = 1001;
+    vector<ff_node *> pipelines;
+    vector<Count *> counters;
+    for (auto i=0; i<num_pipes; ++i) {
+        ff_pipeline* pipe = new ff_pipeline();
+        counters.push_back(new Count());
+        pipe->add_stage(new Doub());
+        pipe->add_stage(counters.back());
+        pipe->cleanup_nodes();
+        pipelines.push_back(pipe);
+    }
+    ff_farm<> farm(pipelines);
+    farm.cleanup_all();
+    Incr first, last;
+    ff_comp comp;
+    comp.add_stage(&first);
+    comp.add_stage(&farm);
+    comp.add_stage(&last);
+    comp.set_farm_parallel(true);
+    comp.set_batch_grain(16);
+
+    vector<int> values(batch_size);
+    vector<void*> tasks(batch_size);
+    for (size_t i=0; i<batch_size; ++i) {
+        values[i] = (int) i;
+        tasks[i] = &values[i];
+    }
+    cout << "Executing farm batch test..." << endl;
+    assert(comp.run_batch(tasks.data(), batch_size)==0);
+    for (size_t i=0; i<batch_size; ++i) assert(values[i]==((int)i+1)*2+1);
+    size_t total = 0;
+    for (Count *c : counters) {
+        assert(c->count>0);
+        total += c->count;
+    }
+    assert(total==batch_size);
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    cout << "Executing farm batch test with a single task..." << endl;
+    int foo = 2;
+    size_t first_count = counters[0]->count;
+    assert(*((int*)comp.run(&foo))==7);
+    assert(counters[0]->count==first_count+1); // single tasks still use the first worker only
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    return EXIT_SUCCESS;
+}
@@ -38,41 +38,78 @@
  *   skeleton == 0 -> pipe(Source, Comp(Stage1, Stage2), Drain)
  *   skeleton == 1 -> pipe(Source, Seq(Stage1, Stage2), Drain)
  *   skeleton == 2 -> pipe(Source, Pipe(Stage1, Stage2), Drain)
+ *   skeleton == 3 -> pipe(Source, BandMap(Comp(Stage1, Stage2)), Drain)
+ *   skeleton == 4 -> pipe(Source, Fused, Drain)
+ *   skeleton == 5 -> pipe(Source, Rows(Comp(Stage1, Stage2)), Drain)
+ *   skeleton == 6 -> pipe(Source, Adaptive(Stage1, Stage2), Drain)
  * where Seq is a ff_node_t that executes in sequence the code contained into Stage1 and
  * Stage2 svc methods.
  * 
  * We expect to not find any notable difference in completion time between Seq and Comp version,
  * on the other side we expect to see an huge speedup between Pipe and Seq / Comp.
+ * BandMap runs a Comp(Stage1, Stage2) per band of rows of the frame in parallel (-b bands, default 4), it's the
+ * only one that lowers the time of every single frame.
+ * Fused computes both filters in a single pass over the frame (see FusedStage), with -c every frame is also
+ * computed by Comp(Stage1, Stage2) and the two results are compared.
+ * Rows runs the same Comp row by row through line buffers (see ff_comp::run_rows), the generic way of Fused.
+ * Adaptive starts as Comp and moves Stage2 to a helper thread (as Pipe does) while the frames arrive faster than the
+ * two stages compute them, back to Comp when they don't (see ff_adaptive_comp), its switches are printed at the end.
  * 
- * (-v option: visualize output video)
+ * (-v option: visualize output video, -H option: back the frame buffers with huge pages,
+ *  -d option: number of decoder threads of Source, -s option: frames per decoded segment, see Source,
+ *  -o option: write the output into a video file, on the encoder thread of VideoSink)
  *
 */
 
 #include "ffvideo.hpp" // definition of ff stages are in this header, please have a look
+#include "../adaptcomp.hpp"
 
 using namespace ff;
 using namespace cv;
 using namespace std;
 
-// fixed number of stages, run this program with: ffcompvideo input skeleton [-v]
+// fixed number of stages, run this program with: ffcompvideo input skeleton [-v] [-H] [-d decoders] [-s segment frames] [-o output] [-b bands] [-c]
 int main(int argc, char *argv[]) {
   
     Mat edges;
   
     bool out_video_flag = false;
+    bool huge_pages_flag = false;
+    size_t decoders = 1, segment_frames = 250;
+    string out_path;
+    size_t bands_num = 4;
+    bool validate_flag = false;
     
     int param;
-    const char *pattern = "hv";
+    const char *pattern = "hvHd:s:o:b:c";
     while ((param = getopt(argc, argv, pattern)) != -1) {
         switch (param) {
             case 'h':
-                cout << "Usage: ./ffcompvideo input skeleton [-v]" << endl;
+                cout << "Usage: ./ffcompvideo input skeleton [-v] [-H] [-d decoders] [-s segment frames] [-o output] [-b bands] [-c]" << endl;
                 return EXIT_SUCCESS;
             case 'v':
                 out_video_flag = true;
                 break;
+            case 'H':
+                huge_pages_flag = true;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'c':
+                validate_flag = true;
+                break;
+            case 'd':
+            case 's':
+            case 'b':
+                if (atoi(optarg) < 1) {
+                    cerr << "Error: option -" << (char) param << " requires a positive integer" << endl;
+                    return EXIT_FAILURE;
+                }
+                (param == 'd' ? decoders : param == 's' ? segment_frames : bands_num) = atoi(optarg);
+                break;
             case '?':
-                if (optopt == 'v')
+                if (optopt == 'd' || optopt == 's' || optopt == 'o' || optopt == 'b')
 	                  cerr << "Error: option -" << optopt << " requires an argument" << endl;
                 else if (isprint(optopt))
 	                  cerr << "Error: unknown option -" << (char) optopt << endl;
@@ -86,8 +123,8 @@ int main(int argc, char *argv[]) {
     }
 
     if (argc < 3) {
-        cerr << "Error: you must provide a video input and select a valid skeleton type (0 for comp, 1 for sequential, 2 for pipeline)" << endl;
-        cout << "Usage: ./ffcompvideo input skeleton [-v]" << endl;
+        cerr << "Error: you must provide a video input and select a valid skeleton type (0 for comp, 1 for sequential, 2 for pipeline, 3 for bands, 4 for fused, 5 for rows, 6 for adaptive)" << endl;
+        cout << "Usage: ./ffcompvideo input skeleton [-v] [-H] [-d decoders] [-s segment frames] [-o output] [-b bands] [-c]" << endl;
         return EXIT_FAILURE;
     }
 
@@ -96,18 +133,36 @@ int main(int argc, char *argv[]) {
     try {
         skeleton_type = stoi(argv[optind+1]);
     } catch (exception) {
-        cerr << "Error: skeleton type must be an integer (0 for comp, 1 for sequential, 2 for pipeline)" << endl;
-        cout << "Usage: ./ffcompvideo input skeleton [-v]" << endl;
+        cerr << "Error: skeleton type must be an integer (0 for comp, 1 for sequential, 2 for pipeline, 3 for bands, 4 for fused, 5 for rows, 6 for adaptive)" << endl;
+        cout << "Usage: ./ffcompvideo input skeleton [-v] [-H] [-d decoders] [-s segment frames] [-o output] [-b bands] [-c]" << endl;
         return EXIT_FAILURE;
     }
 
     SeqNode seq;
     ff_comp comp;
     ff_pipeline pipe, inner_pipe;
-    Source source(in_video_path);
+    // frames go around from Drain (or from the encoder of the output sink) back to Source, with more decoders the ring
+    // holds the few frames of every decoder too (see Source) and with an output file the frames waiting for the encoder
+    const size_t sink_depth = 8;
+    const size_t ring_frames = 16 + Source::decode_window(decoders, segment_frames) + (out_path.empty() ? 0 : sink_depth);
+    if (!FrameRing::fits(ring_frames, in_video_path)) {
+        cerr << "Error: a frame ring of " << ring_frames << " frames doesn't fit into memory, use fewer decoders (-d)" << endl;
+        return EXIT_FAILURE;
+    }
+    FrameRing ring(ring_frames, huge_pages_flag);
+    Source source(in_video_path, &ring, decoders, segment_frames);
     Stage1 stage1;
     Stage2 stage2;
-    Drain drain(out_video_flag);
+    unique_ptr<VideoSink> sink;
+    if (!out_path.empty()) sink.reset(new VideoSink(out_path, VideoCapture(in_video_path).get(CAP_PROP_FPS), &ring, sink_depth));
+    Drain drain(out_video_flag, &ring, sink.get());
+    vector<unique_ptr<Stage1> > band_s1s;
+    vector<unique_ptr<Stage2> > band_s2s;
+    vector<unique_ptr<ff_comp> > band_comps;
+    unique_ptr<BandMap> band_map;
+    FusedStage fused(validate_flag);
+    RowsNode rows_node(comp);
+    ff_adaptive_comp adaptive(2);
     
     pipe.add_stage(&source);
 
@@ -128,9 +183,42 @@ int main(int argc, char *argv[]) {
             inner_pipe.add_stage(&stage2);
             pipe.add_stage(&inner_pipe);
             break;
+        case 3:
+            cout << "Selected band inner stage: Pipe(Source, BandMap(Comp(Stage1, Stage2)), Drain) with " << bands_num << " bands" << endl;
+            for (size_t i=0; i<bands_num; ++i) {
+                band_s1s.push_back(unique_ptr<Stage1>(new Stage1()));
+                band_s2s.push_back(unique_ptr<Stage2>(new Stage2()));
+                band_comps.push_back(unique_ptr<ff_comp>(new ff_comp()));
+                band_comps.back()->add_stage(band_s1s.back().get());
+                band_comps.back()->add_stage(band_s2s.back().get());
+            }
+            {
+                vector<ff_comp*> comps;
+                for (unique_ptr<ff_comp>& c : band_comps) comps.push_back(c.get());
+                band_map.reset(new BandMap(comps, Stage1::radius + Stage2::radius));
+            }
+            pipe.add_stage(band_map.get());
+            break;
+        case 4:
+            cout << "Selected fused inner stage: Pipe(Source, Fused, Drain)" << (validate_flag ? " validated against Comp(Stage1, Stage2)" : "") << endl;
+            pipe.add_stage(&fused);
+            break;
+        case 5:
+            cout << "Selected rows inner stage: Pipe(Source, Rows(Comp(Stage1, Stage2)), Drain)" << endl;
+            comp.add_stage(&stage1);
+            comp.add_stage(&stage2);
+            pipe.add_stage(&rows_node);
+            break;
+        case 6:
+            cout << "Selected adaptive inner stage: Pipe(Source, Adaptive(Stage1, Stage2), Drain)" << endl;
+            adaptive.add_stage(&stage1);
+            adaptive.add_stage(&stage2);
+            adaptive.set_window(32);
+            pipe.add_stage(&adaptive);
+            break;
         default:
-            cerr << "Error: skeleton type must one of these values: 0 (comp), 1 (sequential) or 2(pipeline)" << endl;
-            cout << "Usage: ./ffcompvideo input skeleton [-v]" << endl;
+            cerr << "Error: skeleton type must one of these values: 0 (comp), 1 (sequential), 2 (pipeline), 3 (bands), 4 (fused), 5 (rows) or 6 (adaptive)" << endl;
+            cout << "Usage: ./ffcompvideo input skeleton [-v] [-H] [-d decoders] [-s segment frames] [-o output] [-b bands] [-c]" << endl;
             return EXIT_FAILURE;
     }
 
@@ -152,10 +240,16 @@ int main(int argc, char *argv[]) {
     cout << "Completion time: " << elapsed_time << " (ms)" << endl;
     cout << "Average time per frame: " << elapsed_time / frames << " (ms)" << endl; 
     cout << "(with " << frames << " frames)" << endl;
+    cout << "Frame ring: " << ring.size() << " frames, " << ring.buffer_allocations() << " buffer allocations" << (huge_pages_flag ? " (huge pages)" : "") << endl;
+    if (sink) sink->print_stats(cout);
+    if (decoders > 1) cout << "Decoders: " << decoders << " (" << segment_frames << " frames per segment), " << drain.get_out_of_order() << " frames out of order" << endl;
     
     switch (skeleton_type) {
         case 0:
-            cout << "Inner Comp completion time: " << comp.ff_time() << " (ms)\nDone!" <<  endl;
+        case 5:
+            cout << "Inner Comp completion time: " << comp.ff_time() << " (ms)" << endl;
+            if (comp_trace_policy::enabled) comp.print_stats(cout); // per stage times, compile with -DTRACE_FF_COMP
+            cout << "Done!" << endl;
             break;
         case 1:
             cout << "Inner Sequential completion time: " << seq.ff_time() << " (ms)\nDone!" << endl;
@@ -163,6 +257,25 @@ int main(int argc, char *argv[]) {
         case 2:
             cout << "Inner Pipeline completion time: " << inner_pipe.ffTime() << " (ms)\nDone!" << endl;
             break;
+        case 4:
+            cout << "Inner Fused completion time: " << fused.ff_time() << " (ms)" << endl;
+            if (validate_flag)
+                cout << "Validation: " << fused.get_checked() << " frames, max difference " << fused.get_max_diff() << ", " << fused.get_over_tolerance()
+                     << " values beyond the tolerance -> " << (fused.valid() ? "PASSED" : "FAILED") << endl;
+            cout << "Done!" << endl;
+            if (!fused.valid()) return EXIT_FAILURE;
+            break;
+        case 6:
+            cout << "Inner Adaptive completion time: " << adaptive.ff_time() << " (ms)" << endl;
+            cout << "Stage service times: " << adaptive.get_service_time(0) << " / " << adaptive.get_service_time(1) << " (us)" << endl;
+            for (const ff_adaptive_comp::switch_event& e : adaptive.get_switches())
+                cout << "  frame " << e.task << ": " << (e.mode == COMP_FUSED ? "fused" : "pipelined") << " (" << e.segments << " segments, "
+                     << e.service_us << "us per frame, " << e.wait_us << "us waiting for a frame)" << endl;
+            cout << "Done!" << endl;
+            break;
+        case 3:
+            cout << "Inner BandMap completion time: " << band_map->ff_time() << " (ms), " << band_map->ff_time() / frames << " (ms) per frame\nDone!" << endl;
+            break;
         default:
             cerr << "Error: this point should be inaccesible!" << endl;
             return EXIT_FAILURE;
@@ -39,21 +39,181 @@
 
 #include <opencv2/opencv.hpp>
 #include <ff/pipeline.hpp>
+#include <ff/buffer.hpp>
+#include <ff/parallel_for.hpp>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
 #include "../comp.hpp"
+#include "numa.hpp"
 
 using namespace ff;
 using namespace std;
 using namespace cv;
 
-// Reads frames and sends them to the next stage
+// Allocator of the frame buffers (OpenCV 3 MatAllocator interface), buffers are mapped on their own pages, optionally
+// huge pages (explicit ones if the system has a reserved pool, transparent ones otherwise) and optionally interleaved over
+// the NUMA nodes of a mask. It counts the buffers it allocates, so a steady state with no allocation per frame can be checked.
+class FrameAllocator : public MatAllocator {
+
+    static const size_t huge_page = 2*1024*1024;
+    const bool huge_pages;
+    const unsigned long interleave_mask;
+    mutable atomic<size_t> allocations;
+
+    size_t mapped_size(size_t size) const {
+        const size_t page = huge_pages ? huge_page : (size_t) sysconf(_SC_PAGESIZE);
+        return (size + page - 1) / page * page;
+    }
+
+public:
+    FrameAllocator(bool huge_pages, unsigned long interleave_mask=0) :
+		huge_pages(huge_pages), interleave_mask(interleave_mask), allocations(0) { }
+
+    UMatData *allocate(int dims, const int *sizes, int type, void *data0, size_t *step, int, UMatUsageFlags) const {
+		size_t total = CV_ELEM_SIZE(type);
+		for (int i=dims-1; i>=0; i--) {
+	    	if (step) {
+				if (data0 && step[i] != CV_AUTOSTEP) total = step[i];
+				else step[i] = total;
+	    	}
+	    	total *= sizes[i];
+		}
+		uchar *data = (uchar*) data0;
+		if (!data) {
+	    	const size_t len = mapped_size(total);
+	    	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	    	if (huge_pages) p = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+	    	if (p == MAP_FAILED) {
+				p = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+				if (p == MAP_FAILED) throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+				if (huge_pages) madvise(p, len, MADV_HUGEPAGE);
+#endif
+	    	}
+	    	if (interleave_mask) numa_interleave(p, len, interleave_mask);
+	    	data = (uchar*) p;
+	    	allocations++;
+		}
+		UMatData *u = new UMatData(this);
+		u->data = u->origdata = data;
+		u->size = total;
+		if (data0) u->flags |= UMatData::USER_ALLOCATED;
+		return u;
+    }
+
+    bool allocate(UMatData *u, int, UMatUsageFlags) const { return u != nullptr; }
+
+    void deallocate(UMatData *u) const {
+		if (!u) return;
+		CV_Assert(u->urefcount == 0);
+		CV_Assert(u->refcount == 0);
+		if (!(u->flags & UMatData::USER_ALLOCATED)) munmap(u->origdata, mapped_size(u->size));
+		delete u;
+    }
+
+    size_t get_allocations() const { return allocations; }
+
+};
+
+// A frame of the video and its position into the input, Source numbers the frames so that the stages after it can
+// check that they are still in order, and stamps the time it sends them out so that Drain measures their latency
+struct Frame : Mat {
+    size_t seq;
+    chrono::steady_clock::time_point sent;
+    bool missed; // set by a decoder of Source that couldn't reach the frame, the stream doesn't end there
+    Frame() : seq(0), missed(false) { }
+};
+
+// Fixed set of frames that goes around the graph: Source takes the free frames from a feedback channel and Drain puts
+// them back once they have been consumed, so the memory footprint is bounded and, once every frame buffer has been
+// created, no allocation is done per frame. Source waits when all the frames are in flight.
+// NOTE: the feedback channel is single producer single consumer, only one Drain can give back the frames.
+class FrameRing {
+
+    FrameAllocator allocator;
+    vector<Frame> frames;
+    SWSR_Ptr_Buffer channel;
+
+public:
+    FrameRing(size_t n, bool huge_pages=false, unsigned long interleave_mask=0) :
+		allocator(huge_pages, interleave_mask), frames(n), channel(n) {
+		channel.init();
+		for (Frame& f : frames) {
+	    	f.allocator = &allocator;
+	    	channel.push(&f);
+		}
+    }
+
+    // creates the buffers in advance (called by Source before the first frame is read)
+    void prepare(int rows, int cols, int type) {
+		if (rows > 0 && cols > 0) for (Frame& f : frames) f.create(rows, cols, type);
+    }
+
+    Frame *acquire() {
+		void *f = nullptr;
+		while (!channel.pop(&f)) this_thread::yield();
+		return (Frame*) f;
+    }
+
+    // a free frame, nullptr if all the frames are in flight
+    Frame *try_acquire() {
+		void *f = nullptr;
+		return channel.pop(&f) ? (Frame*) f : nullptr;
+    }
+
+    void release(Mat *f) {
+		while (!channel.push(f)) this_thread::yield();
+    }
+
+    size_t size() const { return frames.size(); }
+    size_t buffer_allocations() const { return allocator.get_allocations(); }
+
+    // false if the buffers of a ring of n frames of the input would take more than half of the memory of the machine
+    // (true when the input or the memory size can't be read, Source reports the input)
+    static bool fits(size_t n, const string& input) {
+		VideoCapture cap(input.c_str());
+		const double frame_bytes = cap.get(CAP_PROP_FRAME_HEIGHT) * cap.get(CAP_PROP_FRAME_WIDTH) * 3;
+		const long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+		if (!cap.isOpened() || frame_bytes <= 0 || pages <= 0 || page <= 0) return true;
+		return n * frame_bytes <= (double) pages * page / 2;
+    }
+
+};
+
+// Reads frames and sends them to the next stage, if a ring is given the frames are taken from it (and Drain must give
+// them back to the same ring), otherwise a new frame is allocated for every read.
+// With more than one decoder the input is split into segments of segment_frames frames that are given round robin to the
+// decoders, every decoder is a thread with its own VideoCapture that seeks to the first frame of each of its segments.
+// Every decoder holds at most decoder_depth frames of its segment (being decoded or waiting for their turn), whatever the
+// segment length, and sends them out in the order of the stream: Source waits for a free frame only for the next frame
+// to be sent, the decoders ahead of it take the ring frames that are free and otherwise wait, so the ring needs
+// decode_window frames for them.
+// A seek decodes from the keyframe before its target: segments should be as long as the group of pictures of the video
+// (or a multiple of it) so that they start on a keyframe and no frame is decoded twice. A seek that misses its frame is
+// done again from the first frame and a frame that a decoder can't reach at all makes Source decode the rest of the
+// stream serially, only the end of the stream ends it. Inputs that can't seek (no frame count) are decoded serially.
 struct Source : ff_node_t<Mat> {
     
     const string filename;
     int frames;
+    FrameRing *ring;
+    const size_t decoders, segment_frames;
 
-    Source(const string filename) : filename(filename) { }
+    Source(const string filename, FrameRing *ring=nullptr, size_t decoders=1, size_t segment_frames=250) :
+		filename(filename), ring(ring), decoders(decoders ? decoders : 1), segment_frames(segment_frames ? segment_frames : 1) { }
 
     int svc_init() {
 		frames = 0;
@@ -66,65 +226,649 @@ struct Source : ff_node_t<Mat> {
 	    	cerr << "Error: opening input file" << endl;
 	    	return EOS;
 		}
+		if (ring) ring->prepare((int) cap.get(CAP_PROP_FRAME_HEIGHT), (int) cap.get(CAP_PROP_FRAME_WIDTH), CV_8UC3);
+		const double count = cap.get(CAP_PROP_FRAME_COUNT);
+		if (decoders > 1 && count > 0) {
+			cap.release();
+			decode_segments((size_t) count);
+			return EOS;
+		}
+		read_serially(cap);
+		return EOS;
+    }
+
+public:
+    int get_processed_frames() { return frames; }
+
+    // frames a decoder can hold and frames held by all the decoders (the ones a ring must have for them)
+    static size_t decoder_depth(size_t segment_frames) { return min<size_t>(max<size_t>(segment_frames, 1), 16); }
+    static size_t decode_window(size_t decoders, size_t segment_frames) {
+		return decoders > 1 ? decoders * decoder_depth(segment_frames) : 0;
+    }
+
+private:
+	// reads and sends out the rest of the stream, starting from frame if given (a frame already taken from the ring)
+	void read_serially(VideoCapture& cap, Frame *frame=nullptr) {
 		for (;;) {
-	    	Mat *frame = new Mat();
-	    	frames++;
-	    	if (cap.read(*frame)) ff_send_out(frame);
-	    	else {
+	    	if (!frame) frame = ring ? ring->acquire() : new Frame();
+	    	frame->seq = frames++;
+	    	if (!cap.read(*frame)) {
+				if (!ring) delete frame; // a ring frame can't be put back from here (single producer channel)
 				cout << "End of stream in input" << endl;
 				break;
 	    	}
+			frame->sent = chrono::steady_clock::now();
+			ff_send_out(frame);
+			frame = nullptr;
 		}
-		return EOS;
+	}
+
+	// the frames of a decoder: free frames from Source (inbox) and decoded ones back to it (outbox)
+	struct decoder_queues {
+		SWSR_Ptr_Buffer inbox, outbox;
+		decoder_queues(size_t n) : inbox(n), outbox(n) {
+			inbox.init();
+			outbox.init();
+		}
+	};
+
+	// decoder of the frame seq, the frames after the expected count (if it was underestimated) go to the decoder of the
+	// last frame, that goes on reading them
+	size_t owner(size_t seq, size_t count) const {
+		return (min(seq, count-1) / segment_frames) % decoders;
+	}
+
+	// frame of the same decoder after seq: the next one of its segment or the first one of its next segment, count when
+	// the decoder has no more frames
+	size_t next_of(size_t seq, size_t count) const {
+		size_t next = seq + 1;
+		if (next >= count || next % segment_frames) return next; // the last decoder goes on after the expected count
+		next += (decoders - 1) * segment_frames;
+		return next < count ? next : count;
+	}
+
+	static void push(SWSR_Ptr_Buffer& q, void *p) {
+		while (!q.push(p)) this_thread::yield();
+	}
+
+	// pops from q until it succeeds or stop is set (returns nullptr)
+	static Frame *pop(SWSR_Ptr_Buffer& q, const atomic<bool>& stop) {
+		void *p = nullptr;
+		while (!q.pop(&p)) {
+			if (stop) return nullptr;
+			this_thread::yield();
+		}
+		return (Frame*) p;
+	}
+
+	// reads the frame seq of frame, pos is the frame the capture is on: a seek lands on a keyframe before the frame and
+	// grabs forward to it. A seek that misses (lands past the frame, or the frame can't be read from there while the
+	// stream should have it) is done again from the first frame of the stream. False at the end of the stream, a frame
+	// that can't be reached at all (the capture can't be opened) is marked as missed
+	bool read_at(VideoCapture& cap, size_t& pos, Frame& frame, size_t count) {
+		const size_t seq = frame.seq;
+		const bool seek = pos != seq;
+		if (seek && cap.isOpened()) {
+			cap.set(CAP_PROP_POS_FRAMES, (double) seq);
+			const double p = cap.get(CAP_PROP_POS_FRAMES);
+			pos = p >= 0 && p <= (double) seq ? (size_t) p : seq + 1;
+			while (pos < seq && cap.grab()) pos++;
+		}
+		if (pos == seq && cap.isOpened() && cap.read(frame)) {
+			pos++;
+			return true;
+		}
+		if (seek && seq < count && cap.open(filename.c_str())) {
+			pos = 0;
+			while (pos < seq && cap.grab()) pos++;
+			if (pos == seq && cap.read(frame)) {
+				pos++;
+				return true;
+			}
+		}
+		frame.missed = !cap.isOpened();
+		return false;
+	}
+
+	// decodes the frames it's given in order of seq, a frame that can't be read (end of stream, missed) is released
+	void decode(decoder_queues& q, size_t count, const atomic<bool>& stop) {
+		VideoCapture cap(filename.c_str());
+		size_t pos = 0;
+		while (Frame *frame = pop(q.inbox, stop)) {
+			frame->missed = false;
+			if (!read_at(cap, pos, *frame, count)) frame->release();
+			push(q.outbox, frame);
+		}
+	}
+
+	void decode_segments(size_t count) {
+		size_t depth = decoder_depth(segment_frames);
+		if (ring) depth = max<size_t>(1, min(depth, (ring->size() - 1) / decoders));
+		vector<unique_ptr<decoder_queues> > queues;
+		vector<thread> threads;
+		vector<size_t> next(decoders), held(decoders, 0); // next frame to give to every decoder and frames it holds
+		atomic<bool> stop(false);
+		for (size_t d=0; d<decoders; ++d) {
+			queues.push_back(unique_ptr<decoder_queues>(new decoder_queues(depth)));
+			next[d] = min(d * segment_frames, count);
+		}
+		for (size_t d=0; d<decoders; ++d) threads.push_back(thread(&Source::decode, this, ref(*queues[d]), count, cref(stop)));
+		size_t sent = 0;
+		Frame *lost = nullptr;
+		for (;;) {
+			const size_t o = owner(sent, count);
+			for (size_t i=0; i<decoders; ++i) {
+				const size_t d = (o + i) % decoders;
+				while (held[d] < depth && (next[d] < count || d == owner(count-1, count))) {
+					// waits for a free frame only for the next frame to be sent (the decoders ahead of it hold at
+					// most depth frames each), the next stages may need the frames that are ready before giving back
+					// theirs
+					Frame *frame = !ring ? new Frame() : (next[d] == sent ? ring->acquire() : ring->try_acquire());
+					if (!frame) break;
+					frame->seq = next[d];
+					next[d] = next_of(next[d], count);
+					held[d]++;
+					push(queues[d]->inbox, frame);
+				}
+			}
+			Frame *frame = pop(queues[o]->outbox, stop);
+			held[o]--;
+			sent++;
+			frames++;
+			if (frame->missed) { // the rest of the stream is read here, after the decoders have stopped
+				lost = frame;
+				break;
+			}
+			if (frame->empty()) {
+				if (!ring) delete frame;
+				cout << "End of stream in input" << endl;
+				break;
+			}
+			frame->sent = chrono::steady_clock::now();
+			ff_send_out(frame);
+		}
+		stop = true;
+		for (thread& t : threads) t.join();
+		if (!ring) { // frames given to the decoders after the end of the stream
+			void *p = nullptr;
+			for (unique_ptr<decoder_queues>& q : queues) {
+				while (q->inbox.pop(&p)) delete (Frame*) p;
+				while (q->outbox.pop(&p)) delete (Frame*) p;
+			}
+		}
+		if (lost) {
+			cerr << "Warning: a decoder couldn't read frame " << lost->seq << ", the rest of the stream is decoded serially" << endl;
+			VideoCapture cap(filename.c_str());
+			size_t pos = 0;
+			while (pos < lost->seq && cap.isOpened() && cap.grab()) pos++;
+			if (cap.isOpened() && pos == lost->seq) {
+				frames = (int) pos;
+				lost->missed = false;
+				read_serially(cap, lost);
+			} else {
+				cerr << "Error: frame " << lost->seq << " of the input can't be read" << endl;
+				if (!ring) delete lost;
+			}
+		}
+	}
+
+};
+
+// Reflected index of a row or column (BORDER_REFLECT_101, the border of OpenCV filters)
+static inline int reflect101(int i, int n) { return i < 0 ? -i : (i >= n ? 2*n-2-i : i); }
+static inline uchar clamp_round(float v) { return (uchar) (std::min(std::max(v, 0.f), 255.f) + 0.5f); }
+
+// This stage makes the cost of the frames irregular, as a scene change does: every period-th frame is blurred rounds times
+// into a scratch buffer of the thread (the frame itself is not modified) before going on, the other frames go on at once.
+// A farm dealing the frames round robin to period workers gives all the expensive frames to the same one.
+struct Burst : ff_node_t<Mat> {
+
+    Burst(size_t period, int rounds=4) : period(period ? period : 1), rounds(rounds) { }
+
+    Mat *svc(Mat *frame) {
+		static thread_local Mat scratch;
+		if (((Frame*) frame)->seq % period == 0) // every frame comes from Source
+	    	for (int r=0; r<rounds; ++r) GaussianBlur(*frame, scratch, Size(0,0), 3);
+		return frame;
     }
 
-public:
-    int get_processed_frames() { return frames; }
+private:
+    const size_t period;
+    const int rounds;
 
 };
 
 // This stage applies the Gaussian Blur filter and sends the result to the next stage
-struct Stage1 : ff_node_t<Mat> {
+// As a row stage (8 bit frames, see ff_comp::run_rows) it computes a row with a vertical then horizontal Gaussian in
+// float and addWeighted, the inner loops go along the row with no dependence between the values so the compiler
+// vectorizes them (-O3). OpenCV blurs 8 bit images in fixed point, a value may differ from svc by a rounding step.
+// The scratch buffers belong to the thread computing the frame, so a single Stage1 can be shared by the workers of a farm
+// (see the reentrant comp of ffvideofarm).
+struct Stage1 : ff_node_t<Mat>, ff_row_stage<uchar> {
+
+    static const int radius = 9; // rows around a pixel that it depends on (kernel of sigma 3 on 8 bit frames is 19x19)
+
+    Stage1() {
+		float sum = 0;
+		for (int k=-radius; k<=radius; ++k) sum += (kernel[k+radius] = std::exp(-(float) (k*k) / (2 * sigma * sigma)));
+		for (float& g : kernel) g /= sum;
+    }
 
     Mat *svc(Mat *frame) {
-		Mat frame1;
+		Mat& frame1 = buffers().frame1;
 		GaussianBlur(*frame, frame1, Size(0,0), 3);
 		addWeighted(*frame, 1.5, frame1, -0.5, 0, *frame);
 		return frame;
     }
 
+    size_t row_radius() const { return radius; }
+
+    // rows of at least radius+1 pixels
+    void svc_row(const uchar* const* in, uchar *out, size_t cols, size_t channels) {
+		const int cn = (int) channels, width = (int) (cols * channels), c = (int) cols;
+		vector<float>& vert = buffers().vert;
+		vector<float>& blur = buffers().blur;
+		vert.resize((size_t) width + 2*radius*cn);
+		blur.resize(width);
+		float *v = &vert[(size_t) radius*cn];
+		std::fill(v, v+width, 0.f);
+		for (int k=0; k<=2*radius; ++k) {
+	    	const uchar *row = in[k];
+	    	const float g = kernel[k];
+	    	for (int x=0; x<width; ++x) v[x] += g * row[x];
+		}
+		for (int j=1; j<=radius; ++j)
+	    	for (int ch=0; ch<cn; ++ch) {
+				v[-j*cn + ch] = v[reflect101(-j, c)*cn + ch];
+				v[(c-1+j)*cn + ch] = v[reflect101(c-1+j, c)*cn + ch];
+	    	}
+		std::fill(blur.begin(), blur.end(), 0.f);
+		for (int k=-radius; k<=radius; ++k) {
+	    	const float g = kernel[k+radius];
+	    	const float *vk = v + k*cn;
+	    	for (int x=0; x<width; ++x) blur[x] += g * vk[x];
+		}
+		const uchar *center = in[radius];
+		for (int x=0; x<width; ++x) out[x] = clamp_round(1.5f * center[x] - 0.5f * clamp_round(blur[x]));
+    }
+
+private:
+    static constexpr float sigma = 3;
+    float kernel[2*radius+1];
+
+    struct scratch {
+		Mat frame1; // allocated at the first frame and then reused
+		vector<float> vert, blur; // vertical blur of a row (with reflected borders around it), horizontal blur
+    };
+    // the buffers of the calling thread, first touched by it (on its own NUMA node when it's pinned)
+    static scratch& buffers() {
+		static thread_local scratch s;
+		return s;
+    }
+
 };
 
 // This stage applies the Sobel filter and sends the result to the next stage
-struct Stage2 : ff_node_t<Mat> {
+struct Stage2 : ff_node_t<Mat>, ff_row_stage<uchar> {
+
+    static const int radius = 1;
 
     Mat *svc(Mat *frame) {
 		Sobel(*frame, *frame, -1, 1, 0, 3);
 		return frame;
     }
+
+    size_t row_radius() const { return radius; }
+
+    // rows of at least 2 pixels, the reflected first and last columns have no horizontal gradient
+    void svc_row(const uchar* const* in, uchar *out, size_t cols, size_t channels) {
+		const int cn = (int) channels, width = (int) (cols * channels);
+		const uchar *up = in[0], *mid = in[1], *down = in[2];
+		for (int x=0; x<cn; ++x) out[x] = out[width-cn+x] = 0;
+		for (int x=cn; x<width-cn; ++x) {
+	    	const int d = (up[x+cn] - up[x-cn]) + 2*(mid[x+cn] - mid[x-cn]) + (down[x+cn] - down[x-cn]);
+	    	out[x] = (uchar) std::min(std::max(d, 0), 255);
+		}
+    }
 };
 
-// This stage shows the output
+// Runs a comp of image stages over the frames row by row with ff_comp::run_rows (stages that are not row stages make the
+// comp run on whole frames), the intermediate rows stay into line buffers instead of whole frames. The frames must be
+// wider than the radius of the stages, as the ones of Stage1 and Stage2 need.
+struct RowsNode : ff_node_t<Mat> {
+
+    RowsNode(ff_comp& comp) : comp(comp) { }
+
+    int svc_init() { return ((ff_node&) comp).svc_init(); }
+    void svc_end() { ((ff_node&) comp).svc_end(); }
+
+    Mat *svc(Mat *frame) {
+		if (frame->depth() != CV_8U || frame->cols <= Stage1::radius) return (Mat*) comp.run(frame); // see Stage1::svc_row
+		return (Mat*) comp.run_rows(frame, frame->ptr<uchar>(0), frame->rows, frame->cols, frame->channels(), frame->step[0]);
+    }
+
+private:
+    ff_comp& comp;
+
+};
+
+// This stage computes the same filters of Stage1 and Stage2 in a single pass over the frame: the input rows are copied
+// into a ring of 2*radius+1 line buffers as the pass reaches them, every unsharp row is computed from the lines with
+// the row kernel of Stage1 into a ring of 3 rows and every output row is computed from them with the one of Stage2 and
+// written in place, so a frame is read and written once and the working set is a strip of lines that stays in cache.
+// It's what ff_comp::run_rows does for any chain of row stages, written out for these two.
+// 8 bit frames only, the others go through Stage1 and Stage2.
+// With validation every frame is also computed by Comp(Stage1, Stage2) and compared: OpenCV blurs 8 bit images in fixed
+// point, so the unsharp values may differ by a rounding step and the output by up to the Sobel gain of it, 8 (tolerance).
+struct FusedStage : ff_node_t<Mat> {
+
+    FusedStage(bool validate=false, int tolerance=8) : validate(validate), tolerance(tolerance) {
+		reference.add_stage(&reference_s1);
+		reference.add_stage(&reference_s2);
+    }
+
+    int svc_init() {
+		time_elapsed = 0;
+		checked = over_tolerance = 0;
+		max_diff = 0;
+		return 0;
+    }
+
+    Mat *svc(Mat *frame) {
+		using namespace std::chrono;
+		if (validate) frame->copyTo(expected);
+		time_point<steady_clock> cstart = steady_clock::now();
+		if (frame->depth() != CV_8U || frame->rows <= Stage1::radius || frame->cols <= Stage1::radius) {
+	    	s1.svc(frame);
+	    	s2.svc(frame);
+		} else fused(*frame);
+		time_elapsed += ((duration<double, std::milli>) (steady_clock::now()-cstart)).count();
+		if (validate) check(*frame);
+		return frame;
+    }
+
+    double ff_time() { return time_elapsed; }
+    // validation results: frames compared, largest difference from Comp(Stage1, Stage2), values beyond the tolerance
+    size_t get_checked() const { return checked; }
+    int get_max_diff() const { return max_diff; }
+    size_t get_over_tolerance() const { return over_tolerance; }
+    bool valid() const { return over_tolerance == 0; }
+
+private:
+    const bool validate;
+    const int tolerance;
+    vector<uchar> lines, sharp;   // input line ring, unsharp row ring
+    Stage1 s1, reference_s1;
+    Stage2 s2, reference_s2;
+    ff_comp reference;
+    Mat expected;
+    double time_elapsed;
+    size_t checked, over_tolerance;
+    int max_diff;
+
+    void fused(Mat& frame) {
+		const int rows = frame.rows, cn = frame.channels(), width = frame.cols * cn, r = Stage1::radius, lines_n = 2*r+1;
+		lines.resize((size_t) lines_n * width);
+		sharp.resize(3 * (size_t) width);
+		const uchar *window[2*Stage1::radius+1];
+		int loaded = 0; // input rows [0, loaded) are into the line ring
+		for (int y=-1; y<rows; ++y) {
+	    	// unsharp row y+1 (rows 0 and 1 before the first output row), it needs the input rows up to y+1+r
+	    	const int u = y+1;
+	    	if (u < rows) {
+				for (; loaded < rows && loaded <= u+r; ++loaded)
+		    		memcpy(&lines[(size_t) (loaded % lines_n) * width], frame.ptr<uchar>(loaded), width);
+				for (int k=-r; k<=r; ++k) window[k+r] = &lines[(size_t) (reflect101(u+k, rows) % lines_n) * width];
+				s1.svc_row(window, &sharp[(size_t) (u % 3) * width], frame.cols, cn);
+	    	}
+	    	if (y < 0) continue;
+	    	// output row y, the input row y is into the ring so the frame row can be overwritten
+	    	for (int k=-1; k<=1; ++k) window[k+1] = &sharp[(size_t) (reflect101(y+k, rows) % 3) * width];
+	    	s2.svc_row(window, frame.ptr<uchar>(y), frame.cols, cn);
+		}
+    }
+
+    void check(const Mat& frame) {
+		reference.run(&expected);
+		for (int y=0; y<frame.rows; ++y) {
+	    	const uchar *a = frame.ptr<uchar>(y), *b = expected.ptr<uchar>(y);
+	    	for (int x=0; x<frame.cols * frame.channels(); ++x) {
+				const int d = std::abs(a[x] - b[x]);
+				max_diff = std::max(max_diff, d);
+				if (d > tolerance) over_tolerance++;
+	    	}
+		}
+		checked++;
+    }
+
+};
+
+// Writes the frames into a video file on its own encoder thread: Drain puts the frames into a queue of depth frames and
+// goes on while the encoder writes the previous ones, so encoding overlaps the computation of the next frames (with a
+// ring the frames themselves are the buffers, nothing is copied). Frames are written in the order of their seq, the ones
+// that arrive early wait into a reorder buffer, and then they are given back to the ring (or deleted).
+// NOTE: with a ring the encoder thread gives the frames back to it in place of Drain (single producer channel).
+class VideoSink {
+
+    const string filename;
+    const double fps;
+    const int fourcc;
+    FrameRing *ring;
+    SWSR_Ptr_Buffer queue;
+    thread encoder;
+    atomic<bool> done;
+    atomic<size_t> in_sink;                // frames put and not written yet (queue and reorder buffer)
+    VideoWriter writer;
+    map<size_t, Frame*> pending;           // reorder buffer, encoder thread only
+    size_t next_seq, written, reordered, max_depth, depth_sum, puts;
+    double encode_ms, stall_ms, wall_ms;
+    chrono::steady_clock::time_point start_time;
+
+    void write(Frame *frame) {
+		if (!writer.isOpened() && !frame->empty() && !writer.open(filename, fourcc, fps, frame->size(), frame->channels() == 3))
+	    	cerr << "Error: opening output file " << filename << endl;
+		if (writer.isOpened()) {
+	    	const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+	    	writer.write(*frame);
+	    	encode_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+	    	written++;
+		}
+		next_seq = frame->seq + 1;
+		if (ring) ring->release(frame);
+		else delete frame;
+		in_sink--;
+    }
+
+    void encode() {
+		for (;;) {
+	    	void *p = nullptr;
+	    	if (!queue.pop(&p)) {
+				if (done && queue.empty()) break;
+				this_thread::yield();
+				continue;
+	    	}
+	    	Frame *frame = (Frame*) p;
+	    	if (frame->seq != next_seq) {
+				reordered++;
+				pending[frame->seq] = frame;
+	    	} else write(frame);
+	    	while (!pending.empty() && pending.begin()->first == next_seq) {
+				Frame *next = pending.begin()->second;
+				pending.erase(pending.begin());
+				write(next);
+	    	}
+		}
+		while (!pending.empty()) { // frames after a gap of the stream
+	    	Frame *next = pending.begin()->second;
+	    	pending.erase(pending.begin());
+	    	write(next);
+		}
+		writer.release();
+    }
+
+public:
+    VideoSink(const string filename, double fps, FrameRing *ring=nullptr, size_t depth=8,
+		int fourcc=VideoWriter::fourcc('M','J','P','G')) :
+		filename(filename), fps(fps > 0 ? fps : 25), fourcc(fourcc), ring(ring), queue(depth ? depth : 1), done(false), in_sink(0) {
+		queue.init();
+    }
+
+    ~VideoSink() { stop(); }
+
+    // starts the encoder thread (called by Drain in its svc_init)
+    void start() {
+		next_seq = written = reordered = max_depth = depth_sum = puts = 0;
+		encode_ms = stall_ms = wall_ms = 0;
+		done = false;
+		start_time = chrono::steady_clock::now();
+		encoder = thread(&VideoSink::encode, this);
+    }
+
+    // hands a frame to the encoder, it waits only if the queue is full
+    void put(Frame *frame) {
+		const size_t depth = ++in_sink;
+		max_depth = max(max_depth, depth);
+		depth_sum += depth;
+		puts++;
+		if (!queue.push(frame)) {
+	    	const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+	    	while (!queue.push(frame)) this_thread::yield();
+	    	stall_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+		}
+    }
+
+    // writes the frames that are still queued and closes the file (called by Drain in its svc_end)
+    void stop() {
+		if (!encoder.joinable()) return;
+		done = true;
+		encoder.join();
+		wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+    }
+
+    size_t get_written() const { return written; }
+
+    void print_stats(ostream& out) const {
+		out << "Output: " << written << " frames written to " << filename << ", encoding " << encode_ms << " (ms)";
+		if (encode_ms > 0) out << " (" << written / (encode_ms / 1000) << " frames/s)";
+		if (wall_ms > 0) out << ", " << written / (wall_ms / 1000) << " frames/s overall";
+		out << endl;
+		out << "Output queue: depth " << queue.buffersize() << ", average " << (puts ? (double) depth_sum / puts : 0)
+	    	<< ", max " << max_depth << " frames, " << reordered << " reordered, Drain waited " << stall_ms << " (ms)" << endl;
+    }
+
+};
+
+// This node computes every frame with a comp of image stages mapped over horizontal bands of the frame in parallel (one
+// comp per band, every comp has stages of its own). Every band is copied together with halo rows
+// above and below it, the sum of the radius of the stages, so that its own rows are computed exactly as into the whole
+// frame (the borders of the band copy are wrong but they are dropped), then the bands are copied back into the frame.
+// It lowers the latency of a single frame, a farm over the frames raises the throughput instead.
+struct BandMap : ff_node_t<Mat> {
+
+    BandMap(const vector<ff_comp*>& comps, int halo) : comps(comps), halo(halo), bands(comps.size()), pf((long) comps.size()) { }
+
+    int svc_init() {
+		time_elapsed = 0;
+		for (ff_comp *c : comps)
+	    	if (((ff_node*) c)->svc_init() < 0) return -1;
+		return 0;
+    }
+
+    void svc_end() {
+		for (ff_comp *c : comps) ((ff_node*) c)->svc_end();
+    }
+
+    Mat *svc(Mat *frame) {
+		using namespace std::chrono;
+		time_point<steady_clock> cstart = steady_clock::now();
+		const long n = (long) comps.size();
+		pf.parallel_for(0, n, 1, 1, [&](const long b) {
+	    	int first, last;
+	    	band(b, frame->rows, first, last);
+	    	if (first == last) return;
+	    	(*frame)(Range(max(0, first-halo), min(frame->rows, last+halo)), Range::all()).copyTo(bands[b]);
+	    	comps[b]->run(&bands[b]);
+		});
+		// the halo rows of a band are rows of its neighbours, they are written back once every band has been read
+		pf.parallel_for(0, n, 1, 1, [&](const long b) {
+	    	int first, last;
+	    	band(b, frame->rows, first, last);
+	    	if (first == last) return;
+	    	const int top = first - max(0, first-halo);
+	    	Mat rows = frame->rowRange(first, last);
+	    	bands[b].rowRange(top, top + last-first).copyTo(rows);
+		});
+		time_elapsed += ((duration<double, std::milli>) (steady_clock::now()-cstart)).count();
+		return frame;
+    }
+
+    double ff_time() { return time_elapsed; }
+
+private:
+    const vector<ff_comp*> comps;
+    const int halo;
+    vector<Mat> bands; // band copies with their halo, reused between frames
+    ParallelFor pf;
+    double time_elapsed;
+
+    // rows [first, last) of band b, the bands differ at most by one row
+    void band(long b, int rows, int& first, int& last) const {
+		const long n = (long) comps.size();
+		first = (int) (b * rows / n);
+		last = (int) ((b+1) * rows / n);
+    }
+
+};
+
+// This stage shows the output and, if a sink is given, writes it into a file
 struct Drain : ff_node_t<Mat> {
 
-    Drain(bool ovf) : outvideo(ovf) { }
+    Drain(bool ovf, FrameRing *ring=nullptr, VideoSink *sink=nullptr) : outvideo(ovf), ring(ring), sink(sink) { }
 
     int svc_init() {
 		if (outvideo) namedWindow("edges", 1);
+		if (sink) sink->start();
+		next_seq = out_of_order = 0;
+		latencies.clear();
 		return 0;
     }
 
+    void svc_end() {
+		if (sink) sink->stop();
+    }
+
     Mat *svc(Mat *frame) {
 		if (outvideo) {
 	    	imshow("edges", *frame);
 	    	waitKey(30);
 		}
-		delete frame;
+		const size_t seq = ((Frame*) frame)->seq; // every frame comes from Source
+		latencies.push_back(chrono::duration<double, std::milli>(chrono::steady_clock::now() - ((Frame*) frame)->sent).count());
+		if (seq != next_seq) out_of_order++;
+		next_seq = seq + 1;
+		if (sink) sink->put((Frame*) frame);
+		else if (ring) ring->release(frame);
+		else delete (Frame*) frame;
 		return GO_ON;
     }
 
+    // frames that didn't follow the previous one into the input
+    size_t get_out_of_order() const { return out_of_order; }
+    // latency (ms) from Source to Drain that the fraction q of the frames didn't exceed (q = 0.99 -> 99th percentile)
+    double get_latency(double q) const {
+		if (latencies.empty()) return 0;
+		vector<double> sorted(latencies);
+		const size_t k = min(sorted.size()-1, (size_t) (q * sorted.size()));
+		nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		return sorted[k];
+    }
+
 protected:
     const bool outvideo;
+    FrameRing *ring;
+    VideoSink *sink;
+    size_t next_seq = 0, out_of_order = 0;
+    vector<double> latencies; // ms, one per frame
 
 };
 
@@ -139,7 +883,6 @@ struct SeqNode : ff_node_t<Mat> {
 	Mat *svc(Mat *frame) {
 		using namespace std::chrono;
 		time_point<chrono::system_clock> cstart = system_clock::now();
-		Mat frame1;
 		GaussianBlur(*frame, frame1, Size(0,0), 3);
 		addWeighted(*frame, 1.5, frame1, -0.5, 0, *frame);
 		Sobel(*frame, *frame, -1, 1, 0, 3);
@@ -150,6 +893,7 @@ struct SeqNode : ff_node_t<Mat> {
 
 	private:
 	double time_elapsed;
+	Mat frame1; // scratch buffer reused between frames
 
 	public:
 	double ff_time() { return time_elapsed; } // returns total runtime
@@ -38,8 +38,37 @@
  *   skeleton == 0 -> Farm(pipe(Source, Comp(Stage1, Stage2), Drain)) with 16 workers
  *   skeleton == 1 -> Farm(pipe(Source, Seq(Stage1, Stage2), Drain)) with 16 workers
  *   skeleton == 2 -> Farm(pipe(Source, Pipe(Stage1, Stage2), Drain)) with 8 workers
+ *   skeleton == 3 -> pipe(Source, CompFarm(Comp(Stage1, Stage2)), Drain) with 1 to 16 workers
+ *   skeleton == 4 -> Farm(pipe(Source, Fused, Drain)) with 16 workers
+ *   skeleton == 5 -> Farm(pipe(Source, Worker(Shared), Drain)) with 16 workers
+ *   skeleton == 6 -> pipe(Source, WSFarm(Comp(Stage1, Stage2)), Drain) with 16 workers
  * where Seq is a ff_node_t that executes in sequence the code contained into Stage1 and
  * Stage2 svc methods.
+ * Fused computes both filters in a single pass over the frame (see FusedStage), with -c every
+ * worker checks its frames against Comp(Stage1, Stage2).
+ * CompFarm is the autoscaling farm of compfarm.hpp: it starts with a single active comp and
+ * grows or shrinks the number of active ones while the video is computed, looking at how many
+ * frames are waiting for a worker and at how busy the workers are (-a sets the bounds, e.g. -a 2-8,
+ * the idle replicas are parked on a condition variable), the changes are reported at the end.
+ * Shared is a single reentrant Comp(Stage1, Stage2) run by every worker (ff_comp_worker): the stages are not replicated
+ * and the comp keeps the statistics of every worker thread, the spread of the frames among them is reported at the end.
+ * WSFarm is the work stealing farm of wsfarm.hpp (ordered): the frames are dealt round robin to a queue per worker as
+ * ff_ofarm does, but an idle worker steals the frames queued to a busy one, the steals are reported at the end.
+ * With -i every period-th frame costs more, as a scene change (see Burst into ffvideo.hpp), in the comps of the skeletons
+ * 0, 3, 5 and 6: with a period of 16 ff_ofarm gives all of them to the same worker. The latency of the frames from
+ * Source to Drain (median, 99th percentile, max) is reported for every skeleton, compare 0 and 6 with -i 16.
+ * 
+ * With -p the threads are pinned: "numa" places Source and Drain on the first node and spreads the
+ * worker threads (16 for every skeleton) round robin over the NUMA nodes, a cpu list (e.g. 0-15)
+ * gives its cpus in order to Source, to the worker threads and to Drain. The workers pin themselves
+ * before allocating their buffers (the comp replicas before building their stages, see ff_comp::replicate),
+ * the frame ring is interleaved over the nodes and the number of frames computed on every node is reported
+ * at the end.
+ * 
+ * With -d the frames are decoded by several threads of Source, each one on its own segments of
+ * -s frames (see Source into ffvideo.hpp), so that decoding keeps up with the workers.
+ * With -o the output is written into a video file by the encoder thread of VideoSink, its
+ * throughput and queue depth are reported at the end.
  * 
  * Note: for further information please see the ffcompvideo.cpp file.
  *
@@ -47,12 +76,14 @@
 
 #include "ffvideo.hpp" // definition of ff stages are in this header, please have a look
 #include <ff/farm.hpp>
+#include "../compfarm.hpp"
+#include "../wsfarm.hpp"
 
 using namespace ff;
 using namespace cv;
 using namespace std;
 
-// fixed number of components, run this program with ./ffvideofarm input skeleton [-v]
+// fixed number of components, run this program with ./ffvideofarm input skeleton [-v] [-H] [-p numa|cpulist] [-a min-max] [-d decoders] [-s segment frames] [-o output] [-c] [-i period]
 int main(int argc, char *argv[]) {
 
     Mat* edges;
@@ -62,19 +93,52 @@ int main(int argc, char *argv[]) {
     const int pipe_workers_num = 8;
 
     bool out_video_flag = false;
+    bool huge_pages_flag = false;
+    string placement_spec;
+    size_t scale_min = 1, scale_max = comp_workers_num;
+    size_t decoders = 1, segment_frames = 250, burst_period = 0;
+    string out_path;
+    bool validate_flag = false;
 
     int param;
-    const char *pattern = "hv";
+    const char *pattern = "hvHp:a:d:s:o:ci:";
     while ((param = getopt(argc, argv, pattern)) != -1) {
         switch (param) {
             case 'h':
-                cout << "Usage: ./ffvideofarm input skeleton [-v]" << endl;
+                cout << "Usage: ./ffvideofarm input skeleton [-v] [-H] [-p numa|cpulist] [-a min-max] [-d decoders] [-s segment frames] [-o output] [-c] [-i period]" << endl;
                 return EXIT_SUCCESS;
             case 'v':
                 out_video_flag = true;
                 break;
+            case 'H':
+                huge_pages_flag = true;
+                break;
+            case 'p':
+                placement_spec = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'c':
+                validate_flag = true;
+                break;
+            case 'd':
+            case 's':
+            case 'i':
+                if (atoi(optarg) < 1) {
+                    cerr << "Error: option -" << (char) param << " requires a positive integer" << endl;
+                    return EXIT_FAILURE;
+                }
+                (param == 'd' ? decoders : param == 's' ? segment_frames : burst_period) = atoi(optarg);
+                break;
+            case 'a':
+                if (sscanf(optarg, "%zu-%zu", &scale_min, &scale_max) != 2 || scale_min < 1 || scale_min > scale_max) {
+                    cerr << "Error: autoscaling bounds must be min-max with 1 <= min <= max (e.g. 2-8)" << endl;
+                    return EXIT_FAILURE;
+                }
+                break;
             case '?':
-                if (optopt == 'v')
+                if (optopt == 'p' || optopt == 'a' || optopt == 'd' || optopt == 's' || optopt == 'o' || optopt == 'i')
 	                  cerr << "Error: option -" << optopt << " requires an argument" << endl;
                 else if (isprint(optopt))
 	                  cerr << "Error: unknown option -" << (char) optopt << endl;
@@ -88,8 +152,8 @@ int main(int argc, char *argv[]) {
     }
 
     if (argc < 3) {
-        cerr << "Error: you must provide a video input and select a valid skeleton type (0 for comp, 1 for sequential, 2 for pipeline)" << endl;
-        cout << "Usage: ./ffvideofarm input skeleton [-v]" << endl;
+        cerr << "Error: you must provide a video input and select a valid skeleton type (0 for comp, 1 for sequential, 2 for pipeline, 3 for autoscaled comps, 4 for fused, 5 for a shared comp, 6 for work stealing comps)" << endl;
+        cout << "Usage: ./ffvideofarm input skeleton [-v] [-H] [-p numa|cpulist] [-a min-max] [-d decoders] [-s segment frames] [-o output] [-c] [-i period]" << endl;
         return EXIT_FAILURE;
     }
 
@@ -98,20 +162,55 @@ int main(int argc, char *argv[]) {
     try {
         skeleton_type = stoi(argv[optind+1]);
     } catch (exception) {
-        cerr << "Error: skeleton type must be an integer (0 for comp, 1 for sequential, 2 for pipeline)" << endl;
-        cout << "Usage: ./ffvideofarm input skeleton [-v]" << endl;
+        cerr << "Error: skeleton type must be an integer (0 for comp, 1 for sequential, 2 for pipeline, 3 for autoscaled comps, 4 for fused, 5 for a shared comp, 6 for work stealing comps)" << endl;
+        cout << "Usage: ./ffvideofarm input skeleton [-v] [-H] [-p numa|cpulist] [-a min-max] [-d decoders] [-s segment frames] [-o output] [-c] [-i period]" << endl;
         return EXIT_FAILURE;
     }
 
-    vector<ff_node*> pipes, seqs, comps;
+    // every skeleton has 16 worker threads (8 pipelines have 2 stages each)
+    const numa_topology topology;
+    numa_placement placement(comp_workers_num);
+    if (!placement_spec.empty() && !numa_placement::parse(placement_spec, topology, comp_workers_num, placement)) {
+        cerr << "Error: placement must be \"numa\" or a list of at least 3 cpus (e.g. 0-15)" << endl;
+        return EXIT_FAILURE;
+    }
+    const bool interleave = !placement_spec.empty() && topology.size() > 1;
+
+    vector<ff_node*> pipes, seqs, comps, fuseds, shared_workers;
+    // Comp(Stage1, Stage2) of the comp skeletons, every replica builds stages of its own on its worker thread
+    ff_comp prototype;
+    if (burst_period) prototype.add_stage([burst_period]() { return new Burst(burst_period); });
+    prototype.add_stage([]() { return new Stage1(); });
+    prototype.add_stage([]() { return new Stage2(); });
+    vector<unique_ptr<ff_node> > replicas; // they own their stages
     vector<Stage1*> s1s;
     vector<Stage2*> s2s;
-    Source source(in_video_path);
-    Drain drain(out_video_flag);
+    // frames go around from Drain (or from the encoder of the output sink) back to Source, with more decoders the ring
+    // holds the few frames of every decoder too (see Source) and with an output file the frames waiting for the encoder
+    const size_t sink_depth = 8;
+    const size_t ring_frames = 64 + Source::decode_window(decoders, segment_frames) + (out_path.empty() ? 0 : sink_depth);
+    if (!FrameRing::fits(ring_frames, in_video_path)) {
+        cerr << "Error: a frame ring of " << ring_frames << " frames doesn't fit into memory, use fewer decoders (-d)" << endl;
+        return EXIT_FAILURE;
+    }
+    FrameRing ring(ring_frames, huge_pages_flag, interleave ? numa_node_mask(topology) : 0);
+    Pinned<Source> source(in_video_path, &ring, decoders, segment_frames);
+    unique_ptr<VideoSink> sink;
+    if (!out_path.empty()) sink.reset(new VideoSink(out_path, VideoCapture(in_video_path).get(CAP_PROP_FPS), &ring, sink_depth));
+    Pinned<Drain> drain(out_video_flag, &ring, sink.get());
+    source.pin(placement.source);
+    drain.pin(placement.drain);
     ff_pipeline main_pipe;
     // using a normal farm instead of an ordered one should decrease the completion time, but the frames would be processed not in order and the
     // result would be a flickering horrible video, so I prefer to use an ordered farm and pay a very little overhead
     ff_ofarm farm; 
+    ff_node* middle = &farm;
+    ff_comp_farm* comp_farm = nullptr;
+    unique_ptr<ff_comp_wsfarm> ws_farm;
+    Burst shared_burst(burst_period);
+    Stage1 shared_s1;
+    Stage2 shared_s2;
+    ff_comp shared_comp;
 
     main_pipe.add_stage(&source);
 
@@ -119,15 +218,10 @@ int main(int argc, char *argv[]) {
         case 0:
             // farm of comps
             cout << "Using comp skeleton" << endl;
+            replicas = prototype.replicate<Pinned<ff_comp> >(comp_workers_num);
             for (int i=0; i<comp_workers_num; ++i) {
-                Stage1* temp_s1 = new Stage1();
-                Stage2* temp_s2 = new Stage2();
-                ff_comp* temp_comp = new ff_comp();
-                temp_comp->add_stage(temp_s1);
-                temp_comp->add_stage(temp_s2);
-                s1s.push_back(temp_s1);
-                s2s.push_back(temp_s2);
-                comps.push_back(temp_comp);
+                ((Pinned<ff_comp>*) replicas[i].get())->pin(placement.slots[i]);
+                comps.push_back(replicas[i].get());
             }
             if (farm.add_workers(comps)<0) {
                 error("adding comp nodes to the farm\n");
@@ -137,7 +231,11 @@ int main(int argc, char *argv[]) {
         case 1:
             // farm of seqs
             cout << "Using seq nodes" << endl;
-            for (int i=0; i<seq_workers_num; ++i) seqs.push_back(new SeqNode());
+            for (int i=0; i<seq_workers_num; ++i) {
+                Pinned<SeqNode>* temp_seq = new Pinned<SeqNode>();
+                temp_seq->pin(placement.slots[i]);
+                seqs.push_back(temp_seq);
+            }
             if (farm.add_workers(seqs)<0) {
                 error("adding seq nodes to the farm\n");
                 return EXIT_FAILURE;
@@ -147,8 +245,10 @@ int main(int argc, char *argv[]) {
             // farm of pipelines
             cout << "Using pipeline skeleton" << endl;
             for (int i=0; i<pipe_workers_num; ++i) {
-                Stage1* temp_s1 = new Stage1();
-                Stage2* temp_s2 = new Stage2();
+                Pinned<Stage1>* temp_s1 = new Pinned<Stage1>();
+                Pinned<Stage2>* temp_s2 = new Pinned<Stage2>();
+                temp_s1->pin(placement.slots[2*i]);
+                temp_s2->pin(placement.slots[2*i+1]);
                 ff_pipeline* temp_pipe = new ff_pipeline();
                 temp_pipe->add_stage(temp_s1);
                 temp_pipe->add_stage(temp_s2);
@@ -161,13 +261,66 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
             break;
+        case 3:
+            // autoscaled farm of comps (ordered, as the ff_ofarm of the other skeletons)
+            cout << "Using autoscaled comp farm (" << scale_min << "-" << min<size_t>(scale_max, comp_workers_num) << " workers)" << endl;
+            replicas = prototype.replicate<Pinned<ff_comp> >(comp_workers_num);
+            for (int i=0; i<comp_workers_num; ++i) {
+                ((Pinned<ff_comp>*) replicas[i].get())->pin(placement.slots[i]);
+                comps.push_back(replicas[i].get());
+            }
+            comp_farm = new ff_comp_farm(comps, true);
+            comp_farm->set_autoscale(scale_min, scale_max);
+            middle = comp_farm;
+            break;
+        case 4:
+            // farm of fused stages
+            cout << "Using fused stages" << (validate_flag ? " (validated against comps)" : "") << endl;
+            for (int i=0; i<comp_workers_num; ++i) {
+                Pinned<FusedStage>* temp_fused = new Pinned<FusedStage>(validate_flag);
+                temp_fused->pin(placement.slots[i]);
+                fuseds.push_back(temp_fused);
+            }
+            if (farm.add_workers(fuseds)<0) {
+                error("adding fused nodes to the farm\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 5:
+            // farm of workers sharing a single comp
+            cout << "Using a shared comp" << endl;
+            if (burst_period) shared_comp.add_stage(&shared_burst);
+            shared_comp.add_stage(&shared_s1);
+            shared_comp.add_stage(&shared_s2);
+            shared_comp.set_reentrant(true);
+            for (int i=0; i<comp_workers_num; ++i) {
+                Pinned<ff_comp_worker>* temp_worker = new Pinned<ff_comp_worker>(shared_comp);
+                temp_worker->pin(placement.slots[i]);
+                shared_workers.push_back(temp_worker);
+            }
+            if (farm.add_workers(shared_workers)<0) {
+                error("adding shared comp workers to the farm\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 6:
+            // work stealing farm of comps (ordered, as the ff_ofarm of the other skeletons)
+            cout << "Using work stealing comp farm" << endl;
+            replicas = prototype.replicate<Pinned<ff_comp> >(comp_workers_num);
+            for (int i=0; i<comp_workers_num; ++i) {
+                ((Pinned<ff_comp>*) replicas[i].get())->pin(placement.slots[i]);
+                comps.push_back(replicas[i].get());
+            }
+            ws_farm.reset(new ff_comp_wsfarm(comps, true));
+            middle = ws_farm.get();
+            break;
         default:
-            cerr << "Error: skeleton type must one of these values: 0 (comp), 1 (sequential) or 2(pipeline)" << endl;
-            cout << "Usage: ./ffvideofarm input skeleton [-v]" << endl;
+            cerr << "Error: skeleton type must one of these values: 0 (comp), 1 (sequential), 2 (pipeline), 3 (autoscaled comps), 4 (fused), 5 (shared comp) or 6 (work stealing comps)" << endl;
+            cout << "Usage: ./ffvideofarm input skeleton [-v] [-H] [-p numa|cpulist] [-a min-max] [-d decoders] [-s segment frames] [-o output] [-c] [-i period]" << endl;
             return EXIT_FAILURE;
     }
 
-    main_pipe.add_stage(&farm);
+    main_pipe.add_stage(middle);
     main_pipe.add_stage(&drain);
 
     cout << "Applying both enhance and emboss filters (it may take a while...)" << endl;
@@ -188,11 +341,18 @@ int main(int argc, char *argv[]) {
     cout << "Completion time: " << elapsed_time << " (ms)" << endl;
     cout << "Average time per frame: " << elapsed_time / frames << " (ms)" << endl; 
     cout << "(with " << frames << " frames)" << endl;
+    cout << "Frame ring: " << ring.size() << " frames, " << ring.buffer_allocations() << " buffer allocations" << (huge_pages_flag ? " (huge pages)" : "") << endl;
+    if (sink) sink->print_stats(cout);
+    cout << "Frame latency: " << drain.get_latency(0.5) << " (ms) median, " << drain.get_latency(0.99) << " (ms) 99th percentile, "
+         << drain.get_latency(1) << " (ms) max" << (burst_period ? ", a frame out of " + to_string(burst_period) + " costs more" : "") << endl;
+    if (decoders > 1) cout << "Decoders: " << decoders << " (" << segment_frames << " frames per segment), " << drain.get_out_of_order() << " frames out of order" << endl;
 
     double sum=0, avg=0;
 
     switch (skeleton_type) {
         case 0:
+        case 3:
+        case 6:
             for (int i=0; i<comps.size(); ++i) sum += ((ff_comp*)comps[i])->ff_time();
             break;
         case 1:
@@ -201,16 +361,87 @@ int main(int argc, char *argv[]) {
         case 2:
             for (int i=0; i<pipes.size(); ++i) sum += ((ff_pipeline*)pipes[i])->ffTime();
             break;
+        case 4:
+            for (ff_node* f : fuseds) sum += ((FusedStage*)f)->ff_time();
+            break;
+        case 5:
+            sum = shared_comp.ff_time(); // all the worker threads
+            break;
         default:
             cerr << "Error: this point should be inaccesible!" << endl;
             return EXIT_FAILURE;
     }
 
     avg = sum / seq_workers_num;
-    cout << "Average branch completion time: " << avg << " (ms)\nDone!" << endl;
+    cout << "Average branch completion time: " << avg << " (ms)" << endl;
+
+    if (validate_flag && skeleton_type == 4) {
+        size_t checked = 0, over = 0;
+        int max_diff = 0;
+        for (ff_node* f : fuseds) {
+            checked += ((FusedStage*)f)->get_checked();
+            over += ((FusedStage*)f)->get_over_tolerance();
+            max_diff = max(max_diff, ((FusedStage*)f)->get_max_diff());
+        }
+        cout << "Validation: " << checked << " frames, max difference " << max_diff << ", " << over << " values beyond the tolerance -> " << (over ? "FAILED" : "PASSED") << endl;
+    }
+
+    if (skeleton_type == 5) {
+        const vector<comp_thread_stats> stats = shared_comp.get_thread_stats();
+        unsigned long long fewest = stats.empty() ? 0 : stats[0].tasks, most = 0;
+        for (const comp_thread_stats& st : stats) {
+            fewest = min(fewest, st.tasks);
+            most = max(most, st.tasks);
+        }
+        cout << "Shared comp: " << stats.size() << " worker threads, " << fewest << " to " << most << " frames per thread" << endl;
+    }
+
+    if (ws_farm) {
+        size_t fewest = ws_farm->get_worker_tasks(0), most = 0;
+        for (int i=0; i<comp_workers_num; ++i) {
+            fewest = min(fewest, ws_farm->get_worker_tasks(i));
+            most = max(most, ws_farm->get_worker_tasks(i));
+        }
+        cout << "Work stealing: " << ws_farm->get_steals() << " frames stolen, " << fewest << " to " << most << " frames per worker" << endl;
+    }
+
+    if (comp_farm) {
+        cout << "Active workers at the end: " << comp_farm->get_active_workers() << endl;
+        for (const ff_comp_farm::scale_event& e : comp_farm->get_scale_events())
+            cout << "  " << e.time_ms << " (ms): " << e.workers << " workers (waiting frames " << e.occupancy << ", utilization " << e.utilization << ")" << endl;
+    }
+
+    if (!placement_spec.empty()) {
+        // frames computed by the workers of every node (a frame of a pipeline is counted on the node of its first stage)
+        vector<size_t> node_frames(topology.size(), 0);
+        switch (skeleton_type) {
+            case 0:
+            case 3:
+            case 6:
+                for (ff_node* c : comps) node_frames[topology.node_of(((Pinned<ff_comp>*)c)->get_cpu())] += ((Pinned<ff_comp>*)c)->get_calls();
+                break;
+            case 1:
+                for (ff_node* n : seqs) node_frames[topology.node_of(((Pinned<SeqNode>*)n)->get_cpu())] += ((Pinned<SeqNode>*)n)->get_calls();
+                break;
+            case 5:
+                for (ff_node* w : shared_workers) node_frames[topology.node_of(((Pinned<ff_comp_worker>*)w)->get_cpu())] += ((Pinned<ff_comp_worker>*)w)->get_calls();
+                break;
+            case 4:
+                for (ff_node* f : fuseds) node_frames[topology.node_of(((Pinned<FusedStage>*)f)->get_cpu())] += ((Pinned<FusedStage>*)f)->get_calls();
+                break;
+            case 2:
+                for (Stage1* s1 : s1s) node_frames[topology.node_of(((Pinned<Stage1>*)s1)->get_cpu())] += ((Pinned<Stage1>*)s1)->get_calls();
+                break;
+        }
+        cout << "Placement: " << placement_spec << " (" << topology.size() << " NUMA nodes" << (interleave ? ", interleaved frame ring" : "") << ")" << endl;
+        for (size_t n=0; n<topology.size(); ++n)
+            cout << "Node " << topology.ids[n] << ": " << node_frames[n] << " frames, " << node_frames[n] / (elapsed_time / 1000) << " frames/s" << endl;
+    }
+    cout << "Done!" << endl;
 
     // cleaning
 
+    delete comp_farm;
     while (!s1s.empty()) {
         delete s1s.back();
         s1s.pop_back();
@@ -227,9 +458,13 @@ int main(int argc, char *argv[]) {
         delete seqs.back();
         seqs.pop_back();
     }
-    while (!comps.empty()) {
-        delete comps.back();
-        comps.pop_back();
+    while (!fuseds.empty()) {
+        delete fuseds.back();
+        fuseds.pop_back();
+    }
+    while (!shared_workers.empty()) {
+        delete shared_workers.back();
+        shared_workers.pop_back();
     }
 
     return EXIT_SUCCESS;
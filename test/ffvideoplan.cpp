@@ -0,0 +1,155 @@
+/*
+ * Author: Daniele Paolini <daniele.paolini@hotmail.it>
+ *
+ * Skeleton planner for the video filters of ffcompvideo and ffvideofarm, run this program with:
+ *   ffvideoplan input [-n cores] [-f frames] [-w bandwidth GB/s] [-a]
+ * It decodes the first -f frames (default 50) of the input and runs Source, Stage1, Stage2 and Drain in isolation on
+ * them, one stage after the other on a copy of every frame, measuring the mean service time of a frame and the bytes
+ * of the frame every stage hands to the next one. Then it applies the cost model of planner.hpp for a budget of -n
+ * cores (default: the cores of this machine) and prints the best grouping of the stages into comps, pipeline stages and
+ * farm workers with its predicted throughput, and the command that runs it when one of the two programs implements it.
+ * With -a every grouping is printed, ranked by predicted throughput.
+ * The model is only as good as its parameters: -w is the bandwidth of a frame moved between two cores (default 10 GB/s),
+ * confirm the plan with videobenchmark.sh before deploying it.
+ *
+*/
+
+#include "ffvideo.hpp" // definition of ff stages are in this header, please have a look
+#include "planner.hpp"
+#include <iomanip>
+
+using namespace ff;
+using namespace cv;
+using namespace std;
+
+void print_usage(ostream& out) {
+    out << "Usage: ./ffvideoplan input [-n cores] [-f frames] [-w bandwidth GB/s] [-a]" << endl;
+}
+
+// the command running p, empty if neither ffcompvideo nor ffvideofarm implements it
+string command(const plan::plan& p, const vector<plan::stage_profile>& stages, const string& input) {
+    const string s = p.skeleton(stages);
+    if (s == "Pipe(Source, Comp(Stage1, Stage2), Drain)") return "test/bin/ffcompvideo " + input + " 0";
+    if (s == "Pipe(Source, Stage1, Stage2, Drain)") return "test/bin/ffcompvideo " + input + " 2";
+    if (p.groups.size() == 3 && p.groups[1].first == 1 && p.groups[1].last == 3 && p.groups[1].width > 1) {
+        const string w = to_string(p.groups[1].width);
+        return "test/bin/ffvideofarm " + input + " 3 -a " + w + "-" + w;
+    }
+    return "";
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t cores = thread::hardware_concurrency(), sample_frames = 50;
+    double bandwidth = 10;
+    bool all_flag = false;
+
+    int param;
+    while ((param = getopt(argc, argv, "hn:f:w:a")) != -1) {
+        switch (param) {
+            case 'h':
+                print_usage(cout);
+                return EXIT_SUCCESS;
+            case 'a':
+                all_flag = true;
+                break;
+            case 'n':
+            case 'f':
+                if (atoi(optarg) < 1) {
+                    cerr << "Error: option -" << (char) param << " requires a positive integer" << endl;
+                    return EXIT_FAILURE;
+                }
+                (param == 'n' ? cores : sample_frames) = atoi(optarg);
+                break;
+            case 'w':
+                bandwidth = atof(optarg);
+                if (bandwidth <= 0) {
+                    cerr << "Error: option -w requires a positive bandwidth" << endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                print_usage(cerr);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        cerr << "Error: you must provide a video input" << endl;
+        print_usage(cerr);
+        return EXIT_FAILURE;
+    }
+    const string in_video_path = argv[optind];
+    if (!cores) cores = 1;
+
+    // Source: serial decoding of the sample
+    VideoCapture cap(in_video_path.c_str());
+    if (!cap.isOpened()) {
+        cerr << "Error: opening input file" << endl;
+        return EXIT_FAILURE;
+    }
+    vector<Frame> sample(sample_frames);
+    size_t n = 0;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    while (n < sample_frames && cap.read(sample[n])) {
+        sample[n].seq = n;
+        n++;
+    }
+    const double decode_us = chrono::duration<double, micro>(chrono::steady_clock::now()-t0).count();
+    if (n == 0) {
+        cerr << "Error: the input has no frames" << endl;
+        return EXIT_FAILURE;
+    }
+    sample.resize(n);
+    const double frame_bytes = (double) sample[0].total() * sample[0].elemSize();
+
+    // Stage1, Stage2 and Drain in isolation, every stage on the frames computed by the previous one
+    Stage1 stage1;
+    Stage2 stage2;
+    Drain drain(false);
+    vector<Frame*> frames;
+    for (Frame& f : sample) {
+        frames.push_back(new Frame());
+        f.copyTo(*frames.back());
+        frames.back()->seq = f.seq;
+    }
+    stage1.svc(frames[0]); // warm up (scratch buffers)
+    sample[0].copyTo(*frames[0]);
+    double us[3] = { 0, 0, 0 };
+    t0 = chrono::steady_clock::now();
+    for (Frame *f : frames) stage1.svc(f);
+    us[0] = chrono::duration<double, micro>(chrono::steady_clock::now()-t0).count() / n;
+    t0 = chrono::steady_clock::now();
+    for (Frame *f : frames) stage2.svc(f);
+    us[1] = chrono::duration<double, micro>(chrono::steady_clock::now()-t0).count() / n;
+    t0 = chrono::steady_clock::now();
+    for (Frame *f : frames) drain.svc(f); // gives back (deletes) the frames
+    us[2] = chrono::duration<double, micro>(chrono::steady_clock::now()-t0).count() / n;
+
+    vector<plan::stage_profile> stages;
+    stages.push_back({ "Source", decode_us / n, frame_bytes, false });
+    stages.push_back({ "Stage1", us[0], frame_bytes, true });
+    stages.push_back({ "Stage2", us[1], frame_bytes, true });
+    stages.push_back({ "Drain", us[2], 0, false });
+
+    cout << "Profile of " << n << " frames " << sample[0].cols << "x" << sample[0].rows << " (" << frame_bytes / 1e6 << " MB per frame):" << endl;
+    for (const plan::stage_profile& s : stages)
+        cout << "  " << setw(8) << left << s.name << right << setw(12) << fixed << setprecision(1) << s.service_us << " us per frame"
+             << (s.replicable ? "" : " (serial)") << endl;
+
+    plan::machine m(cores);
+    m.bandwidth_gbs = bandwidth;
+    const plan::plan best = plan::best(stages, m);
+    cout << "Best plan for " << cores << " cores: " << best.skeleton(stages) << endl;
+    cout << "  " << best.threads << " threads, bottleneck " << best.period_us << " us per frame, predicted throughput "
+         << best.throughput() << " frames/s (sequential: " << plan::best(stages, plan::machine(1)).throughput() << " frames/s)" << endl;
+    const string cmd = command(best, stages, in_video_path);
+    if (!cmd.empty()) cout << "  run it with: " << cmd << endl;
+    else cout << "  not implemented by ffcompvideo/ffvideofarm, build it with ff_comp, ff_pipeline and ff_comp_farm" << endl;
+
+    if (all_flag) {
+        cout << "All plans:" << endl;
+        for (const plan::plan& p : plan::rank(stages, m))
+            cout << "  " << setw(12) << p.throughput() << " frames/s " << setw(3) << p.threads << " threads  " << p.skeleton(stages) << endl;
+    }
+    return EXIT_SUCCESS;
+}
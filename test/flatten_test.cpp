@@ -0,0 +1,124 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Flatten test:
+ *  Composing nested comps, single stage wrappers and ordered farms
+ *  Comp(Comp(Incr, Comp(Doub)), Pipe(Comp(Incr)), OFarm(Comp(Doub, Count)), Farm(Incr)) where OFarm is an ff_ofarm of 3 workers
+ *  and Farm an ff_Farm of a single worker
+ *  Expected ((2(x+1)+1)*2)+1 for every x, a flat array of 6 stages none of them a comp, pipeline or farm, then a batch with
+ *  the farm parallelism enabled, where every worker of the ordered farm (recorded through the nested comp it was inlined
+ *  from) computes a slice of the batch, and the inlined comps refusing to run on their own
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "../comp.hpp"
+#include <ff/farm.hpp>
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+// counts the tasks computed by a single worker, it is not thread safe on purpose
+struct Count : ff_node {
+    size_t count = 0;
+    void* svc(void *t){
+        ++count;
+        return t;
+    }
+};
+
+int main() {
+    Incr incr1, incr2;
+    Doub doub1;
+    ff_comp inner, single, outer_left;
+    single.add_stage(&doub1);
+    outer_left.add_stage(&incr1);
+    outer_left.add_stage(&single);
+
+    ff_comp wrapped;
+    wrapped.add_stage(&incr2);
+    ff_pipeline pipe;
+    pipe.add_stage(&wrapped);
+
+    vector<unique_ptr<Doub> > doubs;
+    vector<unique_ptr<Count> > counters;
+    vector<unique_ptr<ff_comp> > workers;
+    vector<ff_node*> nodes;
+    for (size_t w=0; w<3; ++w) {
+        doubs.push_back(unique_ptr<Doub>(new Doub()));
+        counters.push_back(unique_ptr<Count>(new Count()));
+        workers.push_back(unique_ptr<ff_comp>(new ff_comp()));
+        workers.back()->add_stage(doubs.back().get());
+        workers.back()->add_stage(counters.back().get());
+        nodes.push_back(workers.back().get());
+    }
+    ff_ofarm ofarm;
+    ofarm.add_workers(nodes);
+    inner.add_stage(&ofarm); // recorded into inner, then inlined with it
+
+    vector<unique_ptr<ff_node> > last;
+    last.push_back(unique_ptr<ff_node>(new Incr()));
+    ff_Farm<int> farm(move(last));
+
+    ff_comp comp;
+    comp.add_stage(&outer_left);
+    comp.add_stage(&pipe);
+    comp.add_stage(&inner);
+    comp.add_stage(&farm);
+
+    cout << "Executing flattening test..." << endl;
+    const svector<ff_node *>& stages = comp.get_stages();
+    assert(stages.size() == 6);
+    for (ff_node *n : stages) {
+        assert(!dynamic_cast<ff_comp*>(n) && !dynamic_cast<ff_pipeline*>(n));
+        assert(!dynamic_cast<ff_farm<>*>(n) && !dynamic_cast<ff_ofarm*>(n));
+    }
+    assert(stages[0] == &incr1 && stages[1] == &doub1 && stages[2] == &incr2);
+    assert(stages[3] == doubs[0].get() && stages[4] == counters[0].get());
+    int x = 5;
+    assert(comp.run(&x) == &x && x == ((2*(5+1)+1)*2)+1);
+    x = 5;
+    assert(inner.run(&x) == nullptr && x == 5); // its stages forward their tasks to comp now
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing flattened farm batch test..." << endl;
+    const size_t batch_size = 999;
+    comp.set_farm_parallel(true);
+    comp.set_batch_grain(16);
+    vector<int> values(batch_size);
+    vector<void*> tasks(batch_size);
+    for (size_t i=0; i<batch_size; ++i) {
+        values[i] = (int) i;
+        tasks[i] = &values[i];
+    }
+    const size_t first_count = counters[0]->count;
+    assert(comp.run_batch(tasks.data(), batch_size) == 0);
+    for (size_t i=0; i<batch_size; ++i) assert(values[i] == ((2*((int) i+1)+1)*2)+1);
+    size_t total = 0;
+    for (unique_ptr<Count>& c : counters) {
+        assert(c->count > 0);
+        total += c->count;
+    }
+    assert(total == batch_size + first_count);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Memo test:
+ *  Comp(Memo(Comp(Square, Incr)), Doub) over a stream of n values repeating k distinct keys, cache large enough for all
+ *  the keys
+ *  Expected 2(x^2+1) for every x, the memoized prefix computed exactly once per key, then a stream with a few hot keys
+ *  through a cache of k/4 entries (evictions, the hot keys still hit, same results) and the first stream through an ordered farm of 4 Memo replicas sharing one cache
+ *  (hits + misses = n)
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "../compfarm.hpp"
+#include "../memo.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Square : ff_node {
+    atomic<int> calls;
+    Square() : calls(0) { }
+    void* svc(void *t){
+        calls++;
+        *((int*)t)*=*((int*)t);
+        return t;
+    }
+};
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+typedef ff_memo_cache<int, int> cache_t;
+typedef ff_memo_node<int, int> memo_t;
+
+memo_t *make_memo(ff_node *stage, cache_t& cache) {
+    return new memo_t(stage, cache,
+                      [](void *t) { return *((int*)t); },
+                      [](void *t) { return *((int*)t); },
+                      [](void *t, const int& v) { *((int*)t) = v; return t; });
+}
+
+vector<int> stream(size_t n, int k) {
+    vector<int> in;
+    for (size_t i=0; i<n; ++i) in.push_back((int) (i*7919 % k));
+    return in;
+}
+
+struct Source : ff_node {
+    vector<int> in;
+    size_t i;
+    Source(const vector<int>& in) : in(in), i(0) { }
+    void *svc(void *) {
+        if (i == in.size()) return EOS;
+        return new int(in[i++]);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+int main() {
+    const size_t n = 10000;
+    const int k = 100;
+    const vector<int> in = stream(n, k);
+    vector<int> expected;
+    for (int x : in) expected.push_back(2*(x*x+1));
+
+    cout << "Executing memoized prefix test..." << endl;
+    Square square;
+    Incr incr;
+    Doub doub;
+    ff_comp prefix, comp;
+    prefix.add_stage(&square);
+    prefix.add_stage(&incr);
+    cache_t cache(2*k);
+    memo_t *memo = make_memo(&prefix, cache);
+    comp.add_stage(memo);
+    comp.add_stage(&doub);
+    for (size_t i=0; i<n; ++i) {
+        int x = in[i];
+        assert(comp.run(&x) == &x && x == expected[i]);
+    }
+    assert(square.calls == k);
+    assert(cache.get_misses() == (size_t) k && cache.get_hits() == n-k && cache.get_evictions() == 0);
+    assert(memo->get_hits() == n-k && cache.size() == (size_t) k);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing eviction test..." << endl;
+    Square square2;
+    Incr incr2;
+    Doub doub2;
+    cache_t small(k/4, 4);
+    memo_t *memo2 = make_memo(&square2, small);
+    ff_comp evicting;
+    evicting.add_stage(memo2);
+    evicting.add_stage(&incr2);
+    evicting.add_stage(&doub2);
+    for (size_t i=0; i<n; ++i) {
+        int x = i % 2 ? in[i] % 10 : in[i]; // half of the tasks from 10 hot keys
+        const int y = 2*(x*x+1);
+        evicting.run(&x);
+        assert(x == y);
+    }
+    assert(square2.calls > k && small.get_evictions() > 0 && small.size() <= (size_t) k/4);
+    assert(small.get_hits() >= n/4); // the hot keys stay into the cache
+    assert(small.get_hits() + small.get_misses() == n);
+    cout << "-> PASSED (" << small.get_hits() << " hits, " << small.get_misses() << " misses)" << endl;
+
+    cout << "Executing shared cache farm test..." << endl;
+    cache_t shared(2*k);
+    vector<Square> squares(4);
+    vector<Incr> incrs(4);
+    vector<Doub> doubs(4);
+    vector<ff_comp> replicas(4);
+    vector<memo_t*> memos;
+    vector<ff_node*> nodes;
+    for (size_t i=0; i<4; ++i) {
+        memos.push_back(make_memo(&squares[i], shared));
+        replicas[i].add_stage(memos[i]);
+        replicas[i].add_stage(&incrs[i]);
+        replicas[i].add_stage(&doubs[i]);
+        nodes.push_back(&replicas[i]);
+    }
+    ff_comp_farm farm(nodes, true);
+    Source source(in);
+    Drain drain;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&farm);
+    pipe.add_stage(&drain);
+    assert(pipe.run_and_wait_end() == 0);
+    assert(drain.data == expected);
+    assert(shared.get_hits() + shared.get_misses() == n && shared.get_hits() >= n-4*k);
+    cout << "-> PASSED (" << shared.get_hits() << " hits)" << endl;
+
+    delete memo;
+    delete memo2;
+    for (memo_t *m : memos) delete m;
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  NUMA placement helpers used by ffvideofarm: the topology of the machine is read from sysfs, a placement assigns a cpu to
+ *  the source, to every worker slot and to the drain, and Pinned<Node> maps the thread of a node to its cpu in svc_init
+ *  (before the node allocates anything, so the buffers that a worker allocates lazily are first-touched on its own node)
+ *  and counts the tasks that the node computes.
+ *  Without libnuma: the frame buffers shared between the nodes are interleaved with a raw mbind system call.
+ *
+*/
+
+#ifndef FFVIDEO_NUMA_HPP
+#define FFVIDEO_NUMA_HPP
+
+#include <ff/mapping_utils.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// cpus of every NUMA node of the machine (a single node with all the online cpus if sysfs has no node information)
+struct numa_topology {
+
+    std::vector<int> ids;                // node ids, they may be not contiguous
+    std::vector<std::vector<int> > cpus; // cpus[i] are the cpus of the node ids[i]
+
+    numa_topology() {
+        for (int id=0; id<1024; ++id) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            if (!in || !std::getline(in, list)) {
+                if (id > 64 && !ids.empty()) break; // node ids are small, don't probe the whole range
+                continue;
+            }
+            std::vector<int> c = parse_cpulist(list);
+            if (c.empty()) continue; // memory only node
+            ids.push_back(id);
+            cpus.push_back(c);
+        }
+        if (ids.empty()) {
+            ids.push_back(0);
+            cpus.push_back(std::vector<int>());
+            for (long c=0; c<sysconf(_SC_NPROCESSORS_ONLN); ++c) cpus[0].push_back((int) c);
+        }
+    }
+
+    size_t size() const { return ids.size(); }
+
+    // index (not id) of the node of cpu, 0 if it's unknown
+    size_t node_of(int cpu) const {
+        for (size_t n=0; n<cpus.size(); ++n)
+            for (int c : cpus[n]) if (c == cpu) return n;
+        return 0;
+    }
+
+    // cpu list in the sysfs/taskset format ("0-5,12,14-17")
+    static std::vector<int> parse_cpulist(const std::string& list) {
+        std::vector<int> out;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            if (range.empty()) continue;
+            const size_t dash = range.find('-');
+            try {
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash+1));
+                for (int c=first; c<=last; ++c) out.push_back(c);
+            } catch (std::exception&) {
+                return std::vector<int>();
+            }
+        }
+        return out;
+    }
+
+};
+
+// cpus chosen for the nodes of the farm, -1 means not pinned
+struct numa_placement {
+
+    int source, drain;
+    std::vector<int> slots; // one cpu per worker thread
+
+    numa_placement(size_t n_slots=0) : source(-1), drain(-1), slots(n_slots, -1) { }
+
+    // "numa": source and drain on the first two cpus of the first node, the worker slots spread round robin over the nodes
+    // "cpu list": the cpus of the list are given in order to source, worker slots and drain (the slots reuse the middle of
+    // the list if it's shorter than them), at least 3 cpus
+    static bool parse(const std::string& spec, const numa_topology& topo, size_t n_slots, numa_placement& p) {
+        p = numa_placement(n_slots);
+        if (spec == "numa") {
+            const std::vector<int>& first = topo.cpus[0];
+            p.source = first[0];
+            p.drain = first[1 % first.size()];
+            for (size_t s=0; s<n_slots; ++s) {
+                const size_t n = s % topo.size();
+                const std::vector<int>& node = topo.cpus[n];
+                const size_t skip = (n == 0 && node.size() > 2) ? 2 : 0; // cpus of source and drain
+                p.slots[s] = node[skip + (s / topo.size()) % (node.size()-skip)];
+            }
+            return true;
+        }
+        std::vector<int> list = numa_topology::parse_cpulist(spec);
+        if (list.size() < 3) return false;
+        p.source = list.front();
+        p.drain = list.back();
+        for (size_t s=0; s<n_slots; ++s) p.slots[s] = list[1 + s % (list.size()-2)];
+        return true;
+    }
+
+};
+
+// mask of the given nodes for mbind (node ids up to 63)
+static inline unsigned long numa_node_mask(const numa_topology& topo) {
+    unsigned long mask = 0;
+    for (int id : topo.ids) if (id < 64) mask |= 1UL << id;
+    return mask;
+}
+
+// interleaves the pages of [addr, addr+len) over the nodes of mask, it must be called before the memory is touched
+static inline bool numa_interleave(void *addr, size_t len, unsigned long mask) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const int mpol_interleave = 3;
+    return syscall(SYS_mbind, addr, len, mpol_interleave, &mask, 8*sizeof(mask)+1, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+// task type of the svc of a node: IN_t for a ff_node_t, void for a plain ff_node
+template<typename T> struct numa_void { typedef void type; };
+template<typename N, typename = void> struct pinned_task { typedef void type; };
+template<typename N> struct pinned_task<N, typename numa_void<typename N::in_type>::type> { typedef typename N::in_type type; };
+
+// a node whose thread is mapped to a cpu before its own svc_init, it counts the tasks it computes
+template<typename Node>
+class Pinned : public Node {
+
+    typedef typename pinned_task<Node>::type task_t;
+    int cpu;
+    size_t calls;
+
+public:
+    template<typename... Args>
+    Pinned(Args&&... args) : Node(std::forward<Args>(args)...), cpu(-1), calls(0) { }
+
+    void pin(int to) { cpu = to; }
+    int get_cpu() const { return cpu; }
+    size_t get_calls() const { return calls; }
+
+    int svc_init() {
+        if (cpu >= 0 && ff::ff_mapThreadToCpu(cpu) != 0) std::cerr << "Warning: can't map a thread to cpu " << cpu << std::endl;
+        return Node::svc_init();
+    }
+
+    task_t *svc(task_t *t) {
+        calls++;
+        return Node::svc(t);
+    }
+
+};
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Skeleton planner used by ffvideoplan. Given the profile of the stages of a linear graph (service time of a task and
+ *  bytes of the task a stage hands to the next one, measured running every stage in isolation) and a machine, it groups
+ *  consecutive stages into comps, makes every group a stage of the pipeline and gives farm workers to the replicable
+ *  groups, choosing the plan with the highest predicted throughput that fits the core budget.
+ *  Cost model (all the times in us per task):
+ *    comp fusion    a group computes its stages one after the other on a single thread, only the first stage of a
+ *                   pipeline stage pays the handoff of its task from the previous one (queue + bytes / bandwidth)
+ *    farm           w workers of a group of time t deliver a task every t * (1 + contention * (w-1)) / w, never faster
+ *                   than the emitter/collector can dispatch one (farm_us), and they take farm_threads more threads
+ *    pipeline       the throughput is the one of its slowest stage (bottleneck)
+ *
+*/
+
+#ifndef PLANNER_HPP
+#define PLANNER_HPP
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace plan {
+
+    struct stage_profile {
+        std::string name;
+        double service_us;  // mean time of a task computed alone
+        double bytes;       // size of the task it hands to the next stage
+        bool replicable;    // it can be a farm worker (no state shared between tasks)
+    };
+
+    struct machine {
+        size_t cores;
+        double handoff_us;      // queue push/pop and wake up of a task between two threads
+        double bandwidth_gbs;   // bytes of a task moved between the caches of two cores
+        double farm_us;         // dispatch of a task by the emitter/collector of a farm
+        double contention;      // throughput lost by every worker added to a farm (shared caches, memory bandwidth)
+        size_t farm_threads;    // threads of a farm besides its workers
+        machine(size_t cores) : cores(cores), handoff_us(2), bandwidth_gbs(10), farm_us(1), contention(0.03), farm_threads(1) { }
+    };
+
+    struct group {
+        size_t first, last;     // stages [first, last)
+        size_t width;           // farm workers, 1 = no farm
+        double time_us;         // time of a task on a single worker
+        double period_us;       // time between two tasks out of the group
+    };
+
+    struct plan {
+        std::vector<group> groups;
+        double period_us;       // bottleneck
+        size_t threads;
+
+        plan() : period_us(0), threads(0) { }
+        double throughput() const { return period_us > 0 ? 1e6 / period_us : 0; } // tasks per second
+
+        // e.g. Pipe(Source, Farm(4 x Comp(Stage1, Stage2)), Drain)
+        std::string skeleton(const std::vector<stage_profile>& stages) const {
+            std::ostringstream out;
+            if (groups.size() > 1) out << "Pipe(";
+            for (size_t g=0; g<groups.size(); ++g) {
+                const group& gr = groups[g];
+                if (g) out << ", ";
+                if (gr.width > 1) out << "Farm(" << gr.width << " x ";
+                if (gr.last - gr.first > 1) out << "Comp(";
+                for (size_t i=gr.first; i<gr.last; ++i) out << (i > gr.first ? ", " : "") << stages[i].name;
+                if (gr.last - gr.first > 1) out << ")";
+                if (gr.width > 1) out << ")";
+            }
+            if (groups.size() > 1) out << ")";
+            return out.str();
+        }
+    };
+
+    // time of a task through the stages [first, last) fused, handed over from the previous pipeline stage if first > 0
+    inline double group_time(const std::vector<stage_profile>& stages, size_t first, size_t last, const machine& m) {
+        double t = 0;
+        for (size_t i=first; i<last; ++i) t += stages[i].service_us;
+        if (first > 0) t += m.handoff_us + stages[first-1].bytes / (m.bandwidth_gbs * 1e3);
+        return t;
+    }
+
+    inline double farm_period(double time_us, size_t width, const machine& m) {
+        if (width <= 1) return time_us;
+        return std::max(m.farm_us, time_us * (1 + m.contention * (width-1)) / width);
+    }
+
+    inline bool replicable(const std::vector<stage_profile>& stages, size_t first, size_t last) {
+        for (size_t i=first; i<last; ++i) if (!stages[i].replicable) return false;
+        return true;
+    }
+
+    // widths of the groups of p: a worker at a time to the bottleneck, while it lowers the period and fits the budget
+    inline void assign_workers(const std::vector<stage_profile>& stages, plan& p, const machine& m) {
+        p.threads = p.groups.size();
+        for (;;) {
+            size_t slowest = 0;
+            for (size_t g=0; g<p.groups.size(); ++g) if (p.groups[g].period_us > p.groups[slowest].period_us) slowest = g;
+            group& gr = p.groups[slowest];
+            p.period_us = gr.period_us;
+            if (!replicable(stages, gr.first, gr.last)) return;
+            const size_t extra = gr.width == 1 ? 1 + m.farm_threads : 1;
+            const double period = farm_period(gr.time_us, gr.width+1, m);
+            if (p.threads + extra > m.cores || period >= gr.period_us) return;
+            gr.width++;
+            gr.period_us = period;
+            p.threads += extra;
+        }
+    }
+
+    // every grouping of the stages into consecutive groups (2^(n-1)) fitting the cores, sorted by throughput
+    inline std::vector<plan> rank(const std::vector<stage_profile>& stages, const machine& m) {
+        std::vector<plan> plans;
+        const size_t n = stages.size();
+        if (n == 0 || n > 20) return plans;
+        for (unsigned long cuts=0; cuts < (1ul << (n-1)); ++cuts) {
+            plan p;
+            size_t first = 0;
+            for (size_t i=1; i<=n; ++i)
+                if (i == n || (cuts >> (i-1) & 1)) {
+                    group g = { first, i, 1, group_time(stages, first, i, m), 0 };
+                    g.period_us = g.time_us;
+                    p.groups.push_back(g);
+                    first = i;
+                }
+            if (p.groups.size() > m.cores) continue;
+            assign_workers(stages, p, m);
+            plans.push_back(p);
+        }
+        std::stable_sort(plans.begin(), plans.end(), [](const plan& a, const plan& b) {
+            return a.period_us < b.period_us || (a.period_us == b.period_us && a.threads < b.threads);
+        });
+        return plans;
+    }
+
+    // the plan with fewer threads among the ones within 2% of the highest throughput
+    inline plan best(const std::vector<stage_profile>& stages, const machine& m) {
+        const std::vector<plan> plans = rank(stages, m);
+        if (plans.empty()) return plan();
+        size_t b = 0;
+        for (size_t i=1; i<plans.size() && plans[i].period_us <= 1.02 * plans[0].period_us; ++i)
+            if (plans[i].threads < plans[b].threads) b = i;
+        return plans[b];
+    }
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Planner test:
+ *  Planning Source, Stage1, Stage2, Drain (Source and Drain serial and cheap) with the cost model of planner.hpp
+ *  Expected a single comp of all the stages on a single core, the coarse filters fused into a farm between Source and Drain
+ *  when there are cores for it, fine stages fused whatever the budget (the handoff costs more than the stages) and a
+ *  pipeline of serial stages when none of them can be replicated
+ *
+ */
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "planner.hpp"
+
+using namespace std;
+
+bool near(double a, double b, double eps) { return fabs(a-b) <= eps; }
+
+vector<plan::stage_profile> video(double filter_us, double bytes) {
+    vector<plan::stage_profile> stages;
+    stages.push_back({ "Source", 10, bytes, false });
+    stages.push_back({ "Stage1", filter_us, bytes, true });
+    stages.push_back({ "Stage2", filter_us / 4, bytes, true });
+    stages.push_back({ "Drain", 1, 0, false });
+    return stages;
+}
+
+int main() {
+    cout << "Executing cost model test..." << endl;
+    plan::machine m(16);
+    assert(near(plan::farm_period(100, 1, m), 100, 1e-9));
+    assert(near(plan::farm_period(100, 4, m), 100 * 1.09 / 4, 1e-9));
+    assert(near(plan::farm_period(2, 16, m), m.farm_us, 1e-9));
+    const vector<plan::stage_profile> coarse = video(4000, 6e6);
+    assert(near(plan::group_time(coarse, 1, 3, m), 5000 + m.handoff_us + 6e6 / 1e4, 1e-9));
+    assert(near(plan::group_time(coarse, 0, 2, m), 4010, 1e-9));
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing single core plan test..." << endl;
+    plan::plan p = plan::best(coarse, plan::machine(1));
+    assert(p.groups.size() == 1 && p.threads == 1);
+    assert(p.skeleton(coarse) == "Comp(Source, Stage1, Stage2, Drain)");
+    assert(near(p.period_us, 5011, 1e-9));
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing coarse stages plan test..." << endl;
+    p = plan::best(coarse, m);
+    assert(p.groups.size() == 3 && p.groups[1].first == 1 && p.groups[1].last == 3);
+    assert(p.groups[1].width == 16 - 2 - m.farm_threads && p.threads == 16);
+    assert(p.skeleton(coarse) == "Pipe(Source, Farm(13 x Comp(Stage1, Stage2)), Drain)");
+    assert(p.throughput() > 8 * plan::best(coarse, plan::machine(1)).throughput());
+    const vector<plan::plan> ranked = plan::rank(coarse, m);
+    assert(ranked.size() == 8);
+    for (size_t i=1; i<ranked.size(); ++i) assert(ranked[i-1].period_us <= ranked[i].period_us);
+    cout << "-> PASSED (" << p.skeleton(coarse) << ", " << p.throughput() << " tasks/s)" << endl;
+
+    cout << "Executing fine stages plan test..." << endl;
+    const vector<plan::stage_profile> fine = video(2, 1e6);
+    p = plan::best(fine, m);
+    assert(p.groups.size() == 1 && p.threads == 1);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing serial stages plan test..." << endl;
+    vector<plan::stage_profile> serial = video(400, 1e3);
+    for (plan::stage_profile& s : serial) s.replicable = false;
+    p = plan::best(serial, m);
+    assert(p.skeleton(serial) == "Pipe(Comp(Source, Stage1), Comp(Stage2, Drain))"); // within 2% of the best, one thread less
+    assert(p.threads == 2);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Reentrant comp test:
+ *  a single Comp(Incr, Doub) of stateless stages run by 4 threads at once with run and run_batch, then shared by the
+ *  4 workers of Pipe(Source, CompFarm(4 x Worker(Comp)), Drain) over the stream [1, ..., n]
+ *  Expected Doub(Incr(x)) = 2x+2 for every x, a statistics slot for every thread that ran the comp whose tasks add up to
+ *  the tasks computed, ff_time as the sum of the times of the threads and svc_init/svc_end called once on the shared stages
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../compfarm.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    int inits = 0, ends = 0;
+    int svc_init() { ++inits; return 0; }
+    void svc_end() { ++ends; }
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+struct Source : ff_node {
+    int counter;
+    const int n;
+    Source(int n) : n(n) { }
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+unsigned long long total_tasks(const ff_comp& comp) {
+    unsigned long long tasks = 0;
+    for (const comp_thread_stats& st : comp.get_thread_stats()) tasks += st.tasks;
+    return tasks;
+}
+
+int main() {
+    const int n = 1000, nthreads = 4;
+    Incr incr;
+    Doub doub;
+    ff_comp comp;
+    comp.add_stage(&incr);
+    comp.add_stage(&doub);
+    comp.set_reentrant(true);
+
+    cout << "Executing concurrent run test..." << endl;
+    vector<vector<int> > values(nthreads, vector<int>(n));
+    vector<thread> threads;
+    for (int t=0; t<nthreads; ++t)
+        threads.push_back(thread([&, t]() {
+            for (int i=0; i<n; ++i) {
+                values[t][i] = i;
+                assert(comp.run(&values[t][i]) == &values[t][i]);
+            }
+            vector<void*> tasks;
+            for (int i=0; i<n; ++i) tasks.push_back(&values[t][i]);
+            assert(comp.run_batch(tasks.data(), n) == 0);
+        }));
+    for (thread& th : threads) th.join();
+    for (const vector<int>& v : values)
+        for (int i=0; i<n; ++i) assert(v[i] == 2*(2*i+2)+2);
+    vector<comp_thread_stats> stats = comp.get_thread_stats();
+    assert(stats.size() == (size_t) nthreads);
+    double sum = 0;
+    for (const comp_thread_stats& st : stats) {
+        assert(st.tasks == 2ULL*n);
+        sum += st.time_ms;
+    }
+    assert(fabs(comp.ff_time() - sum) < 1e-6);
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+
+    cout << "Executing shared comp farm test..." << endl;
+    vector<unique_ptr<ff_comp_worker> > workers;
+    vector<ff_node*> nodes;
+    for (int w=0; w<nthreads; ++w) {
+        workers.push_back(unique_ptr<ff_comp_worker>(new ff_comp_worker(comp)));
+        nodes.push_back(workers.back().get());
+    }
+    ff_comp_farm farm(nodes, true);
+    Source source(n);
+    Drain drain;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&farm);
+    pipe.add_stage(&drain);
+    assert(pipe.run_and_wait_end() == 0);
+    assert(drain.data.size() == (size_t) n);
+    for (int i=0; i<n; ++i) assert(drain.data[i] == 2*(i+1)+2);
+    assert(incr.inits == 1 && incr.ends == 1);
+    assert(comp.get_thread_stats().size() == (size_t) 2*nthreads);
+    assert(total_tasks(comp) == (unsigned long long) 2*nthreads*n + n);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Replicate test:
+ *  Comp(Incr, Count) built from stage factories and replicated for the 4 workers of Pipe(Source, CompFarm(4 x Comp), Drain)
+ *  over the stream [1, ..., n], then Comp(Comp(Incr), Count) replicated with its nested comp
+ *  Expected Incr(x) = x+1 for every x in the stream order, every replica with stages of its own built by the thread that
+ *  runs it, the tasks counted by the replicas adding up to n, the stages deleted with their replica, a comp with a stage
+ *  added without a factory replicated only when it's reentrant (the stage is shared, initialized and finalized once by
+ *  the replicas running into a farm, the replicas themselves are not reentrant and the stages of the comp that only the
+ *  replicas rebuild are never initialized) and the replicas built by the caller when asked to
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../compfarm.hpp"
+
+using namespace std;
+using namespace ff;
+
+atomic<int> alive(0);
+
+struct Incr : ff_node {
+    Incr() { ++alive; }
+    ~Incr() { --alive; }
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+// stateful stage: it counts its tasks and remembers the thread that built it
+struct Count : ff_node {
+    const thread::id builder;
+    thread::id runner;
+    size_t count = 0;
+    int inits = 0;
+    Count() : builder(this_thread::get_id()) { ++alive; }
+    ~Count() { --alive; }
+    int svc_init() { ++inits; return 0; }
+    void* svc(void *t){
+        runner = this_thread::get_id();
+        ++count;
+        return t;
+    }
+};
+
+// stage shared by the replicas, it counts its svc_init and svc_end calls
+struct Shared : Incr {
+    atomic<int> inits, ends;
+    Shared() : inits(0), ends(0) { }
+    int svc_init() { ++inits; return 0; }
+    void svc_end() { ++ends; }
+};
+
+struct Source : ff_node {
+    int counter;
+    const int n;
+    Source(int n) : n(n) { }
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+vector<ff_node*> nodes(const vector<unique_ptr<ff_node> >& replicas) {
+    vector<ff_node*> n;
+    for (const unique_ptr<ff_node>& r : replicas) n.push_back(r.get());
+    return n;
+}
+
+Count *counter(ff_node *replica) { return (Count*) ((ff_comp*) replica)->get_stages().back(); }
+
+int main() {
+    const int n = 1000, nw = 4;
+    ff_comp prototype;
+    prototype.add_stage([]() { return new Incr(); });
+    prototype.add_stage([]() { return new Count(); });
+    assert(alive == 2 && prototype.get_stages().size() == 2);
+
+    cout << "Executing replicated comp farm test..." << endl;
+    {
+        vector<unique_ptr<ff_node> > replicas = prototype.replicate(nw);
+        assert(replicas.size() == (size_t) nw && alive == 2);
+        ff_comp_farm farm(nodes(replicas), true);
+        Source source(n);
+        Drain drain;
+        ff_pipeline pipe;
+        pipe.add_stage(&source);
+        pipe.add_stage(&farm);
+        pipe.add_stage(&drain);
+        assert(pipe.run_and_wait_end() == 0);
+        assert(alive == 2 + 2*nw);
+        for (int i=0; i<n; ++i) assert(drain.data[i] == i+2);
+        size_t total = 0;
+        for (size_t r=0; r<replicas.size(); ++r) {
+            const svector<ff_node *>& stages = ((ff_comp*) replicas[r].get())->get_stages();
+            assert(stages.size() == 2 && stages[0] != prototype.get_stages()[0]);
+            for (size_t o=0; o<r; ++o) assert(counter(replicas[o].get()) != counter(replicas[r].get()));
+            Count *c = counter(replicas[r].get());
+            assert(c->builder != this_thread::get_id());
+            if (c->count) assert(c->builder == c->runner);
+            total += c->count;
+        }
+        assert(total == (size_t) n && ((Count*) prototype.get_stages()[1])->count == 0);
+    }
+    assert(alive == 2);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing nested comp replicate test..." << endl;
+    {
+        ff_comp inner, outer;
+        inner.add_stage([]() { return new Incr(); });
+        outer.add_stage(&inner);
+        outer.add_stage([]() { return new Count(); });
+        vector<unique_ptr<ff_node> > replicas = outer.replicate(2, false); // built here
+        assert(replicas.size() == 2 && alive == 2 + 2 + 2*2);
+        ff_comp *r = (ff_comp*) replicas[1].get();
+        assert(r->get_stages().size() == 2 && r->get_stages()[0] != inner.get_stages()[0]);
+        int x = 1;
+        assert(r->run(&x) == &x && x == 2 && counter(r)->count == 1 && counter(r)->builder == this_thread::get_id());
+    }
+    assert(alive == 2);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing shared stage replicate test..." << endl;
+    Shared shared;
+    ff_comp mixed;
+    mixed.add_stage(&shared);
+    mixed.add_stage([]() { return new Count(); });
+    assert(mixed.replicate(2).empty()); // Incr would be shared by two comps running at once
+    mixed.set_reentrant(true);
+    {
+        vector<unique_ptr<ff_node> > replicas = mixed.replicate(2, false);
+        assert(replicas.size() == 2);
+        for (const unique_ptr<ff_node>& r : replicas) assert(((ff_comp*) r.get())->get_stages()[0] == &shared);
+        assert(counter(replicas[0].get()) != counter(replicas[1].get()));
+    }
+    {
+        vector<unique_ptr<ff_node> > replicas = mixed.replicate(nw);
+        ff_comp_farm farm(nodes(replicas), true);
+        Source source(n);
+        Drain drain;
+        ff_pipeline pipe;
+        pipe.add_stage(&source);
+        pipe.add_stage(&farm);
+        pipe.add_stage(&drain);
+        assert(pipe.run_and_wait_end() == 0);
+        for (int i=0; i<n; ++i) assert(drain.data[i] == i+2);
+        assert(shared.inits == 1 && shared.ends == 1 && counter(&mixed)->inits == 0);
+        for (const unique_ptr<ff_node>& r : replicas)
+            assert(!((ff_comp*) r.get())->is_reentrant() && counter(r.get())->inits == 1);
+    }
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Rows test:
+ *  Running a comp of image stages row by row with run_rows
+ *  Comp(VSmooth, HDiff, VBox) applied to a random image of 2 channels with padded rows, every stage provides svc_row, expected
+ *  the same image that the comp computes stage by stage on whole images with run (the padding of the rows untouched),
+ *  then the same comp with a stage that doesn't provide svc_row and an image with fewer rows than a radius, that both go
+ *  through run
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Image {
+    size_t rows, cols, channels, stride;
+    vector<int> data;
+    Image(size_t rows, size_t cols, size_t channels, size_t padding) :
+        rows(rows), cols(cols), channels(channels), stride(cols*channels+padding), data(rows*stride) { }
+    int *row(long y) { // reflected as ff_row_stage does, then clamped (images with fewer rows than a radius)
+        if (y < 0) y = -y;
+        if (y >= (long) rows) y = 2*(long) rows-2-y;
+        return &data[min(max(y, 0L), (long) rows-1)*stride];
+    }
+};
+
+// whole image svc built on svc_row, so that both ways compute the same values
+template<typename Stage>
+void *whole(Stage& stage, void *t) {
+    Image *img = (Image*) t;
+    Image out = *img;
+    const long r = (long) stage.row_radius();
+    vector<const int*> in(2*r+1);
+    for (long y=0; y<(long) img->rows; ++y) {
+        for (long k=-r; k<=r; ++k) in[k+r] = img->row(y+k);
+        stage.svc_row(in.data(), out.row(y), img->cols, img->channels);
+    }
+    img->data = out.data;
+    return t;
+}
+
+struct VSmooth : ff_node, ff_row_stage<int> {
+    size_t row_radius() const { return 1; }
+    void svc_row(const int* const* in, int *out, size_t cols, size_t channels) {
+        for (size_t x=0; x<cols*channels; ++x) out[x] = in[0][x] + 2*in[1][x] + in[2][x];
+    }
+    void *svc(void *t) { return whole(*this, t); }
+};
+
+struct HDiff : ff_node, ff_row_stage<int> {
+    size_t row_radius() const { return 0; }
+    void svc_row(const int* const* in, int *out, size_t cols, size_t channels) {
+        const size_t w = cols*channels;
+        for (size_t x=0; x<w; ++x)
+            out[x] = (x < channels || x >= w-channels) ? 0 : in[0][x+channels] - in[0][x-channels];
+    }
+    void *svc(void *t) { return whole(*this, t); }
+};
+
+struct VBox : ff_node, ff_row_stage<int> {
+    size_t calls = 0;
+    size_t row_radius() const { return 3; }
+    void svc_row(const int* const* in, int *out, size_t cols, size_t channels) {
+        for (size_t x=0; x<cols*channels; ++x) {
+            out[x] = 0;
+            for (size_t k=0; k<7; ++k) out[x] += in[k][x] * (int) (k+1);
+        }
+    }
+    void *svc(void *t) { calls++; return whole(*this, t); }
+};
+
+// same as VSmooth, without the row entry point
+struct PlainSmooth : ff_node {
+    VSmooth impl;
+    size_t calls = 0;
+    void *svc(void *t) { calls++; return impl.svc(t); }
+};
+
+Image random_image(size_t rows, size_t cols, size_t channels, size_t padding) {
+    Image img(rows, cols, channels, padding);
+    for (int& v : img.data) v = rand() % 256;
+    return img;
+}
+
+bool same_as_run(ff_comp& rows_comp, ff_comp& run_comp, Image img) {
+    Image expected = img;
+    run_comp.run(&expected);
+    void *r = rows_comp.run_rows(&img, img.data.data(), img.rows, img.cols, img.channels, img.stride);
+    return r == &img && img.data == expected.data;
+}
+
+int main() {
+    srand(7);
+    VSmooth s1, s2;
+    HDiff d1, d2;
+    VBox b1, b2;
+    ff_comp streamed, whole_image;
+    streamed.add_stage(&s1);
+    streamed.add_stage(&d1);
+    streamed.add_stage(&b1);
+    whole_image.add_stage(&s2);
+    whole_image.add_stage(&d2);
+    whole_image.add_stage(&b2);
+
+    cout << "Executing row streaming test..." << endl;
+    assert(same_as_run(streamed, whole_image, random_image(57, 31, 2, 5)));
+    assert(same_as_run(streamed, whole_image, random_image(4, 9, 3, 0))); // every row is near a border
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing whole image fallback test..." << endl;
+    PlainSmooth plain;
+    HDiff d3;
+    VBox b3;
+    ff_comp mixed;
+    mixed.add_stage(&plain);
+    mixed.add_stage(&d3);
+    mixed.add_stage(&b3);
+    assert(same_as_run(mixed, whole_image, random_image(20, 10, 1, 3)));
+    assert(plain.calls == 1);
+    VBox b4, b5;
+    ff_comp tiny, tiny_whole;
+    tiny.add_stage(&b4);
+    tiny_whole.add_stage(&b5);
+    assert(same_as_run(tiny, tiny_whole, random_image(3, 6, 1, 0))); // VBox reads 3 rows around a row, they can't be reflected
+    assert(b4.calls == 1);
+    cout << "-> PASSED" << endl;
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Vectorized sine and cosine used by the batch stages of the benchmarks. Every kernel applies sin (or cos) `runs` times to
+ *  each value of an array, in place, keeping the values into the vector registers between two applications.
+ *  The algorithm is the one of the Cephes library (reduction by pi/4 in three parts and degree 13/14 polynomials), it's
+ *  accurate to a couple of ulps for |x| < 2^30 but its results are not bit identical to the ones of libm.
+ *  The AVX2 and AVX-512 versions are compiled with target attributes and chosen at runtime from the features of the cpu,
+ *  so the program can still be compiled without -mavx2 / -mavx512f and run on any x86-64 machine.
+ *
+*/
+
+#ifndef SIMD_TRIG_HPP
+#define SIMD_TRIG_HPP
+
+#include <cmath>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_TRIG_X86
+#endif
+
+namespace simd_trig {
+
+    enum isa { SCALAR, AVX2, AVX512 };
+
+    static const double FOPI = 1.27323954473516268615; // 4/pi
+    static const double DP1 = 7.85398125648498535156E-1;
+    static const double DP2 = 3.77489470793079817668E-8;
+    static const double DP3 = 2.69515142907905952645E-15;
+    static const double S0 = 1.58962301576546568060E-10, S1 = -2.50507477628578072866E-8, S2 = 2.75573136213857245213E-6,
+                        S3 = -1.98412698295895385996E-4, S4 = 8.33333333332211858878E-3, S5 = -1.66666666666666307295E-1;
+    static const double C0 = -1.13585365213876817300E-11, C1 = 2.08757008419747316778E-9, C2 = -2.75573141792967388112E-7,
+                        C3 = 2.48015872888517045348E-5, C4 = -1.38888888888730564116E-3, C5 = 4.16666666666665929218E-2;
+
+    // scalar version of the kernel, used for the tails of the arrays and when the cpu has no vector extension
+    inline double sin_cos(double x, bool cosine) {
+        double sign = 1;
+        if (x < 0) {
+            x = -x;
+            if (!cosine) sign = -1;
+        }
+        double q = std::floor(x * FOPI);
+        q += q - 2*std::floor(q*0.5); // odd octants are moved to the next one, q is even
+        const double j = q - 8*std::floor(q*0.125); // 0, 2, 4 or 6
+        const double z = ((x - q*DP1) - q*DP2) - q*DP3;
+        const double zz = z*z;
+        const double ps = z + z*zz*((((((S0*zz + S1)*zz + S2)*zz + S3)*zz + S4)*zz + S5));
+        const double pc = 1.0 - 0.5*zz + zz*zz*((((((C0*zz + C1)*zz + C2)*zz + C3)*zz + C4)*zz + C5));
+        const bool swap = (j == 2 || j == 6);
+        if (cosine) {
+            if (j == 2 || j == 4) sign = -sign;
+            return sign * (swap ? ps : pc);
+        }
+        if (j >= 4) sign = -sign;
+        return sign * (swap ? pc : ps);
+    }
+
+    inline void apply_scalar(double *data, size_t n, unsigned long runs, bool cosine) {
+        for (size_t i=0; i<n; ++i) {
+            double v = data[i];
+            for (unsigned long r=0; r<runs; ++r) v = sin_cos(v, cosine);
+            data[i] = v;
+        }
+    }
+
+#ifdef SIMD_TRIG_X86
+
+    __attribute__((target("avx2,fma")))
+    inline __m256d sin_cos_avx2(__m256d x, bool cosine) {
+        const __m256d sgn = _mm256_set1_pd(-0.0);
+        const __m256d ax = _mm256_andnot_pd(sgn, x);
+        __m256d q = _mm256_floor_pd(_mm256_mul_pd(ax, _mm256_set1_pd(FOPI)));
+        q = _mm256_add_pd(q, _mm256_fnmadd_pd(_mm256_set1_pd(2.0), _mm256_floor_pd(_mm256_mul_pd(q, _mm256_set1_pd(0.5))), q));
+        const __m256d j = _mm256_fnmadd_pd(_mm256_set1_pd(8.0), _mm256_floor_pd(_mm256_mul_pd(q, _mm256_set1_pd(0.125))), q);
+        __m256d z = _mm256_fnmadd_pd(q, _mm256_set1_pd(DP1), ax);
+        z = _mm256_fnmadd_pd(q, _mm256_set1_pd(DP2), z);
+        z = _mm256_fnmadd_pd(q, _mm256_set1_pd(DP3), z);
+        const __m256d zz = _mm256_mul_pd(z, z);
+        __m256d ps = _mm256_fmadd_pd(_mm256_set1_pd(S0), zz, _mm256_set1_pd(S1));
+        ps = _mm256_fmadd_pd(ps, zz, _mm256_set1_pd(S2));
+        ps = _mm256_fmadd_pd(ps, zz, _mm256_set1_pd(S3));
+        ps = _mm256_fmadd_pd(ps, zz, _mm256_set1_pd(S4));
+        ps = _mm256_fmadd_pd(ps, zz, _mm256_set1_pd(S5));
+        ps = _mm256_fmadd_pd(_mm256_mul_pd(z, zz), ps, z);
+        __m256d pc = _mm256_fmadd_pd(_mm256_set1_pd(C0), zz, _mm256_set1_pd(C1));
+        pc = _mm256_fmadd_pd(pc, zz, _mm256_set1_pd(C2));
+        pc = _mm256_fmadd_pd(pc, zz, _mm256_set1_pd(C3));
+        pc = _mm256_fmadd_pd(pc, zz, _mm256_set1_pd(C4));
+        pc = _mm256_fmadd_pd(pc, zz, _mm256_set1_pd(C5));
+        pc = _mm256_fmadd_pd(_mm256_mul_pd(zz, zz), pc, _mm256_fnmadd_pd(_mm256_set1_pd(0.5), zz, _mm256_set1_pd(1.0)));
+        const __m256d j2 = _mm256_cmp_pd(j, _mm256_set1_pd(2.0), _CMP_EQ_OQ);
+        const __m256d j4 = _mm256_cmp_pd(j, _mm256_set1_pd(4.0), _CMP_EQ_OQ);
+        const __m256d j6 = _mm256_cmp_pd(j, _mm256_set1_pd(6.0), _CMP_EQ_OQ);
+        const __m256d swap = _mm256_or_pd(j2, j6);
+        if (cosine) {
+            const __m256d r = _mm256_blendv_pd(pc, ps, swap);
+            return _mm256_xor_pd(r, _mm256_and_pd(_mm256_or_pd(j2, j4), sgn));
+        }
+        const __m256d r = _mm256_blendv_pd(ps, pc, swap);
+        const __m256d flip = _mm256_and_pd(_mm256_or_pd(j4, j6), sgn);
+        return _mm256_xor_pd(r, _mm256_xor_pd(flip, _mm256_and_pd(x, sgn)));
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline void apply_avx2(double *data, size_t n, unsigned long runs, bool cosine) {
+        size_t i = 0;
+        for (; i+4<=n; i+=4) {
+            __m256d v = _mm256_loadu_pd(data+i);
+            for (unsigned long r=0; r<runs; ++r) v = sin_cos_avx2(v, cosine);
+            _mm256_storeu_pd(data+i, v);
+        }
+        apply_scalar(data+i, n-i, runs, cosine);
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d sin_cos_avx512(__m512d x, bool cosine) {
+        const __m512d ax = _mm512_abs_pd(x);
+        const int down = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC; // rounding of floor
+        const __mmask8 all = 0xff; // zero masking, the unmasked form trips -Wmaybe-uninitialized on g++ 12
+        __m512d q = _mm512_maskz_roundscale_pd(all, _mm512_mul_pd(ax, _mm512_set1_pd(FOPI)), down);
+        q = _mm512_add_pd(q, _mm512_fnmadd_pd(_mm512_set1_pd(2.0), _mm512_maskz_roundscale_pd(all, _mm512_mul_pd(q, _mm512_set1_pd(0.5)), down), q));
+        const __m512d j = _mm512_fnmadd_pd(_mm512_set1_pd(8.0), _mm512_maskz_roundscale_pd(all, _mm512_mul_pd(q, _mm512_set1_pd(0.125)), down), q);
+        __m512d z = _mm512_fnmadd_pd(q, _mm512_set1_pd(DP1), ax);
+        z = _mm512_fnmadd_pd(q, _mm512_set1_pd(DP2), z);
+        z = _mm512_fnmadd_pd(q, _mm512_set1_pd(DP3), z);
+        const __m512d zz = _mm512_mul_pd(z, z);
+        __m512d ps = _mm512_fmadd_pd(_mm512_set1_pd(S0), zz, _mm512_set1_pd(S1));
+        ps = _mm512_fmadd_pd(ps, zz, _mm512_set1_pd(S2));
+        ps = _mm512_fmadd_pd(ps, zz, _mm512_set1_pd(S3));
+        ps = _mm512_fmadd_pd(ps, zz, _mm512_set1_pd(S4));
+        ps = _mm512_fmadd_pd(ps, zz, _mm512_set1_pd(S5));
+        ps = _mm512_fmadd_pd(_mm512_mul_pd(z, zz), ps, z);
+        __m512d pc = _mm512_fmadd_pd(_mm512_set1_pd(C0), zz, _mm512_set1_pd(C1));
+        pc = _mm512_fmadd_pd(pc, zz, _mm512_set1_pd(C2));
+        pc = _mm512_fmadd_pd(pc, zz, _mm512_set1_pd(C3));
+        pc = _mm512_fmadd_pd(pc, zz, _mm512_set1_pd(C4));
+        pc = _mm512_fmadd_pd(pc, zz, _mm512_set1_pd(C5));
+        pc = _mm512_fmadd_pd(_mm512_mul_pd(zz, zz), pc, _mm512_fnmadd_pd(_mm512_set1_pd(0.5), zz, _mm512_set1_pd(1.0)));
+        const __mmask8 j2 = _mm512_cmp_pd_mask(j, _mm512_set1_pd(2.0), _CMP_EQ_OQ);
+        const __mmask8 j4 = _mm512_cmp_pd_mask(j, _mm512_set1_pd(4.0), _CMP_EQ_OQ);
+        const __mmask8 j6 = _mm512_cmp_pd_mask(j, _mm512_set1_pd(6.0), _CMP_EQ_OQ);
+        const __mmask8 swap = j2 | j6;
+        const __m512d zero = _mm512_setzero_pd();
+        if (cosine) {
+            const __m512d r = _mm512_mask_blend_pd(swap, pc, ps);
+            return _mm512_mask_sub_pd(r, j2 | j4, zero, r);
+        }
+        const __m512d r = _mm512_mask_blend_pd(swap, ps, pc);
+        const __mmask8 negative = _mm512_cmp_pd_mask(x, zero, _CMP_LT_OQ);
+        return _mm512_mask_sub_pd(r, (j4 | j6) ^ negative, zero, r);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void apply_avx512(double *data, size_t n, unsigned long runs, bool cosine) {
+        size_t i = 0;
+        for (; i+8<=n; i+=8) {
+            __m512d v = _mm512_loadu_pd(data+i);
+            for (unsigned long r=0; r<runs; ++r) v = sin_cos_avx512(v, cosine);
+            _mm512_storeu_pd(data+i, v);
+        }
+        apply_scalar(data+i, n-i, runs, cosine);
+    }
+
+#endif
+
+    // widest instruction set supported by this cpu (and by the operating system)
+    inline isa detect() {
+#ifdef SIMD_TRIG_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+#endif
+        return SCALAR;
+    }
+
+    inline const char *isa_name(isa i) {
+        switch (i) {
+        case AVX512: return "AVX-512";
+        case AVX2: return "AVX2";
+        default: return "scalar";
+        }
+    }
+
+    // applies sin (or cos) runs times to every value of data, with the given instruction set (it must be supported)
+    inline void apply(isa i, double *data, size_t n, unsigned long runs, bool cosine) {
+#ifdef SIMD_TRIG_X86
+        if (i == AVX512) return apply_avx512(data, n, runs, cosine);
+        if (i == AVX2) return apply_avx2(data, n, runs, cosine);
+#endif
+        apply_scalar(data, n, runs, cosine);
+    }
+
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Span test:
+ *  Running a comp over a contiguous array of values with run_span
+ *  Comp(Incr, Doub, Incr) applied to [0, 1, ..., n-1], first with stages that all provide svc_batch and then with a stage
+ *  that doesn't (every value goes through svc), expected 2x+3 for every x in both cases
+ *  The vectorized sin/cos kernels used by the benchmark are checked against libm for every instruction set of this cpu
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+#include "simd_trig.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node, ff_batch_stage<int> {
+    size_t batches = 0;
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+    void svc_batch(int *data, size_t n) {
+        batches++;
+        for (size_t i=0; i<n; ++i) data[i]+=1;
+    }
+};
+
+struct Doub : ff_node, ff_batch_stage<int> {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+    void svc_batch(int *data, size_t n) {
+        for (size_t i=0; i<n; ++i) data[i]*=2;
+    }
+};
+
+struct ScalarDoub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+bool check_span(ff_comp& comp, size_t n) {
+    vector<int> values(n);
+    for (size_t i=0; i<n; ++i) values[i] = (int) i;
+    if (comp.run_span(values.data(), n)<0) return false;
+    for (size_t i=0; i<n; ++i)
+        if (values[i] != 2*((int)i)+3) return false;
+    return true;
+}
+
+bool check_trig(simd_trig::isa isa, bool cosine) {
+    vector<double> values(1003); // not a multiple of the vector width, the tail is computed by the scalar kernel
+    for (size_t i=0; i<values.size(); ++i) values[i] = -10.0 + 20.0*i/values.size();
+    vector<double> expected(values);
+    simd_trig::apply(isa, values.data(), values.size(), 3, cosine);
+    for (size_t i=0; i<values.size(); ++i) {
+        for (int r=0; r<3; ++r) expected[i] = cosine ? cos(expected[i]) : sin(expected[i]);
+        if (fabs(values[i]-expected[i]) > 1e-14) return false;
+    }
+    return true;
+}
+
+int main() {
+    Incr incr1, incr2;
+    Doub doub;
+    ScalarDoub sdoub;
+    ff_comp comp, mixed;
+    comp.add_stage(&incr1);
+    comp.add_stage(&doub);
+    comp.add_stage(&incr2);
+    comp.set_batch_grain(7); // not a divisor of the span size, the last chunk is a partial one
+    cout << "Executing span test with batch stages..." << endl;
+    assert(check_span(comp, 1000));
+    assert(incr1.batches == (1000+6)/7);
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    mixed.add_stage(&incr1);
+    mixed.add_stage(&sdoub);
+    mixed.add_stage(&incr2);
+    mixed.set_batch_grain(7);
+    incr1.batches = 0;
+    cout << "Executing span test with a scalar stage..." << endl;
+    assert(check_span(mixed, 1000));
+    assert(incr1.batches == 0);
+    cout << "-> PASSED [Elapsed time: " << mixed.ff_time() << "(ms)]" << endl;
+    const simd_trig::isa best = simd_trig::detect();
+    for (int i=simd_trig::SCALAR; i<=best; ++i) {
+        const simd_trig::isa isa = (simd_trig::isa) i;
+        cout << "Executing " << simd_trig::isa_name(isa) << " sin/cos test..." << endl;
+        assert(check_trig(isa, false));
+        assert(check_trig(isa, true));
+        cout << "-> PASSED" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Stream test:
+ *  FastFlow stream semantics inside a comp, both standalone and as a pipeline stage
+ *  Comp(Filter, Tiler, Incr) where Filter drops the odd values (GO_ON), Tiler sends out three copies of every value and
+ *  Incr counts its calls
+ *  Expected 3 outputs Incr(x) for every even x, no call of Incr for the odd ones, svc_init/svc_end called on every stage
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Lifecycle : ff_node {
+    int inits = 0, ends = 0;
+    int svc_init() { ++inits; return 0; }
+    void svc_end() { ++ends; }
+};
+
+struct Filter : Lifecycle {
+    void* svc(void *t) {
+        if (*((int*)t)%2) {
+            delete (int*) t;
+            return GO_ON;
+        }
+        return t;
+    }
+};
+
+struct Tiler : Lifecycle {
+    void* svc(void *t) {
+        int value = *((int*)t);
+        delete (int*) t;
+        for (int i=0; i<3; ++i) ff_send_out(new int(value));
+        return GO_ON;
+    }
+};
+
+struct Incr : Lifecycle {
+    int calls = 0;
+    void* svc(void *t) {
+        ++calls;
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+struct Stop : ff_node {
+    void* svc(void *t) { return (*((int*)t)<0) ? EOS : t; }
+};
+
+struct Source : ff_node {
+    int counter;
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>4) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) { 
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+// collects what leaves a standalone comp through ff_send_out
+bool collect(void *t, unsigned long, unsigned long, void *arg) {
+    ((vector<int>*) arg)->push_back(*((int*)t));
+    delete (int*) t;
+    return true;
+}
+
+struct TypedFilter : ff_node_t<int> {
+    int* svc(int *t) { return (*t%2) ? GO_ON : t; }
+};
+
+struct TypedTiler : ff_node_t<int> {
+    int* svc(int *t) {
+        ff_send_out(new int(*t));
+        return t;
+    }
+};
+
+int main() {
+    {
+        cout << "Executing stream test on a standalone comp..." << endl;
+        Filter filter;
+        Tiler tiler;
+        Incr incr;
+        Stop stop;
+        ff_comp comp;
+        vector<int> out;
+        comp.add_stage(&stop);
+        comp.add_stage(&filter);
+        comp.add_stage(&tiler);
+        comp.add_stage(&incr);
+        comp.registerCallback(collect, &out);
+        assert(comp.run(new int(3))==GO_ON);
+        assert(incr.calls==0 && out.empty());
+        assert(comp.run(new int(4))==GO_ON);
+        assert(incr.calls==3 && out.size()==3);
+        for (int v : out) assert(v==5);
+        int minus = -1;
+        assert(comp.run(&minus)==EOS);
+        assert(incr.calls==3);
+        cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    }
+    {
+        cout << "Executing stream test within a pipeline..." << endl;
+        Source source;
+        Filter filter;
+        Tiler tiler;
+        Incr incr;
+        Drain drain;
+        ff_comp comp;
+        ff_pipeline pipe;
+        comp.add_stage(&filter);
+        comp.add_stage(&tiler);
+        comp.add_stage(&incr);
+        pipe.add_stage(&source);
+        pipe.add_stage(&comp);
+        pipe.add_stage(&drain);
+        if (pipe.run_and_wait_end()<0) {
+            error("running pipeline\n");
+            return EXIT_FAILURE;
+        }
+        assert(filter.inits==1 && tiler.inits==1 && incr.inits==1);
+        assert(filter.ends==1 && tiler.ends==1 && incr.ends==1);
+        assert(incr.calls==6 && drain.data.size()==6); // 2 and 4 pass the filter
+        for (size_t i=0; i<drain.data.size(); ++i) assert(drain.data[i]==(i<3 ? 3 : 5));
+        cout << "-> PASSED [Elapsed time: " << pipe.ffTime() << "(ms)]" << endl;
+    }
+    {
+        cout << "Executing stream test on a typed comp..." << endl;
+        ff_comp_t<TypedFilter, TypedTiler> comp;
+        vector<int> out;
+        comp.registerCallback(collect, &out);
+        int odd = 1, even = 2;
+        assert((void*) comp.run(&odd)==GO_ON);
+        assert(out.empty());
+        assert(comp.run(&even)==&even);
+        assert(out.size()==1 && out[0]==2);
+        cout << "-> PASSED" << endl;
+    }
+    return EXIT_SUCCESS;
+}
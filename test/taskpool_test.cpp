@@ -0,0 +1,124 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Task pool test:
+ *  Recycling the tasks of a pipeline through a task pool
+ *  Pipe(Source, Comp(Incr, Doub), Drain) where Source draws its tasks from the pool and Drain gives them back
+ *  Source doesn't let more than window tasks into the pipeline, so the tasks created by the pool are bounded by the window
+ *  (plus what the caches hold) and not by the stream length
+ *  Expected Doub(Incr(x)) for every x, a bounded number of tasks and every task back into the pool at the end
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../comp.hpp"
+#include "../taskpool.hpp"
+
+using namespace std;
+using namespace ff;
+
+const size_t slab = 8, window = 16;
+ff_task_pool<int> pool(slab);
+atomic<size_t> recycled(0); // tasks given back by Drain
+
+struct Source : ff_node {
+    int counter;
+    size_t issued;
+    ff_task_pool<int>::cache tasks;
+    Source(): tasks(pool, 4) { }
+    int svc_init() {
+        counter = 0;
+        issued = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>1000) return EOS;
+        while (issued - recycled.load() >= window) this_thread::yield();
+        ++issued;
+        int *t = tasks.get();
+        *t = counter;
+        return t;
+    }
+};
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    } 
+};
+
+struct Doub : ff_node {
+    void* svc(void *t){
+        *((int*)t)*=2;
+        return t;
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    ff_task_pool<int>::cache tasks;
+    Drain(): tasks(pool, 4) { }
+    void *svc(void *t) { 
+        data.push_back(*((int*)t));
+        tasks.put((int*) t);
+        recycled++;
+        return GO_ON;
+    }
+};
+
+int main() {
+    cout << "Executing task pool test within a pipeline..." << endl;
+    {
+        Source source;
+        Incr incr;
+        Doub doub;
+        Drain drain;
+        ff_comp comp;
+        ff_pipeline pipe;
+        comp.add_stage(&incr);
+        comp.add_stage(&doub);
+        pipe.add_stage(&source);
+        pipe.add_stage(&comp);
+        pipe.add_stage(&drain);
+        if (pipe.run_and_wait_end()<0) {
+            error("running pipeline\n");
+            return EXIT_FAILURE;
+        }
+        assert(drain.data.size()==1000);
+        for (size_t i=0; i<drain.data.size(); ++i) assert(drain.data[i]==((int)i+2)*2);
+    }
+    // the pool grows only when a cache of Source can't be refilled (3 tasks): the tasks in flight, the ones held by the
+    // cache of Drain (4) and less than a refill are out of the pool at that time
+    assert(pool.tasks()<=window+4+3+slab);
+    assert(pool.free_tasks()==pool.tasks()); // the caches are flushed when Source and Drain are destroyed
+    cout << "-> PASSED [" << pool.tasks() << " tasks, " << pool.heap_allocations() << " heap allocations]" << endl;
+    cout << "Executing task pool test with concurrent caches..." << endl;
+    vector<thread> threads;
+    for (int i=0; i<4; ++i)
+        threads.push_back(thread([]() {
+            ff_task_pool<int>::cache tasks(pool, 16);
+            vector<int*> mine;
+            for (int round=0; round<100; ++round) {
+                for (int j=0; j<32; ++j) {
+                    mine.push_back(tasks.get());
+                    *mine.back() = j;
+                }
+                for (int j=0; j<32; ++j) assert(*mine[j]==j);
+                for (int *t : mine) tasks.put(t);
+                mine.clear();
+            }
+        }));
+    for (thread& t : threads) t.join();
+    // every thread has at most 32 tasks in use and 16 into its cache, a refill takes 9 tasks
+    assert(pool.tasks()<=4*(32+16)+9+slab);
+    assert(pool.free_tasks()==pool.tasks());
+    cout << "-> PASSED [" << pool.tasks() << " tasks, " << pool.heap_allocations() << " heap allocations]" << endl;
+    return EXIT_SUCCESS;
+}
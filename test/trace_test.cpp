@@ -0,0 +1,67 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Trace test:
+ *  Collecting per stage statistics of a comp compiled with TRACE_FF_COMP
+ *  Comp(Incr, Slow) where Slow sleeps for a while, run on single tasks and on a batch
+ *  Expected one call per task for each stage, Slow must dominate the service time
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#define TRACE_FF_COMP
+
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node {
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    } 
+};
+
+struct Slow : ff_node {
+    void* svc(void *t){
+        this_thread::sleep_for(chrono::microseconds(200));
+        return t;
+    }
+};
+
+int main() {
+    Incr incr;
+    Slow slow;
+    ff_comp comp;
+    comp.add_stage(&incr);
+    comp.add_stage(&slow);
+    cout << "Executing trace test on single tasks..." << endl;
+    int foo = 0;
+    for (int i=0; i<10; ++i) comp.run(&foo);
+    assert(foo==10);
+    comp_stage_stats incr_stats = comp.get_stage_stats(0), slow_stats = comp.get_stage_stats(1);
+    assert(incr_stats.calls==10 && slow_stats.calls==10);
+    assert(slow_stats.min_ns>=200000 && slow_stats.min_ns<=slow_stats.max_ns);
+    assert(slow_stats.total_ns>incr_stats.total_ns);
+    unsigned long long hist_calls = 0;
+    for (size_t b=0; b<comp_stage_stats::buckets; ++b) hist_calls += slow_stats.hist[b];
+    assert(hist_calls==slow_stats.calls);
+    cout << "-> PASSED" << endl;
+    cout << "Executing trace test on a batch..." << endl;
+    comp.reset_stats();
+    vector<int> values(20, 0);
+    vector<void*> tasks;
+    for (int& v : values) tasks.push_back(&v);
+    assert(comp.run_batch(tasks.data(), tasks.size(), COMP_STAGE_MAJOR)==0);
+    assert(comp.get_stage_stats(0).calls==20 && comp.get_stage_stats(1).calls==20);
+    assert(comp.get_stage_stats(1).min_ns>=200000);
+    comp.print_stats(cout);
+    cout << "-> PASSED [Elapsed time: " << comp.ff_time() << "(ms)]" << endl;
+    return EXIT_SUCCESS;
+}
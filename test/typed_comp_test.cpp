@@ -0,0 +1,124 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ * 
+ *  Typed comp test:
+ *  Composing typed nodes and callables with ff_comp_t, both as a plain function and as a pipeline stage
+ *  Comp(Incr, Doub, Square) where Incr and Doub are ff_node_t<int> and Square is a functor
+ *  Expected Square(Doub(Incr(x))) where x is the input
+ *  A copied and a moved comp forward what their stages send out with ff_send_out through their own stages and callback
+ *  Note: chains with mismatching types (ex. ff_comp_t<Incr, ToDouble, Incr>) are rejected by the compiler
+ * 
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "../comp.hpp"
+
+using namespace std;
+using namespace ff;
+
+struct Incr : ff_node_t<int> {
+    int* svc(int *t) {
+        *t+=1;
+        return t;
+    }
+};
+
+struct Doub : ff_node_t<int> {
+    int* svc(int *t) {
+        *t*=2;
+        return t;
+    }
+};
+
+struct Square {
+    int* operator()(int *t) const {
+        *t*=*t;
+        return t;
+    }
+};
+
+// sends out a copy of its task before returning it
+struct Dup : ff_node_t<int> {
+    int* svc(int *t) {
+        ff_send_out(new int(*t));
+        return t;
+    }
+};
+
+vector<int> sent;
+bool collect(void *t, unsigned long, unsigned long, void *) {
+    sent.push_back(*((int*)t));
+    delete (int*) t;
+    return true;
+}
+
+double half(int x) { return x/2.0; }
+
+struct Source : ff_node_t<int> {
+    int counter;
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    int *svc(int *) {
+        if (++counter>3) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node_t<int> {
+    vector<int> data;
+    int *svc(int *t) {
+        data.push_back(*t);
+        delete t;
+        return GO_ON;
+    }
+};
+
+int main() {
+    ff_comp_t<Incr, Doub, Square> comp;
+    static_assert(decltype(comp)::cardinality()==3, "wrong number of stages");
+    cout << "Executing typed comp test with input..." << endl;
+    int foo = 2;
+    assert(*comp.run(&foo)==36);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing typed comp test with values, lambdas and function pointers..." << endl;
+    auto incr = [](int x) { return x+1; };
+    ff_comp_t<decltype(incr), double(*)(int)> value_comp(incr, half);
+    assert(value_comp(4)==2.5);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing copied and moved typed comp test..." << endl;
+    ff_comp_t<Dup, Doub> original;
+    ff_comp_t<Dup, Doub> copy(original);
+    copy.registerCallback(collect, nullptr);
+    int bar = 3;
+    assert(*copy.run(&bar)==6 && sent.size()==1 && sent[0]==6);
+    ff_comp_t<Dup, Doub> moved(std::move(copy));
+    moved.registerCallback(collect, nullptr);
+    bar = 5;
+    assert(*moved.run(&bar)==10 && sent.size()==2 && sent[1]==10);
+    cout << "-> PASSED" << endl;
+
+    cout << "Executing typed comp test within a pipeline..." << endl;
+    Source source;
+    Drain drain;
+    ff_comp_t<Incr, Doub> inner;
+    ff_pipeline pipe;
+    pipe.add_stage(&source);
+    pipe.add_stage(&inner);
+    pipe.add_stage(&drain);
+    if (pipe.run_and_wait_end()<0) {
+        error("running pipeline\n");
+        return EXIT_FAILURE;
+    }
+    assert(drain.data.size()==3);
+    for (size_t i=0; i<drain.data.size(); ++i) assert(drain.data[i]==((int)i+2)*2);
+    cout << "-> PASSED [Elapsed time: " << pipe.ffTime() << "(ms)]" << endl;
+    return EXIT_SUCCESS;
+}
@@ -113,6 +113,12 @@ if [ $farm_flag -eq 1 ]; then
     printf "Running the optional farm test with pipeline branches\n"
     ./bin/ffvideofarm "$video" "2"
     printf "\n"
+    printf "Running the optional farm test with comp branches and irregular frames\n"
+    ./bin/ffvideofarm "$video" "0" -i 16
+    printf "\n"
+    printf "Running the optional farm test with work stealing comp branches and irregular frames\n"
+    ./bin/ffvideofarm "$video" "6" -i 16
+    printf "\n"
 fi    
 
 # printing average, min & max of comp test
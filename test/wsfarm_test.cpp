@@ -0,0 +1,113 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  Work stealing farm test:
+ *  Pipe(Source, WSFarm(4 x Comp(Incr, Gate)), Drain) over the stream [1, ..., n], the replicas built by replicate from
+ *  stage factories. The Gate of the first worker holds the first task it computes until all the other tasks have been
+ *  computed, so the tasks dealt to the first worker behind it can only be computed by the other workers stealing them
+ *  Expected Incr(x) = x+1 for every x, in the stream order for the ordered farm and as a permutation of it otherwise
+ *  (with a capacity smaller than the number of workers), svc_init/svc_end called once on the stages of every replica, a
+ *  single task computed by the first worker and at least the other n/4-1 tasks dealt to it stolen
+ *
+ *  Tested with valgrind http://valgrind.org/info/about.html
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../wsfarm.hpp"
+
+using namespace std;
+using namespace ff;
+
+const int n = 200, nw = 4;
+
+struct Incr : ff_node {
+    int inits = 0, ends = 0;
+    int svc_init() { ++inits; return 0; }
+    void svc_end() { ++ends; }
+    void* svc(void *t){
+        *((int*)t)+=1;
+        return t;
+    }
+};
+
+// the gate of the first replica (id 0, the replicas are built in order) holds its first task until the gates of the other
+// replicas have let all the other tasks go
+atomic<int> gates(0), passed(0);
+struct Gate : ff_node {
+    const int id;
+    bool held = false;
+    Gate() : id(gates++ % nw) { }
+    void* svc(void *t){
+        if (id == 0 && !held) {
+            held = true;
+            while (passed < n-1) this_thread::yield();
+        } else ++passed;
+        return t;
+    }
+};
+
+struct Source : ff_node {
+    int counter;
+    int svc_init() {
+        counter = 0;
+        return 0;
+    }
+    void *svc(void *) {
+        if (++counter>n) return EOS;
+        return new int(counter);
+    }
+};
+
+struct Drain : ff_node {
+    vector<int> data;
+    void *svc(void *t) {
+        data.push_back(*((int*)t));
+        delete (int*) t;
+        return GO_ON;
+    }
+};
+
+int main() {
+    ff_comp prototype;
+    prototype.add_stage([]() { return new Incr(); });
+    prototype.add_stage([]() { return new Gate(); });
+    vector<int> expected;
+    for (int i=1; i<=n; ++i) expected.push_back(i+1);
+
+    for (int ordered=1; ordered>=0; --ordered) {
+        cout << "Executing " << (ordered ? "ordered" : "unordered") << " work stealing farm test..." << endl;
+        gates = passed = 0;
+        vector<unique_ptr<ff_node> > replicas = prototype.replicate(nw, false);
+        vector<ff_node*> workers;
+        for (unique_ptr<ff_node>& r : replicas) workers.push_back(r.get());
+        ff_comp_wsfarm farm(workers, ordered);
+        // the ordered farm keeps the results behind the held task, so it must take the whole stream
+        farm.set_capacity(ordered ? n : 3);
+        Source source;
+        Drain drain;
+        ff_pipeline pipe;
+        pipe.add_stage(&source);
+        pipe.add_stage(&farm);
+        pipe.add_stage(&drain);
+        assert(pipe.run_and_wait_end() == 0);
+        if (!ordered) sort(drain.data.begin(), drain.data.end());
+        assert(drain.data == expected);
+        for (unique_ptr<ff_node>& r : replicas) {
+            Incr *incr = (Incr*) ((ff_comp*) r.get())->get_stages()[0];
+            assert(incr->inits == 1 && incr->ends == 1);
+        }
+        size_t tasks = 0;
+        for (size_t i=0; i<nw; ++i) tasks += farm.get_worker_tasks(i);
+        assert(tasks == (size_t) n && farm.get_worker_tasks(0) == 1);
+        assert(farm.get_steals() >= (size_t) n/nw - 1 && farm.get_steals(0) <= 1);
+        cout << "-> PASSED (" << farm.get_steals() << " steals)" << endl;
+    }
+    return 0;
+}
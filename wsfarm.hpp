@@ -0,0 +1,148 @@
+/*
+ *  Author: Daniele Paolini, daniele.paolini@hotmail.it
+ *
+ *  This file implements a work stealing farm of comps, for tasks whose cost changes from one to another.
+ *  ff_comp_wsfarm shares the core of ff_comp_farm (ff_comp_farm_base, see compfarm.hpp) but every worker has a queue of
+ *  its own: the farm deals the tasks it receives round robin to the queues and a worker that finds its queue empty steals
+ *  from the longest one, so a worker stuck on an expensive task doesn't keep the tasks dealt to it waiting while the
+ *  others are idle. Workers with nothing to compute or steal block on a condition variable, they don't spin.
+ *
+*/
+
+/* ***************************************************************************
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ ****************************************************************************
+ */
+
+#ifndef FF_WSFARM_HPP
+#define FF_WSFARM_HPP
+
+#include "compfarm.hpp"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ff {
+
+    class ff_comp_wsfarm: public ff_comp_farm_base {
+
+    private:
+        // tasks dealt to a worker, the owner and the thieves take the oldest one (the one an ordered farm is waiting for),
+        // the padding keeps the queues of two workers and their counters on different cache lines
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<entry> tasks;
+            std::atomic<size_t> size;   // read by the thieves to choose a victim without taking its lock
+            size_t steals;              // written by the worker only
+            char pad[64];
+            worker_queue() : size(0), steals(0) { }
+        };
+        std::unique_ptr<worker_queue[]> queues;
+        size_t queued;                      // tasks into all the queues (or about to be), lock held
+        size_t next_worker;
+
+        bool pop(size_t id, entry& e);
+        bool steal(size_t id, entry& e);
+
+    protected:
+        void dispatch(size_t seq, void *task);
+        bool next_task(size_t id, entry& e);
+        void reset();
+
+    public:
+         // one worker thread and one queue per replica
+        ff_comp_wsfarm(const std::vector<ff_node *>& replicas, bool ordered=false);
+        ~ff_comp_wsfarm() { stop(); }
+         // tasks stolen from the other queues by the worker id, to be read at the end of the stream
+        size_t get_steals(size_t id) const { return queues[id].steals; }
+        size_t get_steals() const {
+            size_t steals = 0;
+            for (size_t i=0; i<replicas.size(); ++i) steals += queues[i].steals;
+            return steals;
+        }
+
+    };
+
+    inline ff_comp_wsfarm::ff_comp_wsfarm(const std::vector<ff_node *>& replicas, bool ordered) :
+        ff_comp_farm_base(replicas, ordered), queues(new worker_queue[replicas.size()]), queued(0), next_worker(0) { }
+
+    inline bool ff_comp_wsfarm::pop(size_t id, entry& e) {
+        worker_queue& q = queues[id];
+        std::unique_lock<std::mutex> l(q.lock);
+        if (q.tasks.empty()) return false;
+        e = q.tasks.front();
+        q.tasks.pop_front();
+        q.size--;
+        return true;
+    }
+
+    // takes the oldest task of the longest queue, a queue emptied by its owner in the meantime makes it look again
+    inline bool ff_comp_wsfarm::steal(size_t id, entry& e) {
+        for (size_t attempt=0; attempt<replicas.size(); ++attempt) {
+            size_t victim = id, longest = 0;
+            for (size_t i=0; i<replicas.size(); ++i) {
+                const size_t s = queues[i].size.load(std::memory_order_relaxed);
+                if (i != id && s > longest) {
+                    victim = i;
+                    longest = s;
+                }
+            }
+            if (victim == id) return false;
+            if (pop(victim, e)) {
+                queues[id].steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void ff_comp_wsfarm::dispatch(size_t seq, void *task) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            queued++; // before the task is into the queue, so a worker can't take it before it's counted
+        }
+        worker_queue& q = queues[next_worker];
+        {
+            std::unique_lock<std::mutex> l(q.lock);
+            q.tasks.push_back({ seq, task });
+            q.size++;
+        }
+        next_worker = (next_worker + 1) % replicas.size();
+        work_cv.notify_one();
+    }
+
+    inline bool ff_comp_wsfarm::next_task(size_t id, entry& e) {
+        for (;;) {
+            if (pop(id, e) || steal(id, e)) {
+                std::unique_lock<std::mutex> l(lock);
+                queued--;
+                return true;
+            }
+            std::unique_lock<std::mutex> l(lock);
+            work_cv.wait(l, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0) return false;
+            // a task has been dealt, to this worker or to another one
+        }
+    }
+
+    inline void ff_comp_wsfarm::reset() {
+        for (size_t i=0; i<replicas.size(); ++i) queues[i].steals = 0;
+        queued = next_worker = 0;
+    }
+
+}
+
+#endif